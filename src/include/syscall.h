@@ -1,13 +1,103 @@
 #ifndef SYSCALL_H
 #define SYSCALL_H
 
+#include <stdint-gcc.h>
+
 #define YIELD_SYS_CALL 0
 #define GETC_SYS_CALL 1
 #define PUTC_SYS_CALL 2
+#define OPEN_SYS_CALL 3
+#define READ_SYS_CALL 4
+#define LSEEK_SYS_CALL 5
+#define CLOSE_SYS_CALL 6
+#define MMAP_SYS_CALL 7
+#define SENDFILE_SYS_CALL 8
+#define READV_SYS_CALL 9
+#define WRITEV_SYS_CALL 10
+#define IO_RING_SETUP_SYS_CALL 11
+#define IO_RING_ENTER_SYS_CALL 12
+#define MUNMAP_SYS_CALL 13
+
+// lseek whence values
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+// sendfile destinations besides open files
+#define SENDFILE_SERIAL -2
+#define SENDFILE_CONSOLE -3     // Screen and serial, like putc
+
+// One buffer of readv / writev
+typedef struct iovec {
+    void *iov_base;
+    uint64_t iov_len;
+} iovec_t;
+
+#define IOV_MAX 64
+#define IO_CURSOR -1            // Offset meaning the file's cursor
+
+// io ring operations
+#define IO_OP_NOP 0
+#define IO_OP_READ 1
+#define IO_OP_WRITE 2
+
+// io_ring_setup flags
+#define IO_RING_SQPOLL 1        // A kernel thread drains submissions without io_ring_enter
+
+// io ring flags, set by the kernel
+#define IO_RING_NEED_WAKEUP 1   // The poller went to sleep, io_ring_enter(IO_ENTER_WAKEUP) restarts it
+
+// io_ring_enter flags
+#define IO_ENTER_WAKEUP 1
+
+#define IO_RING_MAX_ENTRIES 256
+
+// A request, written by the process at sq_tail
+typedef struct io_sqe {
+    uint8_t op;
+    uint8_t reserved[3];
+    int32_t fd;
+    uint64_t addr;              // User buffer
+    uint64_t len;
+    int64_t offset;             // Offset in the file, or IO_CURSOR
+    uint64_t user_data;         // Passed back in the completion
+} io_sqe_t;
+
+// A result, written by the kernel at cq_tail
+typedef struct io_cqe {
+    uint64_t user_data;
+    int64_t res;                // Bytes moved, or -1
+} io_cqe_t;
+
+// Shared between a process and the kernel, followed by entries SQEs then entries CQEs
+// Heads and tails only increase, an entry's slot is its index modulo entries
+typedef struct io_ring {
+    volatile uint32_t sq_head;  // Advanced by the kernel as it takes requests
+    volatile uint32_t sq_tail;  // Advanced by the process as it queues requests
+    volatile uint32_t cq_head;  // Advanced by the process as it reaps results
+    volatile uint32_t cq_tail;  // Advanced by the kernel as it posts results
+    uint32_t entries;           // A power of two
+    volatile uint32_t flags;
+} io_ring_t;
+
+#define IO_RING_SQES(ring) ((io_sqe_t *)((io_ring_t *)(ring) + 1))
+#define IO_RING_CQES(ring) ((io_cqe_t *)(IO_RING_SQES(ring) + (ring)->entries))
+#define IO_RING_SIZE(entries) (sizeof(io_ring_t) + (entries) * (sizeof(io_sqe_t) + sizeof(io_cqe_t)))
 
 extern void yield(void);
 extern void kexit(void);
 extern char getc(void);
 extern void putc(char);
+extern int open(const char *path);
+extern int read(int fd, void *buf, int len);
+extern long lseek(int fd, long offset, int whence);
+extern int close(int fd);
+extern void *mmap(int fd, void *addr);
+extern long sendfile(int out_fd, int in_fd, long len);
+extern long readv(int fd, const iovec_t *iov, int count);
+extern long writev(int fd, const iovec_t *iov, int count);
+extern int io_ring_setup(io_ring_t *ring, int entries, int flags);
+extern int io_ring_enter(int flags);
+extern int munmap(void *addr);
 
 #endif
\ No newline at end of file
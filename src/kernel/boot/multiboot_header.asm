@@ -7,6 +7,11 @@ header_start:
     ; checksum
     dd 0x100000000 - (0xe85250d6 + 0 + (header_end - header_start))
 
+    ; module alignment tag, modules start on page boundaries
+    dw 6    ; type
+    dw 0    ; flags
+    dd 8    ; size
+
     ; required end tag
     dw 0    ; type
     dw 0    ; flags
@@ -0,0 +1,555 @@
+#include "ahci.h"
+#include <stddef.h>
+#include "pci.h"
+#include "irq.h"
+#include "proc.h"
+#include "printk.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "pf_alloc.h"
+#include "page_table.h"
+#include "ll_generic.h"
+
+#define AHCI_PROG_IF 0x01
+#define ABAR 5
+#define NUM_PORTS 32
+#define SECTOR_SIZE 512
+
+// HBA Global Host Control bits
+#define GHC_HR 0x1              // HBA reset
+#define GHC_IE 0x2              // Interrupt enable
+#define GHC_AE 0x80000000       // AHCI enable
+
+// HBA Capabilities bits
+#define CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define CAP_SNCQ 0x40000000
+
+// Port Command bits
+#define PORT_CMD_ST 0x1         // Start
+#define PORT_CMD_FRE 0x10       // FIS receive enable
+#define PORT_CMD_FR 0x4000      // FIS receive running
+#define PORT_CMD_CR 0x8000      // Command list running
+
+// Port Interrupt bits
+#define PORT_INT_DHRS 0x1       // Device to host register FIS
+#define PORT_INT_PSS 0x2        // PIO setup FIS
+#define PORT_INT_DSS 0x4        // DMA setup FIS
+#define PORT_INT_SDBS 0x8       // Set device bits FIS (NCQ completion)
+#define PORT_INT_ERRORS 0x78000010
+#define PORT_INT_MASK (PORT_INT_DHRS | PORT_INT_PSS | PORT_INT_DSS | PORT_INT_SDBS | PORT_INT_ERRORS)
+
+// Port status values
+#define SSTS_DET_PRESENT 0x3
+#define SSTS_IPM_ACTIVE 0x1
+#define SIG_ATA 0x00000101
+#define TFD_BSY 0x80
+#define TFD_DRQ 0x08
+
+// FIS values
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_COMMAND 0x80
+#define FIS_DEV_LBA 0x40
+
+// ATA Commands
+#define CMD_IDENTIFY 0xEC
+#define CMD_READ_DMA_EXT 0x25
+#define CMD_READ_FPDMA_QUEUED 0x60
+#define CMD_WRITE_DMA_EXT 0x35
+#define CMD_WRITE_FPDMA_QUEUED 0x61
+#define CMD_FLUSH_CACHE_EXT 0xEA
+
+// Command header flags
+#define CMD_HEADER_WRITE (1 << 6)   // Host to device data
+
+// Memory layout
+#define FIS_AREA_OFFSET 1024
+#define PRDT_ENTRIES 16
+#define PRDT_MAX_BYTES 0x400000
+#define MAX_CMD_SECTORS ((PRDT_ENTRIES - 1) * PAGE_SIZE / SECTOR_SIZE)
+#define CMD_TABLE_PAGES ((AHCI_NUM_SLOTS * sizeof(AHCI_cmd_table_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+struct AHCI_port_regs {
+    uint32_t clb;
+    uint32_t clbu;
+    uint32_t fb;
+    uint32_t fbu;
+    uint32_t is;
+    uint32_t ie;
+    uint32_t cmd;
+    uint32_t rsv0;
+    uint32_t tfd;
+    uint32_t sig;
+    uint32_t ssts;
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact;
+    uint32_t ci;
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t rsv1[11];
+    uint32_t vendor[4];
+} __attribute__((packed));
+
+typedef struct AHCI_hba_regs {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is;
+    uint32_t pi;
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_ports;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t rsv[0xD4];
+    AHCI_port_regs_t ports[NUM_PORTS];
+} __attribute__((packed)) AHCI_hba_regs_t;
+
+struct AHCI_cmd_header {
+    uint16_t flags;         // FIS length in dwords, direction, etc.
+    uint16_t prdtl;         // Number of PRDT entries
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t rsv[4];
+} __attribute__((packed));
+
+typedef struct AHCI_prdt_entry {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t rsv;
+    uint32_t dbc;           // Byte count - 1
+} __attribute__((packed)) AHCI_prdt_entry_t;
+
+struct AHCI_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t rsv[48];
+    AHCI_prdt_entry_t prdt[PRDT_ENTRIES];
+} __attribute__((packed));
+
+typedef struct FIS_reg_h2d {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t command;
+    uint8_t featurel;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t featureh;
+    uint8_t countl;
+    uint8_t counth;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t rsv[4];
+} __attribute__((packed)) FIS_reg_h2d_t;
+
+typedef struct AHCI_controller {
+    volatile AHCI_hba_regs_t *hba;
+    AHCI_block_dev_t *ports[NUM_PORTS];
+} AHCI_controller_t;
+
+static AHCI_block_dev_t *head, *tail;
+static int num_disks;
+
+static inline uint32_t min(uint32_t a, uint32_t b) {
+    return (a < b) ? a : b;
+}
+
+static inline uint32_t slot_mask(AHCI_block_dev_t *dev) {
+    return (dev->queue_depth == AHCI_NUM_SLOTS) ? 0xFFFFFFFF : (1U << dev->queue_depth) - 1;
+}
+
+static void stop_port(volatile AHCI_port_regs_t *regs) {
+    regs->cmd &= ~PORT_CMD_ST;
+    while (regs->cmd & PORT_CMD_CR);
+    regs->cmd &= ~PORT_CMD_FRE;
+    while (regs->cmd & PORT_CMD_FR);
+}
+
+static void start_port(volatile AHCI_port_regs_t *regs) {
+    while (regs->cmd & PORT_CMD_CR);
+    regs->cmd |= PORT_CMD_FRE;
+    while (regs->tfd & (TFD_BSY | TFD_DRQ));
+    regs->cmd |= PORT_CMD_ST;
+}
+
+// Fills a command table's PRDT with the physical segments backing a buffer
+// Returns the number of entries, or -1 if the buffer needs too many
+static int build_prdt(AHCI_cmd_table_t *table, uint8_t *buff, uint32_t len) {
+    virtual_addr_t vaddr = (virtual_addr_t)buff;
+    physical_addr_t phys, seg_end = 0;
+    uint32_t len_here;
+    int n = 0;
+
+    while (len > 0) {
+        len_here = min(len, PAGE_SIZE - (vaddr & (PAGE_SIZE - 1)));
+        if ((phys = MMU_virt_to_phys(vaddr)) == 0) return -1;
+
+        if (n > 0 && seg_end == phys && table->prdt[n - 1].dbc + 1 + len_here <= PRDT_MAX_BYTES) {
+            // Physically contiguous with the previous entry, extend it
+            table->prdt[n - 1].dbc += len_here;
+        } else {
+            if (n >= PRDT_ENTRIES) return -1;
+            table->prdt[n].dba = phys & 0xFFFFFFFF;
+            table->prdt[n].dbau = phys >> 32;
+            table->prdt[n].rsv = 0;
+            table->prdt[n].dbc = len_here - 1;
+            n++;
+        }
+
+        seg_end = phys + len_here;
+        vaddr += len_here;
+        len -= len_here;
+    }
+
+    return n;
+}
+
+// Reserves a free command slot, sleeping while every slot is in use
+static int alloc_slot(AHCI_block_dev_t *dev) {
+    int slot;
+
+    wait_event_or_halt(&dev->blocked, (dev->slots_busy & slot_mask(dev)) == slot_mask(dev));
+
+    for (slot = 0; slot < dev->queue_depth; slot++) {
+        if (!(dev->slots_busy & (1U << slot))) break;
+    }
+
+    dev->slots_busy |= (1U << slot);
+    return slot;
+}
+
+static void free_slot(AHCI_block_dev_t *dev, int slot) {
+    dev->slots_busy &= ~(1U << slot);
+    PROC_unblock_all(&dev->blocked);
+}
+
+// Issues a command into a free slot and sleeps until it completes, dst is NULL for commands without data
+// Queued commands from other threads may be outstanding in the other slots
+// A non-queued command can't overlap queued ones, so with NCQ it waits for them to finish and holds off new ones
+// Returns 1 on success, -1 on failure
+static int issue_command(AHCI_block_dev_t *dev, uint8_t command, uint64_t lba, uint32_t count, void *dst) {
+    int slot = alloc_slot(dev), prdtl, failed;
+    uint32_t bit = 1U << slot, len = (count == 0) ? SECTOR_SIZE : count * SECTOR_SIZE;
+    AHCI_cmd_header_t *header = &dev->cmd_list[slot];
+    AHCI_cmd_table_t *table = &dev->cmd_tables[slot];
+    FIS_reg_h2d_t *fis = (FIS_reg_h2d_t *)table->cfis;
+    bool queued = (command == CMD_READ_FPDMA_QUEUED || command == CMD_WRITE_FPDMA_QUEUED);
+    bool write = (command == CMD_WRITE_DMA_EXT || command == CMD_WRITE_FPDMA_QUEUED);
+    uint16_t int_en;
+
+    if (dst == NULL) {
+        prdtl = 0;
+    } else if ((prdtl = build_prdt(table, (uint8_t *)dst, len)) == -1) {
+        printk("AHCI_transfer(): Failed to build PRDT\n");
+        free_slot(dev, slot);
+        return -1;
+    }
+
+    memset(fis, 0, sizeof(FIS_reg_h2d_t));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_COMMAND;
+    fis->command = command;
+    fis->device = FIS_DEV_LBA;
+    fis->lba0 = lba & 0xFF;
+    fis->lba1 = (lba >> 8) & 0xFF;
+    fis->lba2 = (lba >> 16) & 0xFF;
+    fis->lba3 = (lba >> 24) & 0xFF;
+    fis->lba4 = (lba >> 32) & 0xFF;
+    fis->lba5 = (lba >> 40) & 0xFF;
+
+    if (queued) {
+        // Queued commands carry the count in features and the tag in count
+        fis->featurel = count & 0xFF;
+        fis->featureh = (count >> 8) & 0xFF;
+        fis->countl = slot << 3;
+    } else {
+        fis->countl = count & 0xFF;
+        fis->counth = (count >> 8) & 0xFF;
+    }
+
+    header->flags = sizeof(FIS_reg_h2d_t) / 4 | (write ? CMD_HEADER_WRITE : 0);
+    header->prdtl = prdtl;
+    header->prdbc = 0;
+
+    if (dev->ncq) {
+        wait_event_or_halt(&dev->blocked, dev->exclusive || (!queued && dev->slots_issued != 0));
+        if (!queued) dev->exclusive = true;
+    }
+
+    // Hand the slot to the HBA
+    int_en = check_int();
+    if (int_en) CLI;
+    dev->slots_issued |= bit;
+    if (queued) dev->regs->sact = bit;
+    dev->regs->ci = bit;
+    if (int_en) STI;
+
+    wait_event_or_halt(&dev->blocked, dev->slots_issued & bit);
+
+    failed = dev->slots_failed & bit;
+    dev->slots_failed &= ~bit;
+    if (!queued) dev->exclusive = false;
+    free_slot(dev, slot);
+
+    if (failed) {
+        printk("AHCI_transfer(): Command 0x%x failed on %s\n", command, dev->dev.name);
+        return -1;
+    }
+
+    return 1;
+}
+
+// Reads count contiguous blocks into dst
+// Returns 1 on success, -1 on failure
+int AHCI_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst) {
+    AHCI_block_dev_t *ahci_dev = (AHCI_block_dev_t *)dev;
+    uint8_t command = ahci_dev->ncq ? CMD_READ_FPDMA_QUEUED : CMD_READ_DMA_EXT;
+    uint8_t *buff = (uint8_t *)dst;
+    uint32_t n;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("AHCI_read_blocks(): Tried to read past end of drive\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        n = min(count, MAX_CMD_SECTORS);
+        if (issue_command(ahci_dev, command, blk_num, n, buff) == -1) return -1;
+
+        blk_num += n;
+        count -= n;
+        buff += n * SECTOR_SIZE;
+    }
+
+    return 1;
+}
+
+// Writes count contiguous blocks from src, returning once the drive has flushed them
+// Returns 1 on success, -1 on failure
+int AHCI_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src) {
+    AHCI_block_dev_t *ahci_dev = (AHCI_block_dev_t *)dev;
+    uint8_t command = ahci_dev->ncq ? CMD_WRITE_FPDMA_QUEUED : CMD_WRITE_DMA_EXT;
+    uint8_t *buff = (uint8_t *)src;
+    uint32_t n;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("AHCI_write_blocks(): Tried to write past end of drive\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        n = min(count, MAX_CMD_SECTORS);
+        if (issue_command(ahci_dev, command, blk_num, n, buff) == -1) return -1;
+
+        blk_num += n;
+        count -= n;
+        buff += n * SECTOR_SIZE;
+    }
+
+    // Commit the drive's write cache, so a sync means the data is on the media
+    return issue_command(ahci_dev, CMD_FLUSH_CACHE_EXT, 0, 0, NULL);
+}
+
+int AHCI_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
+    return AHCI_read_blocks(dev, blk_num, 1, dst);
+}
+
+// Completes the commands the port has finished
+static void port_isr(AHCI_block_dev_t *dev) {
+    uint32_t status = dev->regs->is, done;
+
+    dev->regs->is = status;
+
+    if (status & PORT_INT_ERRORS) {
+        // An error aborts every outstanding command, fail them all and restart
+        printk("AHCI: port %d error, is: %x, tfd: %x\n", dev->port, status, dev->regs->tfd);
+        dev->slots_failed |= dev->slots_issued;
+        dev->slots_issued = 0;
+        stop_port(dev->regs);
+        dev->regs->serr = 0xFFFFFFFF;
+        dev->regs->is = 0xFFFFFFFF;
+        start_port(dev->regs);
+    } else {
+        // Queued commands clear their SACT bit, others their CI bit
+        done = dev->slots_issued & ~(dev->regs->sact | dev->regs->ci);
+        dev->slots_issued &= ~done;
+    }
+
+    PROC_unblock_all(&dev->blocked);
+}
+
+void AHCI_isr(uint8_t irq, uint32_t error_code, void *arg) {
+    AHCI_controller_t *ctrl = (AHCI_controller_t *)arg;
+    uint32_t pending = ctrl->hba->is;
+    int i;
+
+    for (i = 0; i < NUM_PORTS; i++) {
+        if ((pending & (1U << i)) && ctrl->ports[i] != NULL) {
+            port_isr(ctrl->ports[i]);
+        }
+    }
+
+    ctrl->hba->is = pending;
+    IRQ_end_of_interrupt(irq);
+}
+
+// Identifies the drive on a port, and determines capacity and NCQ depth
+// Returns 1 on success, -1 on failure
+static int identify(AHCI_block_dev_t *dev, uint32_t cap) {
+    uint16_t *data = (uint16_t *)kmalloc(SECTOR_SIZE);
+
+    if (issue_command(dev, CMD_IDENTIFY, 0, 0, data) == -1) {
+        kfree(data);
+        return -1;
+    }
+
+    // Ensure drive supports LBA48
+    if ((data[83] & 0x400) == 0) {
+        printb("ahci_identify(): Device doesn't support LBA48 mode\n");
+        kfree(data);
+        return -1;
+    }
+
+    dev->dev.tot_len = 0;
+    dev->dev.tot_len |= (uint64_t) data[100] << 0;
+    dev->dev.tot_len |= (uint64_t) data[101] << 16;
+    dev->dev.tot_len |= (uint64_t) data[102] << 32;
+    dev->dev.tot_len |= (uint64_t) data[103] << 48;
+
+    // Word 76 bit 8 is NCQ support, word 75 is the drive's queue depth - 1
+    dev->ncq = (cap & CAP_SNCQ) && (data[76] & 0x100);
+    dev->queue_depth = dev->ncq ? min(CAP_NCS(cap), (data[75] & 0x1F) + 1) : 1;
+
+    kfree(data);
+    return 1;
+}
+
+// Brings up a port with an attached SATA drive and registers it as a block device
+static AHCI_block_dev_t *init_port(AHCI_controller_t *ctrl, int port) {
+    volatile AHCI_port_regs_t *regs = &ctrl->hba->ports[port];
+    AHCI_block_dev_t *dev;
+    physical_addr_t cl_phys, tables_phys, table;
+    char *name;
+    int slot;
+
+    if ((regs->ssts & 0xF) != SSTS_DET_PRESENT || ((regs->ssts >> 8) & 0xF) != SSTS_IPM_ACTIVE) {
+        return NULL;
+    }
+
+    if (regs->sig != SIG_ATA) {
+        printb("ahci_init_port(): Port %d is not a SATA drive\n", port);
+        return NULL;
+    }
+
+    stop_port(regs);
+
+    // Command list and received FIS area share a frame, command tables follow
+    cl_phys = MMU_pf_alloc_contig(1);
+    tables_phys = MMU_pf_alloc_contig(CMD_TABLE_PAGES);
+    memset((void *)GET_VIRT_ADDR(cl_phys), 0, PAGE_SIZE);
+    memset((void *)GET_VIRT_ADDR(tables_phys), 0, CMD_TABLE_PAGES * PAGE_SIZE);
+
+    dev = (AHCI_block_dev_t *)kcalloc(1, sizeof(AHCI_block_dev_t));
+    dev->regs = regs;
+    dev->port = port;
+    dev->queue_depth = 1;
+    dev->cmd_list = (AHCI_cmd_header_t *)GET_VIRT_ADDR(cl_phys);
+    dev->cmd_tables = (AHCI_cmd_table_t *)GET_VIRT_ADDR(tables_phys);
+    PROC_init_queue(&dev->blocked);
+
+    for (slot = 0; slot < AHCI_NUM_SLOTS; slot++) {
+        table = tables_phys + slot * sizeof(AHCI_cmd_table_t);
+        dev->cmd_list[slot].ctba = table & 0xFFFFFFFF;
+        dev->cmd_list[slot].ctbau = table >> 32;
+    }
+
+    regs->clb = cl_phys & 0xFFFFFFFF;
+    regs->clbu = cl_phys >> 32;
+    regs->fb = (cl_phys + FIS_AREA_OFFSET) & 0xFFFFFFFF;
+    regs->fbu = (cl_phys + FIS_AREA_OFFSET) >> 32;
+    regs->serr = 0xFFFFFFFF;
+    regs->is = 0xFFFFFFFF;
+    regs->ie = PORT_INT_MASK;
+
+    ctrl->ports[port] = dev;
+    start_port(regs);
+
+    if (identify(dev, ctrl->hba->cap) == -1) {
+        printb("ahci_init_port(): Failed to identify drive on port %d\n", port);
+        ctrl->ports[port] = NULL;
+        stop_port(regs);
+        return NULL;
+    }
+
+    // Name the disk sataN
+    name = (char *)kmalloc(6);
+    memcpy(name, "sata", 4);
+    name[4] = (char)('0' + num_disks++);
+    name[5] = '\0';
+
+    dev->dev.read_block = AHCI_read_block;
+    dev->dev.read_blocks = AHCI_read_blocks;
+    dev->dev.write_blocks = AHCI_write_blocks;
+    dev->dev.blk_size = SECTOR_SIZE;
+    dev->dev.type = MASS_STORAGE;
+    dev->dev.name = name;
+    dev->dev.next = NULL;
+
+    printb("Identified SATA drive (%s) on AHCI port %d, NCQ depth %d\n", name, port, dev->queue_depth);
+
+    BLK_register(&dev->dev);
+    LL_APPEND(head, tail, dev);
+
+    return dev;
+}
+
+static void init_controller(pci_dev_t *pci) {
+    AHCI_controller_t *ctrl = (AHCI_controller_t *)kcalloc(1, sizeof(AHCI_controller_t));
+    uint8_t irq = PCI_IRQ(pci->irq_line);
+    uint32_t implemented;
+    int i;
+
+    ctrl->hba = (AHCI_hba_regs_t *)MMU_map_mmio(PCI_bar_addr(pci, ABAR), sizeof(AHCI_hba_regs_t));
+    PCI_enable_bus_master(pci);
+
+    // Reset the HBA, then switch it into AHCI mode
+    ctrl->hba->ghc |= GHC_AE;
+    ctrl->hba->ghc |= GHC_HR;
+    while (ctrl->hba->ghc & GHC_HR);
+    ctrl->hba->ghc |= GHC_AE;
+
+    // Completions arrive on the controller's legacy interrupt line
+    IRQ_set_handler(irq, AHCI_isr, ctrl);
+    ctrl->hba->is = 0xFFFFFFFF;
+    ctrl->hba->ghc |= GHC_IE;
+    IRQ_clear_mask(irq);
+
+    implemented = ctrl->hba->pi;
+    for (i = 0; i < NUM_PORTS; i++) {
+        if (implemented & (1U << i)) {
+            init_port(ctrl, i);
+        }
+    }
+}
+
+// Initializes every AHCI controller and registers their SATA drives
+// Returns the first drive found, or NULL if there are none
+AHCI_block_dev_t *AHCI_probe(void) {
+    pci_dev_t *pci = NULL;
+
+    while ((pci = PCI_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, pci)) != NULL) {
+        if (pci->prog_if == AHCI_PROG_IF) {
+            printb("Found AHCI controller %x:%x\n", pci->vendor_id, pci->device_id);
+            init_controller(pci);
+        }
+    }
+
+    return head;
+}
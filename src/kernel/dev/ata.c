@@ -5,6 +5,12 @@
 #include "kmalloc.h"
 #include "memdef.h"
 #include "error.h"
+#include "string.h"
+#include "irq.h"
+#include "proc.h"
+#include "pci.h"
+#include "pf_alloc.h"
+#include "page_table.h"
 
 // PIO Registers
 #define DATA_REG(base) base + 0         // R/W (16 bit)
@@ -21,20 +27,46 @@
 #define DEV_CTRL_REG(base) base + 0x206
 #define DEV_ADDR_REG(base) base + 0x207
 
+// Bus Master IDE Registers (offset from BAR4, secondary channel at +8)
+#define BM_CMD_REG(base) base + 0
+#define BM_STAT_REG(base) base + 2
+#define BM_PRDT_REG(base) base + 4
+#define BM_SECONDARY_OFFSET 8
+#define BM_BAR 4
+
 // Register bits
 #define DEV_CTRL_NIEN 0x2
 #define STAT_DRQ (1 << 3)
 #define STAT_BSY (1 << 7)
 #define STAT_ERR 1
 
+#define BM_CMD_START 0x1
+#define BM_CMD_READ 0x8     // Device to memory
+#define BM_STAT_ERR 0x2
+#define BM_STAT_IRQ 0x4
+#define PROG_IF_BUS_MASTER 0x80
+#define PRD_EOT 0x8000
+
 // Values
 #define FLOATING_BUS 0xFF
+#define SECTOR_SIZE 512
+#define PRD_WINDOW 0x10000  // A PRD segment must not cross a 64K boundary
+#define PRD_TABLE_ENTRIES (PAGE_SIZE / sizeof(ATA_prd_t))
+#define BOUNCE_PAGES 16
+#define MAX_DMA_SECTORS (BOUNCE_PAGES * PAGE_SIZE / SECTOR_SIZE)
+#define DMA_LIMIT 0x100000000   // PRDs hold 32 bit addresses
 
 // Commands
 #define CMD_SELECT_MASTER 0xA0
 #define CMD_SELECT_SLAVE 0xB0
 #define CMD_IDENTIFY 0xEC
 #define CMD_READ_SECTORS_EXT 0x24
+#define CMD_READ_DMA_EXT 0x25
+#define CMD_WRITE_SECTORS_EXT 0x34
+#define CMD_WRITE_DMA_EXT 0x35
+#define CMD_FLUSH_CACHE_EXT 0xEA
+
+static ATA_channel_t channels[2];
 
 void ATA_poll(uint16_t base) {
     int i;
@@ -57,29 +89,34 @@ retry2:
     return;
 }
 
-int ATA_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
-    ATA_block_dev_t *ata_dev = (ATA_block_dev_t *)dev;
-    uint16_t *block_dst = (uint16_t *)dst;
-    uint8_t *lba_n = (uint8_t *)&blk_num, status;
-    int i;
-    
-    if (blk_num >= dev->tot_len) {
-        printk("ATA_read_block(): Tried to read past end of drive\n");
-        return -1;
-    }
+static inline uint32_t min(uint32_t a, uint32_t b) {
+    return (a < b) ? a : b;
+}
+
+// Selects the drive and sends a LBA48 address and sector count
+static void send_lba48(ATA_block_dev_t *ata_dev, uint64_t blk_num, uint32_t count) {
+    uint8_t *lba_n = (uint8_t *)&blk_num;
 
     // Select master / slave
     outb(DRIVE_HEAD_REG(ata_dev->ata_base), 0x40 | (ata_dev->slave << 4));
 
-    // Send address
-    outb(SEC_CNT_REG(ata_dev->ata_base), 0); 
+    // Send high bytes, then low bytes
+    outb(SEC_CNT_REG(ata_dev->ata_base), (count >> 8) & 0xFF);
     outb(SEC_NUM_REG(ata_dev->ata_base), lba_n[3]);
     outb(CYL_LOW_REG(ata_dev->ata_base), lba_n[4]);
     outb(CYL_HIGH_REG(ata_dev->ata_base), lba_n[5]);
-    outb(SEC_CNT_REG(ata_dev->ata_base), 1);
+    outb(SEC_CNT_REG(ata_dev->ata_base), count & 0xFF);
     outb(SEC_NUM_REG(ata_dev->ata_base), lba_n[0]);
     outb(CYL_LOW_REG(ata_dev->ata_base), lba_n[1]);
     outb(CYL_HIGH_REG(ata_dev->ata_base), lba_n[2]);
+}
+
+static int pio_read_block(ATA_block_dev_t *ata_dev, uint64_t blk_num, void *dst) {
+    uint16_t *block_dst = (uint16_t *)dst;
+    uint8_t status;
+    int i;
+
+    send_lba48(ata_dev, blk_num, 1);
 
     // Send read command
     outb(CMD_REG(ata_dev->ata_base), CMD_READ_SECTORS_EXT);
@@ -102,6 +139,297 @@ int ATA_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
     return 1;
 }
 
+static int pio_write_block(ATA_block_dev_t *ata_dev, uint64_t blk_num, void *src) {
+    uint16_t *block_src = (uint16_t *)src;
+    uint8_t status;
+    int i;
+
+    send_lba48(ata_dev, blk_num, 1);
+    outb(CMD_REG(ata_dev->ata_base), CMD_WRITE_SECTORS_EXT);
+
+    // Poll until the drive wants data
+    ATA_poll(ata_dev->ata_base);
+
+    for (i = 0; i < 256; i++) {
+        outw(DATA_REG(ata_dev->ata_base), block_src[i]);
+    }
+
+    // Wait for the drive to take the sector
+    do {
+        status = inb(ALT_STAT_REG(ata_dev->ata_base));
+    } while (status & STAT_BSY);
+
+    if (status & STAT_DRQ || status & STAT_ERR) {
+        printk("ATA_write_blocks(): bad status: %x\n", status);
+        return -1;
+    }
+
+    return 1;
+}
+
+// Waits for the drive to commit its write cache to the media
+static int flush_cache(ATA_block_dev_t *ata_dev) {
+    ATA_channel_t *channel = ata_dev->channel;
+    uint8_t status;
+
+    // Don't interleave with a DMA transfer on the channel
+    if (check_int()) {
+        wait_event_interruptable(&channel->blocked, channel->busy);
+    }
+    channel->busy = true;
+
+    outb(DRIVE_HEAD_REG(ata_dev->ata_base), 0x40 | (ata_dev->slave << 4));
+    outb(CMD_REG(ata_dev->ata_base), CMD_FLUSH_CACHE_EXT);
+
+    do {
+        status = inb(ALT_STAT_REG(ata_dev->ata_base));
+    } while (status & STAT_BSY);
+
+    channel->busy = false;
+    PROC_unblock_all(&channel->blocked);
+
+    if (status & STAT_ERR) {
+        printk("ATA_write_blocks(): Cache flush failed, status: %x\n", status);
+        return -1;
+    }
+    return 1;
+}
+
+// Fills the channel's PRD table with the physical segments backing a buffer
+// Returns the number of entries, or -1 if the controller can't reach the buffer
+static int build_prd_table(ATA_channel_t *channel, uint8_t *buff, uint32_t len) {
+    virtual_addr_t vaddr = (virtual_addr_t)buff;
+    physical_addr_t phys, seg_start = 0;
+    uint32_t seg_len = 0, len_here;
+    int n = 0;
+
+    if (vaddr & 1) return -1;
+
+    while (len > 0) {
+        len_here = min(len, PAGE_SIZE - (vaddr & (PAGE_SIZE - 1)));
+        phys = MMU_virt_to_phys(vaddr);
+
+        if (phys == 0 || phys + len_here > DMA_LIMIT) return -1;
+
+        if (seg_len > 0 && seg_start + seg_len == phys &&
+            (seg_start & ~(PRD_WINDOW - 1)) == ((phys + len_here - 1) & ~(PRD_WINDOW - 1)))
+        {
+            // Physically contiguous with the previous segment, extend it
+            seg_len += len_here;
+        } else {
+            if (seg_len > 0) {
+                channel->prd_table[n].addr = seg_start;
+                channel->prd_table[n].byte_count = seg_len & 0xFFFF; // 0 encodes 64K
+                channel->prd_table[n].flags = 0;
+                n++;
+            }
+            if (n >= PRD_TABLE_ENTRIES) return -1;
+            seg_start = phys;
+            seg_len = len_here;
+        }
+
+        vaddr += len_here;
+        len -= len_here;
+    }
+
+    channel->prd_table[n].addr = seg_start;
+    channel->prd_table[n].byte_count = seg_len & 0xFFFF;
+    channel->prd_table[n].flags = PRD_EOT;
+
+    return n + 1;
+}
+
+// Transfers up to MAX_DMA_SECTORS sectors with a bus master DMA transfer
+static int dma_transfer(ATA_block_dev_t *ata_dev, uint64_t blk_num, uint32_t count, uint8_t *buff, bool write) {
+    ATA_channel_t *channel = ata_dev->channel;
+    uint16_t bm = channel->bmide_base;
+    uint32_t len = count * SECTOR_SIZE;
+    uint8_t direction = write ? 0 : BM_CMD_READ;
+    bool bounce = false;
+
+    // Only one transfer can be in flight per channel
+    if (check_int()) {
+        wait_event_interruptable(&channel->blocked, channel->busy);
+    }
+    channel->busy = true;
+    channel->dma_done = false;
+
+    if (build_prd_table(channel, buff, len) == -1) {
+        // Buffer isn't reachable by the controller, go through the bounce buffer
+        build_prd_table(channel, channel->bounce, len);
+        if (write) memcpy(channel->bounce, buff, len);
+        bounce = true;
+    }
+
+    // Load PRD table, set direction, and clear stale status
+    outl(BM_PRDT_REG(bm), channel->prd_phys);
+    outb(BM_CMD_REG(bm), direction);
+    outb(BM_STAT_REG(bm), BM_STAT_IRQ | BM_STAT_ERR);
+
+    send_lba48(ata_dev, blk_num, count);
+    outb(CMD_REG(ata_dev->ata_base), write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT);
+
+    // Start the transfer, completion is signalled by the channel's IRQ
+    outb(BM_CMD_REG(bm), direction | BM_CMD_START);
+    wait_event_or_halt(&channel->blocked, !channel->dma_done);
+
+    if (bounce && !write) {
+        memcpy(buff, channel->bounce, len);
+    }
+
+    channel->busy = false;
+    PROC_unblock_all(&channel->blocked);
+
+    if (channel->dma_status & STAT_ERR) {
+        printk("ATA_transfer(): DMA transfer failed, status: %x\n", channel->dma_status);
+        return -1;
+    }
+
+    return 1;
+}
+
+// Reads count contiguous blocks into dst
+// Uses bus master DMA when the channel supports it, PIO otherwise
+// Returns 1 on success, -1 on failure
+int ATA_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst) {
+    ATA_block_dev_t *ata_dev = (ATA_block_dev_t *)dev;
+    uint8_t *buff = (uint8_t *)dst;
+    uint32_t n;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("ATA_read_block(): Tried to read past end of drive\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        if (ata_dev->channel != NULL && ata_dev->channel->bmide_base != 0) {
+            n = min(count, MAX_DMA_SECTORS);
+            if (dma_transfer(ata_dev, blk_num, n, buff, false) == -1) return -1;
+        } else {
+            n = 1;
+            if (pio_read_block(ata_dev, blk_num, buff) == -1) return -1;
+        }
+
+        blk_num += n;
+        count -= n;
+        buff += n * SECTOR_SIZE;
+    }
+
+    return 1;
+}
+
+// Writes count contiguous blocks from src, returning once the drive has flushed them
+// Returns 1 on success, -1 on failure
+int ATA_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src) {
+    ATA_block_dev_t *ata_dev = (ATA_block_dev_t *)dev;
+    uint8_t *buff = (uint8_t *)src;
+    uint32_t n;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("ATA_write_blocks(): Tried to write past end of drive\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        if (ata_dev->channel != NULL && ata_dev->channel->bmide_base != 0) {
+            n = min(count, MAX_DMA_SECTORS);
+            if (dma_transfer(ata_dev, blk_num, n, buff, true) == -1) return -1;
+        } else {
+            n = 1;
+            if (pio_write_block(ata_dev, blk_num, buff) == -1) return -1;
+        }
+
+        blk_num += n;
+        count -= n;
+        buff += n * SECTOR_SIZE;
+    }
+
+    return flush_cache(ata_dev);
+}
+
+int ATA_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
+    return ATA_read_blocks(dev, blk_num, 1, dst);
+}
+
+// Services the channel's IRQ
+// Completes a DMA transfer if one finished, otherwise acknowledges the drive
+void ATA_isr(uint8_t irq, uint32_t error_code, void *arg) {
+    ATA_channel_t *channel = (ATA_channel_t *)arg;
+    uint16_t bm = channel->bmide_base;
+    uint8_t bm_status;
+
+    if (bm != 0 && ((bm_status = inb(BM_STAT_REG(bm))) & BM_STAT_IRQ)) {
+        // Stop the bus master, reading status acknowledges the drive
+        outb(BM_CMD_REG(bm), 0);
+        channel->dma_status = inb(STAT_REG(channel->ata_base));
+        if (bm_status & BM_STAT_ERR) channel->dma_status |= STAT_ERR;
+        outb(BM_STAT_REG(bm), BM_STAT_IRQ | BM_STAT_ERR);
+
+        channel->dma_done = true;
+        PROC_unblock_all(&channel->blocked);
+    } else {
+        inb(STAT_REG(channel->ata_base));
+    }
+
+    IRQ_end_of_interrupt(irq);
+}
+
+// Locates the PCI IDE controller and sets up bus master DMA on the channel
+// Returns 1 on success, -1 if the channel must fall back to PIO
+static int init_dma(ATA_channel_t *channel) {
+    pci_dev_t *ide;
+    uint64_t bar;
+
+    if ((ide = PCI_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_IDE, NULL)) == NULL) {
+        printb("ata_init_dma(): No PCI IDE controller\n");
+        return -1;
+    }
+
+    if (!(ide->prog_if & PROG_IF_BUS_MASTER) || (bar = PCI_bar_addr(ide, BM_BAR)) == 0) {
+        printb("ata_init_dma(): IDE controller doesn't support bus mastering\n");
+        return -1;
+    }
+
+    // PRD table and bounce buffer need contiguous frames below 4GB
+    channel->prd_phys = MMU_pf_alloc_contig(1);
+    channel->bounce_phys = MMU_pf_alloc_contig(BOUNCE_PAGES);
+    if (channel->bounce_phys + BOUNCE_PAGES * PAGE_SIZE > DMA_LIMIT) {
+        printb("ata_init_dma(): No DMA-able memory\n");
+        return -1;
+    }
+    channel->prd_table = (ATA_prd_t *)GET_VIRT_ADDR(channel->prd_phys);
+    channel->bounce = (uint8_t *)GET_VIRT_ADDR(channel->bounce_phys);
+
+    PCI_enable_bus_master(ide);
+    channel->bmide_base = bar + ((channel->ata_base == PRIMARY_BASE) ? 0 : BM_SECONDARY_OFFSET);
+
+    printb("Bus master DMA enabled on IDE channel 0x%x\n", channel->ata_base);
+    return 1;
+}
+
+// Returns the channel for the IDE bus, initializing it on first use
+static ATA_channel_t *get_channel(uint16_t base, uint8_t irq) {
+    ATA_channel_t *channel = &channels[(base == PRIMARY_BASE) ? 0 : 1];
+
+    if (channel->ata_base == base) {
+        return channel;
+    }
+
+    channel->ata_base = base;
+    channel->irq = irq;
+    PROC_init_queue(&channel->blocked);
+
+    if (init_dma(channel) == -1) {
+        channel->bmide_base = 0;
+    }
+
+    // Route drive interrupts to the channel's handler
+    IRQ_set_handler(irq, ATA_isr, channel);
+    IRQ_clear_mask(irq);
+
+    return channel;
+}
+
 // Ensures specified controller is present
 // Returns a pointer to a struct with its information
 ATA_block_dev_t *ATA_probe(uint16_t base, uint8_t slave, const char *name, uint8_t irq) 
@@ -183,12 +511,18 @@ ATA_block_dev_t *ATA_probe(uint16_t base, uint8_t slave, const char *name, uint8
     printb("Identified ATA drive (%s)\n", name);
 
     // Ready to allocate ATA dev struct
-    ata_dev = (ATA_block_dev_t *)kmalloc(sizeof(ATA_block_dev_t));
+    ata_dev = (ATA_block_dev_t *)kcalloc(1, sizeof(ATA_block_dev_t));
 
     ata_dev->ata_base = base;
     ata_dev->slave = slave;
+    ata_dev->channel = get_channel(base, irq);
+
+    // Drive interrupts signal DMA completion
+    outb(DEV_CTRL_REG(base), 0);
     ata_dev->dev.tot_len = sectors;
     ata_dev->dev.read_block = ATA_read_block;
+    ata_dev->dev.read_blocks = ATA_read_blocks;
+    ata_dev->dev.write_blocks = ATA_write_blocks;
     ata_dev->dev.blk_size = 512;
     ata_dev->dev.type = MASS_STORAGE;
     ata_dev->dev.name = name;
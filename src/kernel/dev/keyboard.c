@@ -143,7 +143,7 @@ static keyb_state_t keyb;
 #define TEST_BIT(I, k) (I & (1 << k))
 
 void keyboard_handler(uint8_t, uint32_t, void *);
-uint64_t getc_sys_call(uint64_t arg);
+uint64_t getc_sys_call(uint64_t arg, uint64_t arg2, uint64_t arg3);
 
 uint8_t read_data() {
     while ((inb(PS2_STATUS) & 0x1) == 0); // Waiting for full output buffer
@@ -276,7 +276,7 @@ int KBD_init() {
     return 1;
 }
 
-uint64_t getc_sys_call(uint64_t arg) {
+uint64_t getc_sys_call(uint64_t arg, uint64_t arg2, uint64_t arg3) {
     char chr;
     wait_event_interruptable(&keyb.blocked, is_buffer_empty(&keyb.circ_buff));
 
@@ -0,0 +1,615 @@
+#include "nvme.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include "pci.h"
+#include "irq.h"
+#include "proc.h"
+#include "printk.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "pf_alloc.h"
+#include "page_table.h"
+
+#define PCI_SUBCLASS_NVM 0x08
+#define NVME_PROG_IF 0x02
+#define REGS_SIZE 0x4000
+
+// Controller registers
+#define REG_CAP 0x00
+#define REG_CC 0x14
+#define REG_CSTS 0x1C
+#define REG_AQA 0x24
+#define REG_ASQ 0x28
+#define REG_ACQ 0x30
+#define REG_DOORBELLS 0x1000
+
+#define CAP_MQES(cap) (((cap) & 0xFFFF) + 1)
+#define CAP_DSTRD(cap) (((cap) >> 32) & 0xF)
+#define CC_EN 0x1
+#define CC_IOSQES (6 << 16)     // 64 byte submission entries
+#define CC_IOCQES (4 << 20)     // 16 byte completion entries
+#define CSTS_RDY 0x1
+#define CSTS_CFS 0x2
+
+// Admin commands
+#define ADMIN_CREATE_SQ 0x01
+#define ADMIN_CREATE_CQ 0x05
+#define ADMIN_IDENTIFY 0x06
+#define ADMIN_SET_FEATURES 0x09
+#define IDENTIFY_NAMESPACE 0
+#define IDENTIFY_CONTROLLER 1
+#define FEATURE_NUM_QUEUES 0x07
+#define QUEUE_PHYS_CONTIG 0x1
+#define CQ_INT_ENABLE 0x2
+
+// I/O commands
+#define CMD_WRITE 0x01
+#define CMD_READ 0x02
+
+#define ADMIN_QUEUE_SIZE 16
+#define MAX_CMD_PAGES 256
+#define DEFAULT_NSID 1
+#define SECTOR_SIZE 512         // Partition tables, the buffer cache and FAT all assume 512 byte blocks
+
+// The kernel only runs on the bootstrap processor, so it gets the only queue pair
+#define NUM_CPUS 1
+
+struct NVME_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsv;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed));
+
+struct NVME_cqe {
+    uint32_t result;
+    uint32_t rsv;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;        // Phase tag in bit 0
+} __attribute__((packed));
+
+static int num_ctrls;
+
+static inline int current_cpu(void) {
+    return 0;
+}
+
+static inline uint32_t min(uint32_t a, uint32_t b) {
+    return (a < b) ? a : b;
+}
+
+static inline volatile uint32_t *reg32(NVME_ctrl_t *ctrl, uint32_t offset) {
+    return (volatile uint32_t *)(ctrl->regs + offset);
+}
+
+static inline volatile uint64_t *reg64(NVME_ctrl_t *ctrl, uint32_t offset) {
+    return (volatile uint64_t *)(ctrl->regs + offset);
+}
+
+// Allocates a queue pair's rings, and a PRP list frame per slot for I/O queues
+static void init_queue(NVME_ctrl_t *ctrl, NVME_queue_t *q, uint16_t qid, uint16_t size, bool io) {
+    int sq_pages = (size * sizeof(NVME_sqe_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    int cq_pages = (size * sizeof(NVME_cqe_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    int slot;
+
+    q->qid = qid;
+    q->size = size;
+    q->sq = (NVME_sqe_t *)GET_VIRT_ADDR(MMU_pf_alloc_contig(sq_pages));
+    q->cq = (NVME_cqe_t *)GET_VIRT_ADDR(MMU_pf_alloc_contig(cq_pages));
+    memset(q->sq, 0, sq_pages * PAGE_SIZE);
+    memset((void *)q->cq, 0, cq_pages * PAGE_SIZE);
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->sq_doorbell = reg32(ctrl, REG_DOORBELLS + (2 * qid) * ctrl->doorbell_stride);
+    q->cq_doorbell = reg32(ctrl, REG_DOORBELLS + (2 * qid + 1) * ctrl->doorbell_stride);
+    PROC_init_queue(&q->blocked);
+
+    if (!io) return;
+
+    for (slot = 0; slot < NVME_QUEUE_SLOTS; slot++) {
+        q->prp_phys[slot] = MMU_pf_alloc();
+        q->prp_lists[slot] = (uint64_t *)GET_VIRT_ADDR(q->prp_phys[slot]);
+    }
+}
+
+static inline physical_addr_t sq_phys(NVME_queue_t *q) {
+    return GET_PHYS_ADDR((virtual_addr_t)q->sq);
+}
+
+static inline physical_addr_t cq_phys(NVME_queue_t *q) {
+    return GET_PHYS_ADDR((virtual_addr_t)q->cq);
+}
+
+// Submits an admin command and polls for its completion
+// Only used during initialization, so nothing else is on the admin queue
+// Returns 1 on success, -1 on failure
+static int admin_command(NVME_ctrl_t *ctrl, NVME_sqe_t *cmd, uint32_t *result) {
+    NVME_queue_t *q = &ctrl->admin;
+    volatile NVME_cqe_t *cqe;
+    uint16_t status;
+
+    cmd->cid = q->sq_tail;
+    memcpy(&q->sq[q->sq_tail], cmd, sizeof(NVME_sqe_t));
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    *q->sq_doorbell = q->sq_tail;
+
+    cqe = &q->cq[q->cq_head];
+    while ((cqe->status & 1) != q->phase);
+
+    status = cqe->status >> 1;
+    if (result != NULL) *result = cqe->result;
+
+    if (++q->cq_head == q->size) {
+        q->cq_head = 0;
+        q->phase ^= 1;
+    }
+    *q->cq_doorbell = q->cq_head;
+
+    if (status != 0) {
+        printb("nvme_admin_command(): Opcode 0x%x failed with status 0x%x\n", cmd->opcode, status);
+        return -1;
+    }
+
+    return 1;
+}
+
+static int identify(NVME_ctrl_t *ctrl, uint32_t cns, uint32_t nsid, physical_addr_t buff) {
+    NVME_sqe_t cmd;
+
+    memset(&cmd, 0, sizeof(NVME_sqe_t));
+    cmd.opcode = ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = buff;
+    cmd.cdw10 = cns;
+
+    return admin_command(ctrl, &cmd, NULL);
+}
+
+// Creates the completion queue, then the submission queue of an I/O queue pair
+static int create_io_queue(NVME_ctrl_t *ctrl, NVME_queue_t *q) {
+    NVME_sqe_t cmd;
+
+    memset(&cmd, 0, sizeof(NVME_sqe_t));
+    cmd.opcode = ADMIN_CREATE_CQ;
+    cmd.prp1 = cq_phys(q);
+    cmd.cdw10 = ((q->size - 1) << 16) | q->qid;
+    cmd.cdw11 = CQ_INT_ENABLE | QUEUE_PHYS_CONTIG;     // Interrupt vector 0 (INTx)
+    if (admin_command(ctrl, &cmd, NULL) == -1) return -1;
+
+    memset(&cmd, 0, sizeof(NVME_sqe_t));
+    cmd.opcode = ADMIN_CREATE_SQ;
+    cmd.prp1 = sq_phys(q);
+    cmd.cdw10 = ((q->size - 1) << 16) | q->qid;
+    cmd.cdw11 = (q->qid << 16) | QUEUE_PHYS_CONTIG;
+    return admin_command(ctrl, &cmd, NULL);
+}
+
+// Largest transfer of one command
+// A buffer not starting on a page boundary spans one more page than its length, so one page is kept spare
+static inline uint32_t max_cmd_len(NVME_ctrl_t *ctrl) {
+    return (ctrl->max_cmd_pages - 1) * PAGE_SIZE;
+}
+
+// Points a command at a buffer, through the slot's PRP list if it spans more than two pages
+// Returns 1 on success, -1 if the buffer is not DMA-able
+static int build_prps(NVME_queue_t *q, int slot, NVME_sqe_t *cmd, uint8_t *buff, uint32_t len) {
+    virtual_addr_t vaddr = (virtual_addr_t)buff;
+    uint32_t len_here = min(len, PAGE_SIZE - (vaddr & (PAGE_SIZE - 1)));
+    uint64_t *list = q->prp_lists[slot];
+    int n = 0;
+
+    if ((vaddr & 0x3) || (cmd->prp1 = MMU_virt_to_phys(vaddr)) == 0) return -1;
+    vaddr += len_here;
+    len -= len_here;
+
+    if (len == 0) {
+        cmd->prp2 = 0;
+    } else if (len <= PAGE_SIZE) {
+        if ((cmd->prp2 = MMU_virt_to_phys(vaddr)) == 0) return -1;
+    } else {
+        // Every following entry is page aligned
+        while (len > 0) {
+            if ((list[n++] = MMU_virt_to_phys(vaddr)) == 0) return -1;
+            len_here = min(len, PAGE_SIZE);
+            vaddr += len_here;
+            len -= len_here;
+        }
+        cmd->prp2 = q->prp_phys[slot];
+    }
+
+    return 1;
+}
+
+// Writes a read or write command for the slot at the submission queue's tail, without ringing the doorbell
+static int queue_io(NVME_block_dev_t *dev, NVME_queue_t *q, int slot, uint8_t opcode, uint64_t lba, uint32_t count,
+    uint8_t *buff)
+{
+    NVME_sqe_t *cmd = &q->sq[q->sq_tail];
+
+    memset(cmd, 0, sizeof(NVME_sqe_t));
+    cmd->opcode = opcode;
+    cmd->cid = slot;
+    cmd->nsid = dev->nsid;
+    cmd->cdw10 = lba & 0xFFFFFFFF;
+    cmd->cdw11 = lba >> 32;
+    cmd->cdw12 = count - 1;
+
+    if (build_prps(q, slot, cmd, buff, count * dev->dev.blk_size) == -1) {
+        printk("NVME_transfer(): Buffer is not DMA-able\n");
+        return -1;
+    }
+
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    return 1;
+}
+
+// Transfers count contiguous blocks on the calling CPU's queue pair
+// Large transfers are split into several commands, submitted with a single doorbell write
+// Returns 1 on success, -1 on failure
+static int transfer(block_dev_t *dev, uint8_t opcode, uint64_t blk_num, uint32_t count, void *buff) {
+    NVME_block_dev_t *nvme_dev = (NVME_block_dev_t *)dev;
+    NVME_ctrl_t *ctrl = nvme_dev->ctrl;
+    NVME_queue_t *q = &ctrl->io[current_cpu() % ctrl->num_io_queues];
+    uint64_t all = (1UL << NVME_QUEUE_SLOTS) - 1, batch;
+    uint32_t max_blocks = max_cmd_len(ctrl) / dev->blk_size, n;
+    uint8_t *data = (uint8_t *)buff;
+    uint16_t int_en;
+    bool failed = false;
+    int slot;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("NVME_transfer(): Tried to access past end of namespace\n");
+        return -1;
+    }
+
+    while (count > 0 && !failed) {
+        wait_event_or_halt(&q->blocked, q->slots_busy == all);
+
+        int_en = check_int();
+        if (int_en) CLI;
+
+        // Fill every free slot, then ring the doorbell once for the batch
+        batch = 0;
+        for (slot = 0; slot < NVME_QUEUE_SLOTS && count > 0; slot++) {
+            if (q->slots_busy & (1UL << slot)) continue;
+
+            n = min(count, max_blocks);
+            if (queue_io(nvme_dev, q, slot, opcode, blk_num, n, data) == -1) {
+                failed = true;
+                break;
+            }
+
+            q->slots_busy |= (1UL << slot);
+            q->slots_done &= ~(1UL << slot);
+            batch |= (1UL << slot);
+            blk_num += n;
+            count -= n;
+            data += n * dev->blk_size;
+        }
+
+        if (batch) *q->sq_doorbell = q->sq_tail;
+        if (int_en) STI;
+
+        wait_event_or_halt(&q->blocked, (q->slots_done & batch) != batch);
+
+        for (slot = 0; slot < NVME_QUEUE_SLOTS; slot++) {
+            if (!(batch & (1UL << slot))) continue;
+            if (q->status[slot] != 0) {
+                printk("NVME_transfer(): Command failed with status 0x%x\n", q->status[slot]);
+                failed = true;
+            }
+        }
+
+        q->slots_busy &= ~batch;
+        PROC_unblock_all(&q->blocked);
+    }
+
+    return failed ? -1 : 1;
+}
+
+int NVME_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst) {
+    return transfer(dev, CMD_READ, blk_num, count, dst);
+}
+
+int NVME_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src) {
+    return transfer(dev, CMD_WRITE, blk_num, count, src);
+}
+
+int NVME_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
+    return NVME_read_blocks(dev, blk_num, 1, dst);
+}
+
+// Counts the free command slots on a queue
+static int free_slots(NVME_queue_t *q) {
+    int slot, n = 0;
+
+    for (slot = 0; slot < NVME_QUEUE_SLOTS; slot++) {
+        if (!(q->slots_busy & (1UL << slot))) n++;
+    }
+
+    return n;
+}
+
+static int alloc_slot(NVME_queue_t *q) {
+    int slot;
+
+    for (slot = 0; slot < NVME_QUEUE_SLOTS; slot++) {
+        if (!(q->slots_busy & (1UL << slot))) {
+            q->slots_busy |= (1UL << slot);
+            q->slots_done &= ~(1UL << slot);
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+// Counts the commands a request needs, one per contiguous segment of at most max_len bytes
+static int count_commands(blk_request_t *rq, uint32_t max_len) {
+    blk_seg_iter_t iter;
+    uint8_t *buff;
+    uint32_t len;
+    int n = 0;
+
+    BLK_seg_init(&iter, rq);
+    while (BLK_next_segment(&iter, max_len, &buff, &len)) n++;
+
+    return n;
+}
+
+// Starts a batch of block layer requests, writing the submission doorbell once for all of them
+// Requests complete from NVME_isr
+// Returns how many requests fit in the free slots of the calling CPU's queue pair
+int NVME_queue_rq(block_dev_t *dev, blk_request_t **rqs, int count) {
+    NVME_block_dev_t *nvme_dev = (NVME_block_dev_t *)dev;
+    NVME_ctrl_t *ctrl = nvme_dev->ctrl;
+    NVME_queue_t *q = &ctrl->io[current_cpu() % ctrl->num_io_queues];
+    uint32_t max_len = max_cmd_len(ctrl), len;
+    blk_seg_iter_t iter;
+    blk_request_t *rq;
+    uint64_t blk_num;
+    uint16_t int_en;
+    uint8_t *buff;
+    int i, slot, free, needed, queued = 0;
+
+    int_en = check_int();
+    if (int_en) CLI;
+
+    free = free_slots(q);
+    for (i = 0; i < count; i++) {
+        rq = rqs[i];
+        if ((needed = count_commands(rq, max_len)) > NVME_QUEUE_SLOTS) {
+            printk("NVME_queue_rq(): Request has too many segments\n");
+            BLK_end_request(rq, -1);
+            continue;
+        }
+        if (needed > free) break;
+        free -= needed;
+
+        rq->status = 1;
+        rq->pending = needed;
+        blk_num = rq->blk_num;
+
+        BLK_seg_init(&iter, rq);
+        while (BLK_next_segment(&iter, max_len, &buff, &len)) {
+            slot = alloc_slot(q);
+            if (queue_io(nvme_dev, q, slot, (rq->op == BIO_WRITE) ? CMD_WRITE : CMD_READ, blk_num,
+                len / dev->blk_size, buff) == -1)
+            {
+                q->slots_busy &= ~(1UL << slot);
+                rq->status = -1;
+                rq->pending--;
+            } else {
+                q->slot_rqs[slot] = rq;
+                queued++;
+            }
+            blk_num += len / dev->blk_size;
+        }
+
+        if (rq->pending == 0) {
+            BLK_end_request(rq, rq->status);
+        }
+    }
+
+    if (queued) *q->sq_doorbell = q->sq_tail;
+    if (int_en) STI;
+
+    return i;
+}
+
+// Reaps every new completion on the controller's I/O queues
+void NVME_isr(uint8_t irq, uint32_t error_code, void *arg) {
+    NVME_ctrl_t *ctrl = (NVME_ctrl_t *)arg;
+    volatile NVME_cqe_t *cqe;
+    NVME_queue_t *q;
+    blk_request_t *rq;
+    uint16_t status;
+    bool reaped;
+    int i, slot;
+
+    for (i = 0; i < ctrl->num_io_queues; i++) {
+        q = &ctrl->io[i];
+        reaped = false;
+
+        for (cqe = &q->cq[q->cq_head]; (cqe->status & 1) == q->phase; cqe = &q->cq[q->cq_head]) {
+            slot = cqe->cid;
+            status = cqe->status >> 1;
+            reaped = true;
+
+            if (++q->cq_head == q->size) {
+                q->cq_head = 0;
+                q->phase ^= 1;
+            }
+
+            if ((rq = q->slot_rqs[slot]) == NULL) {
+                q->status[slot] = status;
+                q->slots_done |= (1UL << slot);
+                continue;
+            }
+
+            q->slot_rqs[slot] = NULL;
+            q->slots_busy &= ~(1UL << slot);
+            if (status != 0) rq->status = -1;
+            if (--rq->pending == 0) {
+                BLK_end_request(rq, rq->status);
+            }
+        }
+
+        if (reaped) {
+            *q->cq_doorbell = q->cq_head;
+            PROC_unblock_all(&q->blocked);
+        }
+    }
+
+    // Slots freed by synchronous reads may make room for requeued requests
+    if (ctrl->ns != NULL) {
+        BLK_run_queue(ctrl->ns);
+    }
+
+    IRQ_end_of_interrupt(irq);
+}
+
+// Resets the controller, sets up the admin queue and one I/O queue pair per CPU,
+// and registers namespace 1 as a block device
+static NVME_block_dev_t *init_controller(pci_dev_t *pci) {
+    NVME_ctrl_t *ctrl = (NVME_ctrl_t *)kcalloc(1, sizeof(NVME_ctrl_t));
+    NVME_block_dev_t *dev;
+    physical_addr_t buff_phys;
+    uint8_t *buff, mdts, lbads;
+    uint64_t cap;
+    uint32_t result, queues;
+    NVME_sqe_t cmd;
+    char *name;
+    int i;
+
+    PCI_enable_bus_master(pci);
+    ctrl->regs = (uint8_t *)MMU_map_mmio(PCI_bar_addr(pci, 0), REGS_SIZE);
+
+    cap = *reg64(ctrl, REG_CAP);
+    ctrl->doorbell_stride = 4 << CAP_DSTRD(cap);
+    if (REG_DOORBELLS + 2 * (NVME_MAX_IO_QUEUES + 1) * ctrl->doorbell_stride > REGS_SIZE ||
+        CAP_MQES(cap) < NVME_QUEUE_SIZE)
+    {
+        printb("nvme_init(): Unsupported controller capabilities 0x%lx\n", cap);
+        return NULL;
+    }
+
+    // Disable the controller before configuring the admin queue
+    *reg32(ctrl, REG_CC) &= ~CC_EN;
+    while (*reg32(ctrl, REG_CSTS) & CSTS_RDY);
+
+    init_queue(ctrl, &ctrl->admin, 0, ADMIN_QUEUE_SIZE, false);
+    *reg32(ctrl, REG_AQA) = ((ADMIN_QUEUE_SIZE - 1) << 16) | (ADMIN_QUEUE_SIZE - 1);
+    *reg64(ctrl, REG_ASQ) = sq_phys(&ctrl->admin);
+    *reg64(ctrl, REG_ACQ) = cq_phys(&ctrl->admin);
+
+    *reg32(ctrl, REG_CC) = CC_EN | CC_IOSQES | CC_IOCQES;
+    while (!(*reg32(ctrl, REG_CSTS) & (CSTS_RDY | CSTS_CFS)));
+    if (*reg32(ctrl, REG_CSTS) & CSTS_CFS) {
+        printb("nvme_init(): Controller fatal status\n");
+        return NULL;
+    }
+
+    buff_phys = MMU_pf_alloc();
+    buff = (uint8_t *)GET_VIRT_ADDR(buff_phys);
+
+    // Maximum data transfer size is a power of two multiple of the minimum page size
+    if (identify(ctrl, IDENTIFY_CONTROLLER, 0, buff_phys) == -1) goto fail;
+    mdts = buff[77];
+    ctrl->max_cmd_pages = (mdts == 0 || mdts >= 8) ? MAX_CMD_PAGES : min(1U << mdts, MAX_CMD_PAGES);
+
+    // Ask for a queue pair per CPU, the controller may grant fewer
+    memset(&cmd, 0, sizeof(NVME_sqe_t));
+    cmd.opcode = ADMIN_SET_FEATURES;
+    cmd.cdw10 = FEATURE_NUM_QUEUES;
+    cmd.cdw11 = ((NUM_CPUS - 1) << 16) | (NUM_CPUS - 1);
+    if (admin_command(ctrl, &cmd, &result) == -1) goto fail;
+    queues = min((result & 0xFFFF) + 1, (result >> 16) + 1);
+    ctrl->num_io_queues = min(min(queues, NUM_CPUS), NVME_MAX_IO_QUEUES);
+
+    IRQ_set_handler(PCI_IRQ(pci->irq_line), NVME_isr, ctrl);
+
+    for (i = 0; i < ctrl->num_io_queues; i++) {
+        init_queue(ctrl, &ctrl->io[i], i + 1, NVME_QUEUE_SIZE, true);
+        if (create_io_queue(ctrl, &ctrl->io[i]) == -1) goto fail;
+    }
+
+    IRQ_clear_mask(PCI_IRQ(pci->irq_line));
+
+    // Namespace size, and the LBA format it is using
+    if (identify(ctrl, IDENTIFY_NAMESPACE, DEFAULT_NSID, buff_phys) == -1) goto fail;
+    lbads = buff[128 + 4 * (buff[26] & 0xF) + 2];
+    if (lbads >= 32 || (1U << lbads) != SECTOR_SIZE) {
+        printb("nvme_init(): Namespace blocks are 2^%d bytes, only %d byte blocks are supported\n", lbads, SECTOR_SIZE);
+        goto fail;
+    }
+
+    dev = (NVME_block_dev_t *)kcalloc(1, sizeof(NVME_block_dev_t));
+    dev->ctrl = ctrl;
+    dev->nsid = DEFAULT_NSID;
+    dev->dev.tot_len = *(uint64_t *)buff;
+    dev->dev.blk_size = SECTOR_SIZE;
+    dev->dev.read_block = NVME_read_block;
+    dev->dev.read_blocks = NVME_read_blocks;
+    dev->dev.write_blocks = NVME_write_blocks;
+    dev->dev.queue_rq = NVME_queue_rq;
+    dev->dev.type = MASS_STORAGE;
+    dev->dev.next = NULL;
+
+    MMU_pf_free(buff_phys);
+
+    // Name the namespace nvmeXn1
+    name = (char *)kmalloc(8);
+    memcpy(name, "nvme0n1", 8);
+    name[4] = (char)('0' + num_ctrls++);
+    dev->dev.name = name;
+
+    printb("Identified NVMe namespace (%s), %ld blocks of %d bytes, %d I/O queue pair(s)\n",
+        name, dev->dev.tot_len, dev->dev.blk_size, ctrl->num_io_queues);
+
+    // No seek cost, so requests go out in submission order
+    BLK_register(&dev->dev);
+    BLK_set_scheduler(&dev->dev, "noop");
+    dev->dev.queue->max_in_flight = NVME_QUEUE_SLOTS;
+    // Requests no longer than a command get one command per segment, so they always fit the queue
+    dev->dev.queue->max_blocks = min(dev->dev.queue->max_blocks, max_cmd_len(ctrl) / SECTOR_SIZE);
+    dev->dev.queue->max_segments = NVME_QUEUE_SLOTS;
+    ctrl->ns = &dev->dev;
+
+    return dev;
+
+fail:
+    MMU_pf_free(buff_phys);
+    return NULL;
+}
+
+// Initializes every NVMe controller and registers their first namespace
+// Returns the first namespace found, or NULL if there are none
+NVME_block_dev_t *NVME_probe(void) {
+    pci_dev_t *pci = NULL;
+    NVME_block_dev_t *dev, *first = NULL;
+
+    while ((pci = PCI_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_NVM, pci)) != NULL) {
+        if (pci->prog_if != NVME_PROG_IF) continue;
+
+        printb("Found NVMe controller %x:%x\n", pci->vendor_id, pci->device_id);
+        if ((dev = init_controller(pci)) != NULL && first == NULL) {
+            first = dev;
+        }
+    }
+
+    return first;
+}
@@ -0,0 +1,159 @@
+#include "pci.h"
+#include "ioport.h"
+#include "kmalloc.h"
+#include "printk.h"
+#include "ll_generic.h"
+#include <stddef.h>
+
+// Configuration mechanism #1 ports
+#define CONFIG_ADDRESS 0xCF8
+#define CONFIG_DATA 0xCFC
+
+#define NUM_BUSES 256
+#define NUM_SLOTS 32
+#define NUM_FUNCS 8
+
+#define NO_DEVICE 0xFFFF
+#define HEADER_MULTI_FUNC 0x80
+#define HEADER_TYPE_MASK 0x7F
+#define HEADER_TYPE_BRIDGE 0x1
+
+#define BAR_IO_SPACE 0x1
+#define BAR_TYPE_MASK 0x6
+#define BAR_TYPE_64 0x4
+
+static pci_dev_t *head, *tail;
+
+static uint32_t config_readl(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+    uint32_t address = (1U << 31) | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC);
+
+    outl(CONFIG_ADDRESS, address);
+    return inl(CONFIG_DATA);
+}
+
+static void config_writel(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+    uint32_t address = (1U << 31) | (bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC);
+
+    outl(CONFIG_ADDRESS, address);
+    outl(CONFIG_DATA, value);
+}
+
+uint32_t PCI_config_readl(pci_dev_t *dev, uint8_t offset) {
+    return config_readl(dev->bus, dev->slot, dev->func, offset);
+}
+
+void PCI_config_writel(pci_dev_t *dev, uint8_t offset, uint32_t value) {
+    config_writel(dev->bus, dev->slot, dev->func, offset, value);
+}
+
+// Reads the configuration header of a function into a new device struct
+// Adds the device to the list of discovered devices
+static void add_function(uint8_t bus, uint8_t slot, uint8_t func) {
+    pci_dev_t *dev = (pci_dev_t *)kcalloc(1, sizeof(pci_dev_t));
+    uint32_t reg;
+    int i;
+
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+
+    reg = config_readl(bus, slot, func, PCI_VENDOR_ID);
+    dev->vendor_id = reg & 0xFFFF;
+    dev->device_id = reg >> 16;
+
+    reg = config_readl(bus, slot, func, PCI_CLASS);
+    dev->class_code = reg >> 24;
+    dev->subclass = (reg >> 16) & 0xFF;
+    dev->prog_if = (reg >> 8) & 0xFF;
+
+    // Bridges only have two BARs
+    reg = config_readl(bus, slot, func, PCI_HEADER_TYPE);
+    if (((reg >> 16) & HEADER_TYPE_MASK) != HEADER_TYPE_BRIDGE) {
+        for (i = 0; i < 6; i++) {
+            dev->bar[i] = config_readl(bus, slot, func, PCI_BAR0 + i * 4);
+        }
+        dev->irq_line = config_readl(bus, slot, func, PCI_INTERRUPT_LINE) & 0xFF;
+    }
+
+    printb("PCI %x:%x.%x - %x:%x class %x.%x.%x irq %d\n",
+        bus, slot, func, dev->vendor_id, dev->device_id,
+        dev->class_code, dev->subclass, dev->prog_if, dev->irq_line);
+
+    LL_APPEND(head, tail, dev);
+}
+
+// Brute force scans every bus, slot, and function for PCI devices
+void PCI_enumerate(void) {
+    int bus, slot, func, num_funcs;
+    uint32_t header;
+
+    printb("Enumerating PCI devices\n");
+
+    for (bus = 0; bus < NUM_BUSES; bus++) {
+        for (slot = 0; slot < NUM_SLOTS; slot++) {
+            if ((config_readl(bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == NO_DEVICE) {
+                continue;
+            }
+
+            header = config_readl(bus, slot, 0, PCI_HEADER_TYPE);
+            num_funcs = ((header >> 16) & HEADER_MULTI_FUNC) ? NUM_FUNCS : 1;
+
+            for (func = 0; func < num_funcs; func++) {
+                if ((config_readl(bus, slot, func, PCI_VENDOR_ID) & 0xFFFF) != NO_DEVICE) {
+                    add_function(bus, slot, func);
+                }
+            }
+        }
+    }
+}
+
+// Returns the next device after start (or the first if start is NULL) matching the class
+pci_dev_t *PCI_find_class(uint8_t class_code, uint8_t subclass, pci_dev_t *start) {
+    pci_dev_t *dev = (start == NULL) ? head : start->next;
+
+    for (; dev != NULL; dev = dev->next) {
+        if (dev->class_code == class_code && dev->subclass == subclass) {
+            return dev;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the next device after start (or the first if start is NULL) matching the ids
+pci_dev_t *PCI_find_device(uint16_t vendor_id, uint16_t device_id, pci_dev_t *start) {
+    pci_dev_t *dev = (start == NULL) ? head : start->next;
+
+    for (; dev != NULL; dev = dev->next) {
+        if (dev->vendor_id == vendor_id && dev->device_id == device_id) {
+            return dev;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the address decoded by a BAR, with its flag bits masked off
+uint64_t PCI_bar_addr(pci_dev_t *dev, int bar) {
+    uint32_t val = dev->bar[bar];
+
+    if (val & BAR_IO_SPACE) {
+        return val & ~0x3;
+    }
+
+    if ((val & BAR_TYPE_MASK) == BAR_TYPE_64 && bar < 5) {
+        return ((uint64_t)dev->bar[bar + 1] << 32) | (val & ~0xF);
+    }
+
+    return val & ~0xF;
+}
+
+// Allows the device to decode its BARs and initiate DMA
+void PCI_enable_bus_master(pci_dev_t *dev) {
+    // Upper half is the status register, leave its write-to-clear bits alone
+    uint32_t command = PCI_config_readl(dev, PCI_COMMAND) & 0xFFFF;
+
+    command |= PCI_CMD_IO_SPACE | PCI_CMD_MEM_SPACE | PCI_CMD_BUS_MASTER;
+    command &= ~PCI_CMD_INT_DISABLE;
+    PCI_config_writel(dev, PCI_COMMAND, command);
+}
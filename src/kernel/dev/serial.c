@@ -130,6 +130,28 @@ int SER_writeb(const char *buff, int len) {
     return i;
 }
 
+// Writes len bytes of data to the circular serial buffer, NUL bytes included
+// Blocks when the buffer fills
+// Returns the number of bytes written
+int SER_send(const char *data, int len) {
+    int i = 0;
+    CLI;
+
+    while (i < len) {
+        if (producer_write(data[i], &state)) {
+            i++;
+        } else {
+            init_hw_write();
+            wait_event_interruptable(&blocked, is_buffer_full(&state));
+            CLI;
+        }
+    }
+
+    init_hw_write();
+    STI;
+    return i;
+}
+
 // Services two interrupts
 // 1: TX interrupt - occurs when TX buffer empties
 // 2: LINE interrupt - line status register needs to be read
@@ -0,0 +1,411 @@
+#include "virtio_blk.h"
+#include <stddef.h>
+#include "pci.h"
+#include "irq.h"
+#include "proc.h"
+#include "ioport.h"
+#include "printk.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "pf_alloc.h"
+#include "page_table.h"
+#include "ll_generic.h"
+
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_BLK_DEVICE 0x1001    // Transitional (legacy interface) block device
+#define SECTOR_SIZE 512
+
+// Legacy I/O registers (offset from BAR0)
+#define REG_DEVICE_FEATURES(base) base + 0x00
+#define REG_GUEST_FEATURES(base) base + 0x04
+#define REG_QUEUE_ADDRESS(base) base + 0x08
+#define REG_QUEUE_SIZE(base) base + 0x0C
+#define REG_QUEUE_SELECT(base) base + 0x0E
+#define REG_QUEUE_NOTIFY(base) base + 0x10
+#define REG_DEVICE_STATUS(base) base + 0x12
+#define REG_ISR_STATUS(base) base + 0x13
+#define REG_CAPACITY(base) base + 0x14
+
+// Device status bits
+#define STATUS_ACKNOWLEDGE 0x1
+#define STATUS_DRIVER 0x2
+#define STATUS_DRIVER_OK 0x4
+#define STATUS_FAILED 0x80
+
+// Feature bits
+#define F_INDIRECT_DESC (1U << 28)
+#define F_EVENT_IDX (1U << 29)
+
+// Descriptor flags
+#define DESC_F_NEXT 0x1
+#define DESC_F_WRITE 0x2
+#define DESC_F_INDIRECT 0x4
+
+// Request values
+#define REQ_TYPE_IN 0
+#define REQ_TYPE_OUT 1
+#define REQ_STATUS_OK 0
+#define ISR_QUEUE 0x1
+
+#define QUEUE_ALIGN PAGE_SIZE
+#define MAX_SLOTS 64
+#define MAX_SEGS 16
+#define INDIRECT_DESCS (MAX_SEGS + 2)
+#define MAX_REQ_SECTORS ((MAX_SEGS - 1) * PAGE_SIZE / SECTOR_SIZE)
+
+#define mb() asm volatile ("mfence" ::: "memory")
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];        // Followed by used_event
+};
+
+typedef struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+} virtq_used_elem_t;
+
+struct virtq_used {
+    uint16_t flags;
+    volatile uint16_t idx;
+    virtq_used_elem_t ring[];   // Followed by avail_event
+};
+
+typedef struct virtio_blk_req_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+// Everything a single in-flight request needs to be visible to the device
+struct virtio_blk_slot {
+    virtq_desc_t indirect[INDIRECT_DESCS];
+    virtio_blk_req_hdr_t hdr;
+    volatile uint8_t status;
+    uint8_t pad[512 - INDIRECT_DESCS * sizeof(virtq_desc_t) - sizeof(virtio_blk_req_hdr_t) - 1];
+} __attribute__((packed));
+
+static VIRTIO_blk_dev_t *head, *tail;
+static int num_disks;
+
+static inline uint32_t min(uint32_t a, uint32_t b) {
+    return (a < b) ? a : b;
+}
+
+static inline uint64_t align_up(uint64_t val, uint64_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+// Event index locations live past the end of each ring
+static inline volatile uint16_t *used_event(VIRTIO_blk_dev_t *dev) {
+    return (volatile uint16_t *)&dev->avail->ring[dev->queue_size];
+}
+
+static inline volatile uint16_t *avail_event(VIRTIO_blk_dev_t *dev) {
+    return (volatile uint16_t *)&dev->used->ring[dev->queue_size];
+}
+
+// Returns true if the device asked to be notified when the avail index passes event_idx
+static inline bool need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+// Fills descriptors with the physical segments backing a buffer
+// Returns the number of descriptors, or -1 if the buffer needs too many
+static int build_segments(virtq_desc_t *desc, uint8_t *buff, uint32_t len, uint16_t flags) {
+    virtual_addr_t vaddr = (virtual_addr_t)buff;
+    physical_addr_t phys;
+    uint32_t len_here;
+    int n = 0;
+
+    while (len > 0) {
+        len_here = min(len, PAGE_SIZE - (vaddr & (PAGE_SIZE - 1)));
+        if ((phys = MMU_virt_to_phys(vaddr)) == 0) return -1;
+
+        if (n > 0 && desc[n - 1].addr + desc[n - 1].len == phys) {
+            desc[n - 1].len += len_here;
+        } else {
+            if (n >= MAX_SEGS) return -1;
+            desc[n].addr = phys;
+            desc[n].len = len_here;
+            desc[n].flags = flags | DESC_F_NEXT;
+            desc[n].next = n + 2;
+            n++;
+        }
+
+        vaddr += len_here;
+        len -= len_here;
+    }
+
+    return n;
+}
+
+// Reserves a request slot, sleeping while all are in flight
+static int alloc_slot(VIRTIO_blk_dev_t *dev) {
+    uint64_t all = (dev->num_slots == 64) ? ~0UL : (1UL << dev->num_slots) - 1;
+    int slot;
+
+    wait_event_or_halt(&dev->blocked, (dev->slots_busy & all) == all);
+
+    for (slot = 0; slot < dev->num_slots; slot++) {
+        if (!(dev->slots_busy & (1UL << slot))) break;
+    }
+
+    dev->slots_busy |= (1UL << slot);
+    dev->slots_done &= ~(1UL << slot);
+    return slot;
+}
+
+// Submits one read or write through an indirect descriptor table and sleeps until it completes
+// Returns 1 on success, -1 on failure
+static int submit_request(VIRTIO_blk_dev_t *dev, uint32_t type, uint64_t sector, uint32_t count, void *buff) {
+    int slot = alloc_slot(dev), nsegs, status;
+    virtio_blk_slot_t *req = &dev->slots[slot];
+    physical_addr_t req_phys = dev->slots_phys + slot * sizeof(virtio_blk_slot_t);
+    uint16_t old_idx, new_idx, int_en;
+
+    // The device writes the data of reads and only reads the data of writes
+    nsegs = build_segments(&req->indirect[1], (uint8_t *)buff, count * SECTOR_SIZE,
+        (type == REQ_TYPE_IN) ? DESC_F_WRITE : 0);
+    if (nsegs == -1) {
+        printk("VIRTIO_blk_transfer(): Buffer has too many segments\n");
+        dev->slots_busy &= ~(1UL << slot);
+        return -1;
+    }
+
+    // Header (device readable), data segments, then status (device writable)
+    req->hdr.type = type;
+    req->hdr.reserved = 0;
+    req->hdr.sector = sector;
+    req->status = 0xFF;
+
+    req->indirect[0].addr = req_phys + offsetof(virtio_blk_slot_t, hdr);
+    req->indirect[0].len = sizeof(virtio_blk_req_hdr_t);
+    req->indirect[0].flags = DESC_F_NEXT;
+    req->indirect[0].next = 1;
+
+    req->indirect[nsegs + 1].addr = req_phys + offsetof(virtio_blk_slot_t, status);
+    req->indirect[nsegs + 1].len = 1;
+    req->indirect[nsegs + 1].flags = DESC_F_WRITE;
+    req->indirect[nsegs + 1].next = 0;
+
+    // The ring descriptor owned by this slot points at its indirect table
+    dev->desc[slot].addr = req_phys + offsetof(virtio_blk_slot_t, indirect);
+    dev->desc[slot].len = (nsegs + 2) * sizeof(virtq_desc_t);
+    dev->desc[slot].flags = DESC_F_INDIRECT;
+    dev->desc[slot].next = 0;
+
+    int_en = check_int();
+    if (int_en) CLI;
+
+    old_idx = dev->avail->idx;
+    new_idx = old_idx + 1;
+    dev->avail->ring[old_idx % dev->queue_size] = slot;
+    mb();
+    dev->avail->idx = new_idx;
+    mb();
+
+    // Only kick the device if it hasn't suppressed notifications
+    if (!dev->event_idx || need_event(*avail_event(dev), new_idx, old_idx)) {
+        outw(REG_QUEUE_NOTIFY(dev->io_base), 0);
+    }
+
+    if (int_en) STI;
+
+    wait_event_or_halt(&dev->blocked, !(dev->slots_done & (1UL << slot)));
+
+    status = req->status;
+    dev->slots_busy &= ~(1UL << slot);
+    PROC_unblock_all(&dev->blocked);
+
+    if (status != REQ_STATUS_OK) {
+        printk("VIRTIO_blk_transfer(): Request failed with status %d\n", status);
+        return -1;
+    }
+
+    return 1;
+}
+
+// Reads count contiguous blocks into dst
+// Returns 1 on success, -1 on failure
+int VIRTIO_blk_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst) {
+    VIRTIO_blk_dev_t *vdev = (VIRTIO_blk_dev_t *)dev;
+    uint8_t *buff = (uint8_t *)dst;
+    uint32_t n;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("VIRTIO_blk_read_blocks(): Tried to read past end of drive\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        n = min(count, MAX_REQ_SECTORS);
+        if (submit_request(vdev, REQ_TYPE_IN, blk_num, n, buff) == -1) return -1;
+
+        blk_num += n;
+        count -= n;
+        buff += n * SECTOR_SIZE;
+    }
+
+    return 1;
+}
+
+// Writes count contiguous blocks from src
+// Returns 1 on success, -1 on failure
+int VIRTIO_blk_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src) {
+    VIRTIO_blk_dev_t *vdev = (VIRTIO_blk_dev_t *)dev;
+    uint8_t *buff = (uint8_t *)src;
+    uint32_t n;
+
+    if (blk_num + count > dev->tot_len) {
+        printk("VIRTIO_blk_write_blocks(): Tried to write past end of drive\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        n = min(count, MAX_REQ_SECTORS);
+        if (submit_request(vdev, REQ_TYPE_OUT, blk_num, n, buff) == -1) return -1;
+
+        blk_num += n;
+        count -= n;
+        buff += n * SECTOR_SIZE;
+    }
+
+    return 1;
+}
+
+int VIRTIO_blk_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
+    return VIRTIO_blk_read_blocks(dev, blk_num, 1, dst);
+}
+
+// Reaps the used ring, completing every request the device has finished
+void VIRTIO_blk_isr(uint8_t irq, uint32_t error_code, void *arg) {
+    VIRTIO_blk_dev_t *dev = (VIRTIO_blk_dev_t *)arg;
+    virtq_used_elem_t *elem;
+
+    // Reading ISR status acknowledges the interrupt
+    if (inb(REG_ISR_STATUS(dev->io_base)) & ISR_QUEUE) {
+        while (dev->last_used != dev->used->idx) {
+            elem = &dev->used->ring[dev->last_used % dev->queue_size];
+            dev->slots_done |= (1UL << elem->id);
+            dev->last_used++;
+        }
+
+        // Interrupt again on the next completion
+        *used_event(dev) = dev->last_used;
+        mb();
+
+        PROC_unblock_all(&dev->blocked);
+    }
+
+    IRQ_end_of_interrupt(irq);
+}
+
+// Negotiates features and sets up request queue 0
+// Returns 1 on success, -1 on failure
+static int init_device(VIRTIO_blk_dev_t *dev) {
+    uint16_t base = dev->io_base;
+    uint32_t features, ring_size;
+    physical_addr_t ring_phys;
+    int slot_pages;
+
+    // Reset, then acknowledge the device
+    outb(REG_DEVICE_STATUS(base), 0);
+    outb(REG_DEVICE_STATUS(base), STATUS_ACKNOWLEDGE);
+    outb(REG_DEVICE_STATUS(base), STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+
+    features = inl(REG_DEVICE_FEATURES(base));
+    if (!(features & F_INDIRECT_DESC)) {
+        printb("virtio_blk_init(): Device doesn't support indirect descriptors\n");
+        return -1;
+    }
+    dev->event_idx = (features & F_EVENT_IDX) != 0;
+    outl(REG_GUEST_FEATURES(base), F_INDIRECT_DESC | (features & F_EVENT_IDX));
+
+    // Legacy rings are laid out contiguously: descriptors, avail, then used on a page boundary
+    outw(REG_QUEUE_SELECT(base), 0);
+    dev->queue_size = inw(REG_QUEUE_SIZE(base));
+    if (dev->queue_size == 0) {
+        printb("virtio_blk_init(): Request queue doesn't exist\n");
+        return -1;
+    }
+
+    ring_size = align_up(sizeof(virtq_desc_t) * dev->queue_size + sizeof(uint16_t) * (3 + dev->queue_size), QUEUE_ALIGN);
+    ring_size += align_up(sizeof(uint16_t) * 3 + sizeof(virtq_used_elem_t) * dev->queue_size, QUEUE_ALIGN);
+    ring_phys = MMU_pf_alloc_contig(ring_size / PAGE_SIZE);
+    memset((void *)GET_VIRT_ADDR(ring_phys), 0, ring_size);
+
+    dev->desc = (virtq_desc_t *)GET_VIRT_ADDR(ring_phys);
+    dev->avail = (virtq_avail_t *)(dev->desc + dev->queue_size);
+    dev->used = (virtq_used_t *)align_up((virtual_addr_t)&dev->avail->ring[dev->queue_size + 1], QUEUE_ALIGN);
+
+    // Each in-flight request owns one ring descriptor and one slot
+    dev->num_slots = min(dev->queue_size, MAX_SLOTS);
+    slot_pages = align_up(dev->num_slots * sizeof(virtio_blk_slot_t), PAGE_SIZE) / PAGE_SIZE;
+    dev->slots_phys = MMU_pf_alloc_contig(slot_pages);
+    dev->slots = (virtio_blk_slot_t *)GET_VIRT_ADDR(dev->slots_phys);
+    memset(dev->slots, 0, slot_pages * PAGE_SIZE);
+
+    outl(REG_QUEUE_ADDRESS(base), ring_phys / PAGE_SIZE);
+
+    dev->dev.tot_len = inl(REG_CAPACITY(base)) | ((uint64_t)inl(REG_CAPACITY(base) + 4) << 32);
+
+    outb(REG_DEVICE_STATUS(base), STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+    return 1;
+}
+
+// Initializes every virtio block device and registers them
+// Returns the first device found, or NULL if there are none
+VIRTIO_blk_dev_t *VIRTIO_blk_probe(void) {
+    pci_dev_t *pci = NULL;
+    VIRTIO_blk_dev_t *dev;
+    char *name;
+
+    while ((pci = PCI_find_device(VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, pci)) != NULL) {
+        dev = (VIRTIO_blk_dev_t *)kcalloc(1, sizeof(VIRTIO_blk_dev_t));
+        dev->io_base = PCI_bar_addr(pci, 0);
+        PROC_init_queue(&dev->blocked);
+        PCI_enable_bus_master(pci);
+
+        IRQ_set_handler(PCI_IRQ(pci->irq_line), VIRTIO_blk_isr, dev);
+
+        if (init_device(dev) == -1) {
+            outb(REG_DEVICE_STATUS(dev->io_base), STATUS_FAILED);
+            kfree(dev);
+            continue;
+        }
+
+        IRQ_clear_mask(PCI_IRQ(pci->irq_line));
+
+        // Name the disk vdX
+        name = (char *)kmalloc(4);
+        name[0] = 'v';
+        name[1] = 'd';
+        name[2] = (char)('a' + num_disks++);
+        name[3] = '\0';
+
+        dev->dev.read_block = VIRTIO_blk_read_block;
+        dev->dev.read_blocks = VIRTIO_blk_read_blocks;
+        dev->dev.write_blocks = VIRTIO_blk_write_blocks;
+        dev->dev.blk_size = SECTOR_SIZE;
+        dev->dev.type = MASS_STORAGE;
+        dev->dev.name = name;
+        dev->dev.next = NULL;
+
+        printb("Identified virtio block device (%s), %ld sectors, queue size %d\n",
+            name, dev->dev.tot_len, dev->queue_size);
+
+        BLK_register(&dev->dev);
+        LL_APPEND(head, tail, dev);
+    }
+
+    return head;
+}
@@ -2,12 +2,17 @@
 #include "printk.h"
 #include "string.h"
 #include "page_table.h"
+#include "vma.h"
+#include "inode_cache.h"
 
 #define BITSIZE_64 2
 #define LITTLE_ENDIAN 1
 #define VERSION 1
 #define X86_64 0
 #define EXECUTABLE 2
+#define PT_LOAD 1
+#define PF_X 0x1
+#define PF_W 0x2
 
 typedef struct ELF_common_header {
     uint8_t magic[4];
@@ -56,8 +61,12 @@ virtual_addr_t ELF_mmap_binary(inode_t *root, char *path) {
     int i;
     permission_t perms;
 
-    inode = FS_inode_for_path(path, root);
+    if ((inode = FS_inode_for_path(path, root)) == NULL) {
+        printk("ELF_mmap_binary(): Failed to find %s\n", path);
+        return 0;
+    }
     file = inode->open(inode);
+    IC_put(inode);
 
     // Read ELF header
     file->read(file, (char *)&header, sizeof(ELF64_header_t));
@@ -79,17 +88,18 @@ virtual_addr_t ELF_mmap_binary(inode_t *root, char *path) {
         file->lseek(file, cursor + i * header.prog_ent_size);
         file->read(file, (char *)&prog_header, header.prog_ent_size);
 
-        // Allocate associated addresses in virtual space
-        perms.x = 1;
-        perms.w = 1;
-        user_allocate_range(prog_header.load_addr, prog_header.mem_size, perms);
+        if (prog_header.type != PT_LOAD) continue;
 
-        // Read section into memory
-        file->lseek(file, prog_header.file_offset);
-        file->read(file, (char *)prog_header.load_addr, prog_header.file_size);
+        // Map the segment, its pages are read from the page cache on first touch
+        perms.x = (prog_header.flags & PF_X) ? 1 : 0;
+        perms.w = (prog_header.flags & PF_W) ? 1 : 0;
+        if (MMU_map_file(prog_header.load_addr, prog_header.mem_size, file,
+            prog_header.file_offset, prog_header.file_size, perms) == -1)
+        {
+            return 0;
+        }
     }
 
-    file->close(&file);
-
+    // The file stays open for the mappings
     return header.prog_entry_pos;
 }
\ No newline at end of file
@@ -1,12 +1,450 @@
 #include "block.h"
 #include "ll_generic.h"
+#include "string.h"
+#include "kmalloc.h"
+#include "printk.h"
+#include "irq.h"
+#include "proc.h"
+#include "registers.h"
 #include <stddef.h>
 
+#define DEFAULT_SCHEDULER "deadline"
+#define DEFAULT_MAX_BLOCKS 256
+#define DEFAULT_MAX_SEGMENTS DEFAULT_MAX_BLOCKS     // Segments are at least a block, so no limit
+#define BLK_BATCH 16
+#define DEADLINE_EXPIRE (1UL << 30)     // TSC cycles a request may wait before it is forced out
+
 static block_dev_t *head, *tail;
+static proc_queue_t bio_waiters;
+
+static int queue_rq_sync(block_dev_t *dev, blk_request_t **rqs, int count);
 
-// Insert dev into dev list
+// Insert dev into dev list, creating a request queue unless it shares one
 // Returns 1 on success, -1 on failure
 int BLK_register(block_dev_t *dev) {
+    blk_queue_t *q;
+
+    if (dev->queue == NULL && dev->submit_bio == NULL) {
+        q = (blk_queue_t *)kcalloc(1, sizeof(blk_queue_t));
+        q->dev = dev;
+        q->sched = BLK_find_scheduler(DEFAULT_SCHEDULER);
+        q->direction = 1;
+        q->max_blocks = DEFAULT_MAX_BLOCKS;
+        q->max_segments = DEFAULT_MAX_SEGMENTS;
+        q->max_in_flight = BLK_BATCH;
+        dev->queue = q;
+    }
+
+    if (dev->queue_rq == NULL) {
+        dev->queue_rq = queue_rq_sync;
+    }
+
     LL_APPEND(head, tail, dev);
     return 1;
-}
\ No newline at end of file
+}
+
+// Returns the registered device with the given name, or NULL
+block_dev_t *BLK_get(const char *name) {
+    block_dev_t *dev;
+
+    for (dev = head; dev != NULL; dev = dev->next) {
+        if (strcmp(dev->name, name) == 0) {
+            return dev;
+        }
+    }
+
+    return NULL;
+}
+
+// Switches the I/O scheduler of the device's queue
+// Returns 1 on success, -1 if there is no such scheduler
+int BLK_set_scheduler(block_dev_t *dev, const char *name) {
+    blk_sched_t *sched = BLK_find_scheduler(name);
+
+    if (sched == NULL || dev->queue == NULL) {
+        printk("BLK_set_scheduler(): No scheduler %s\n", name);
+        return -1;
+    }
+
+    dev->queue->sched = sched;
+    return 1;
+}
+
+void BLK_bio_init(bio_t *bio, block_dev_t *dev, uint64_t blk_num, bio_end_io_f end_io, void *private) {
+    memset(bio, 0, sizeof(bio_t));
+    bio->dev = dev;
+    bio->blk_num = blk_num;
+    bio->end_io = end_io;
+    bio->private = private;
+    bio->status = BIO_PENDING;
+}
+
+// Appends a buffer to the bio's scatter-gather list
+// Returns 1 on success, -1 if the list is full or len isn't a whole number of blocks
+int BLK_bio_add(bio_t *bio, void *buff, uint32_t len) {
+    if (bio->num_vecs == BIO_MAX_VECS || len == 0 || len % bio->dev->blk_size) {
+        return -1;
+    }
+
+    bio->vecs[bio->num_vecs].buff = buff;
+    bio->vecs[bio->num_vecs].len = len;
+    bio->num_vecs++;
+    bio->num_blks += len / bio->dev->blk_size;
+    return 1;
+}
+
+static blk_request_t *get_request(blk_queue_t *q) {
+    blk_request_t *rq = q->free_rqs;
+
+    if (rq == NULL) {
+        return (blk_request_t *)kmalloc(sizeof(blk_request_t));
+    }
+
+    q->free_rqs = rq->sort_next;
+    return rq;
+}
+
+// Recycling requests in the queue keeps kfree out of interrupt context
+static void put_request(blk_queue_t *q, blk_request_t *rq) {
+    rq->sort_next = q->free_rqs;
+    q->free_rqs = rq;
+}
+
+static void sort_insert(blk_queue_t *q, blk_request_t *rq) {
+    blk_request_t *prev = NULL, *next = q->sort_head;
+
+    while (next != NULL && next->blk_num <= rq->blk_num) {
+        prev = next;
+        next = next->sort_next;
+    }
+
+    rq->sort_prev = prev;
+    rq->sort_next = next;
+    if (prev == NULL) q->sort_head = rq;
+    else prev->sort_next = rq;
+    if (next != NULL) next->sort_prev = rq;
+}
+
+static void fifo_append(blk_queue_t *q, blk_request_t *rq) {
+    rq->fifo_prev = q->fifo_tail;
+    rq->fifo_next = NULL;
+    if (q->fifo_tail == NULL) q->fifo_head = rq;
+    else q->fifo_tail->fifo_next = rq;
+    q->fifo_tail = rq;
+}
+
+static void remove_request(blk_queue_t *q, blk_request_t *rq) {
+    if (rq->sort_prev == NULL) q->sort_head = rq->sort_next;
+    else rq->sort_prev->sort_next = rq->sort_next;
+    if (rq->sort_next != NULL) rq->sort_next->sort_prev = rq->sort_prev;
+
+    if (rq->fifo_prev == NULL) q->fifo_head = rq->fifo_next;
+    else rq->fifo_prev->fifo_next = rq->fifo_next;
+    if (rq->fifo_next == NULL) q->fifo_tail = rq->fifo_prev;
+    else rq->fifo_next->fifo_prev = rq->fifo_prev;
+
+    q->num_pending--;
+}
+
+// Adds the bio to the back or front of a pending request it is adjacent to
+// Merges stay within the queue's block and segment limits, so drivers never have to split a request
+// Returns 1 if it was merged, 0 otherwise
+static int try_merge(blk_queue_t *q, bio_t *bio) {
+    blk_request_t *rq;
+
+    for (rq = q->sort_head; rq != NULL && rq->blk_num <= bio->blk_num + bio->num_blks; rq = rq->sort_next) {
+        if (rq->op != bio->op || rq->num_blks + bio->num_blks > q->max_blocks ||
+            rq->num_segs + bio->num_vecs > q->max_segments)
+        {
+            continue;
+        }
+
+        if (rq->blk_num + rq->num_blks == bio->blk_num) {
+            rq->bio_tail->next = bio;
+            rq->bio_tail = bio;
+        } else if (bio->blk_num + bio->num_blks == rq->blk_num) {
+            bio->next = rq->bio;
+            rq->bio = bio;
+            rq->blk_num = bio->blk_num;
+        } else {
+            continue;
+        }
+
+        rq->num_blks += bio->num_blks;
+        rq->num_segs += bio->num_vecs;
+        q->merges++;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Queues the bio on its device, its end_io is called once the blocks are read
+// Dispatches right away unless the queue is plugged
+void BLK_submit(bio_t *bio) {
+    block_dev_t *dev = bio->dev;
+    blk_queue_t *q;
+    blk_request_t *rq;
+    uint16_t int_en;
+    uint32_t plugged;
+
+    if (dev->submit_bio != NULL) {
+        dev->submit_bio(dev, bio);
+        return;
+    }
+
+    bio->next = NULL;
+    if (bio->num_blks == 0 || bio->blk_num + bio->num_blks > dev->tot_len ||
+        (bio->op == BIO_WRITE && dev->write_blocks == NULL))
+    {
+        printk("BLK_submit(): Bad request for %d blocks at %ld on %s\n", bio->num_blks, bio->blk_num, dev->name);
+        bio->status = -1;
+        bio->end_io(bio);
+        return;
+    }
+
+    q = dev->queue;
+    int_en = check_int();
+    if (int_en) CLI;
+
+    if (!try_merge(q, bio)) {
+        rq = get_request(q);
+        rq->dev = q->dev;
+        rq->op = bio->op;
+        rq->blk_num = bio->blk_num;
+        rq->num_blks = bio->num_blks;
+        rq->num_segs = bio->num_vecs;
+        rq->bio = bio;
+        rq->bio_tail = bio;
+        rq->expires = read_tsc() + DEADLINE_EXPIRE;
+        sort_insert(q, rq);
+        fifo_append(q, rq);
+        q->num_pending++;
+    }
+    plugged = q->plugged;
+
+    if (int_en) STI;
+
+    if (!plugged) {
+        BLK_run_queue(dev);
+    }
+}
+
+// Holds back dispatching so a burst of submissions can be merged
+void BLK_plug(block_dev_t *dev) {
+    uint16_t int_en = check_int();
+    if (int_en) CLI;
+    dev->queue->plugged++;
+    if (int_en) STI;
+}
+
+void BLK_unplug(block_dev_t *dev) {
+    uint16_t int_en = check_int();
+    uint32_t plugged;
+
+    if (int_en) CLI;
+    plugged = --dev->queue->plugged;
+    if (int_en) STI;
+
+    if (plugged == 0) {
+        BLK_run_queue(dev);
+    }
+}
+
+static blk_request_t *next_request(blk_queue_t *q) {
+    blk_request_t *rq = q->requeue;
+
+    if (rq != NULL) {
+        q->requeue = rq->sort_next;
+        return rq;
+    }
+
+    if ((rq = q->sched->next_request(q)) != NULL) {
+        remove_request(q, rq);
+        q->head_pos = rq->blk_num + rq->num_blks;
+    }
+
+    return rq;
+}
+
+// Hands the driver batches of requests until the queue is empty or the driver is full
+// Safe to call from interrupt handlers, a call made while dispatching just makes the loop run again
+void BLK_run_queue(block_dev_t *dev) {
+    blk_queue_t *q = dev->queue;
+    blk_request_t *rqs[BLK_BATCH];
+    uint16_t int_en = check_int();
+    int n, accepted;
+
+    if (int_en) CLI;
+
+    if (q->dispatching) {
+        q->rerun = 1;
+        if (int_en) STI;
+        return;
+    }
+    q->dispatching = 1;
+
+    do {
+        q->rerun = 0;
+
+        for (n = 0; n < BLK_BATCH && q->in_flight < q->max_in_flight; n++) {
+            if ((rqs[n] = next_request(q)) == NULL) break;
+            q->in_flight++;
+        }
+        if (n == 0) break;
+        q->dispatched += n;
+
+        if (int_en) STI;
+        accepted = q->dev->queue_rq(q->dev, rqs, n);
+        if (int_en) CLI;
+
+        // Put back what the driver had no room for, keeping their order
+        while (n > accepted) {
+            rqs[--n]->sort_next = q->requeue;
+            q->requeue = rqs[n];
+            q->in_flight--;
+            q->dispatched--;
+        }
+    } while (accepted > 0 || q->rerun);
+
+    q->dispatching = 0;
+    if (int_en) STI;
+}
+
+// Completes every bio of a dispatched request, then keeps the queue moving
+void BLK_end_request(blk_request_t *rq, int status) {
+    block_dev_t *dev = rq->dev;
+    blk_queue_t *q = dev->queue;
+    bio_t *bio, *next;
+    uint16_t int_en;
+
+    for (bio = rq->bio; bio != NULL; bio = next) {
+        next = bio->next;
+        bio->status = status;
+        bio->end_io(bio);
+    }
+
+    int_en = check_int();
+    if (int_en) CLI;
+    put_request(q, rq);
+    q->in_flight--;
+    if (int_en) STI;
+
+    BLK_run_queue(dev);
+}
+
+void BLK_seg_init(blk_seg_iter_t *iter, blk_request_t *rq) {
+    iter->bio = rq->bio;
+    iter->vec = 0;
+    iter->offset = 0;
+}
+
+// Gets the next run of the request's buffers that is contiguous in memory, at most max_len bytes
+// Returns 1 if there was a segment left, 0 otherwise
+int BLK_next_segment(blk_seg_iter_t *iter, uint32_t max_len, uint8_t **buff, uint32_t *len) {
+    bio_vec_t *vec;
+    uint32_t take;
+
+    *len = 0;
+    while (iter->bio != NULL && *len < max_len) {
+        vec = &iter->bio->vecs[iter->vec];
+
+        if (*len == 0) {
+            *buff = (uint8_t *)vec->buff + iter->offset;
+        } else if ((uint8_t *)vec->buff + iter->offset != *buff + *len) {
+            break;
+        }
+
+        take = vec->len - iter->offset;
+        if (take > max_len - *len) take = max_len - *len;
+        *len += take;
+        iter->offset += take;
+
+        if (iter->offset == vec->len) {
+            iter->offset = 0;
+            if (++iter->vec == iter->bio->num_vecs) {
+                iter->bio = iter->bio->next;
+                iter->vec = 0;
+            }
+        }
+    }
+
+    return *len > 0;
+}
+
+static int transfer_request(block_dev_t *dev, blk_request_t *rq) {
+    blk_seg_iter_t iter;
+    uint64_t blk_num = rq->blk_num;
+    uint32_t len, i;
+    uint8_t *buff;
+
+    BLK_seg_init(&iter, rq);
+    while (BLK_next_segment(&iter, rq->num_blks * dev->blk_size, &buff, &len)) {
+        if (rq->op == BIO_WRITE) {
+            if (dev->write_blocks(dev, blk_num, len / dev->blk_size, buff) == -1) return -1;
+        } else if (dev->read_blocks != NULL) {
+            if (dev->read_blocks(dev, blk_num, len / dev->blk_size, buff) == -1) return -1;
+        } else {
+            for (i = 0; i < len / dev->blk_size; i++) {
+                if (dev->read_block(dev, blk_num + i, buff + i * dev->blk_size) == -1) return -1;
+            }
+        }
+        blk_num += len / dev->blk_size;
+    }
+
+    return 1;
+}
+
+// Default for drivers without a request queue, each request is transferred before returning
+static int queue_rq_sync(block_dev_t *dev, blk_request_t **rqs, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        BLK_end_request(rqs[i], transfer_request(dev, rqs[i]));
+    }
+
+    return count;
+}
+
+static void wake_bio_waiters(bio_t *bio) {
+    PROC_unblock_all(&bio_waiters);
+}
+
+// Submits a bio and waits for it, replacing its end_io
+// Returns 1 on success, -1 on failure
+int BLK_submit_wait(bio_t *bio) {
+    bio->end_io = wake_bio_waiters;
+    bio->status = BIO_PENDING;
+
+    BLK_submit(bio);
+    wait_event_or_halt(&bio_waiters, bio->status == BIO_PENDING);
+
+    return bio->status;
+}
+
+// Reads count blocks through the device's request queue and waits for them
+// Returns 1 on success, -1 on failure
+int BLK_read(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst) {
+    bio_t bio;
+
+    BLK_bio_init(&bio, dev, blk_num, wake_bio_waiters, NULL);
+    if (BLK_bio_add(&bio, dst, count * dev->blk_size) == -1) {
+        return -1;
+    }
+
+    return BLK_submit_wait(&bio);
+}
+
+// Writes count blocks from src through the device's request queue and waits for them
+// Returns 1 on success, -1 on failure
+int BLK_write(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src) {
+    bio_t bio;
+
+    BLK_bio_init(&bio, dev, blk_num, wake_bio_waiters, NULL);
+    bio.op = BIO_WRITE;
+    if (BLK_bio_add(&bio, src, count * dev->blk_size) == -1) {
+        return -1;
+    }
+
+    return BLK_submit_wait(&bio);
+}
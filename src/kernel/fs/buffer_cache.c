@@ -0,0 +1,474 @@
+#include "buffer_cache.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "printk.h"
+#include "irq.h"
+#include "proc.h"
+#include "registers.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NUM_BUCKETS 256
+#define MAX_BUFFERS 1024
+#define NUM_PREFETCHES 32
+#define DIRTY_RATIO 25                  // Percent of the cache dirty that wakes the flusher
+#define DIRTY_EXPIRE (1UL << 32)        // TSC cycles a buffer may stay dirty before the flusher writes it
+
+// An asynchronous read filling several buffers
+typedef struct prefetch {
+    bio_t bio;
+    buffer_t *bufs[BIO_MAX_VECS];
+    struct prefetch *next;
+} prefetch_t;
+
+// A write of several adjacent dirty buffers
+typedef struct writeback {
+    bio_t bio;
+    buffer_t *bufs[BIO_MAX_VECS];
+} writeback_t;
+
+static buffer_t *buckets[NUM_BUCKETS];
+static buffer_t *buffers[MAX_BUFFERS];      // Every allocated buffer, swept by the clock hand
+static int clock_hand;
+static buffer_stats_t stats;
+static proc_queue_t buffer_waiters;
+static prefetch_t prefetches[NUM_PREFETCHES];
+static prefetch_t *free_prefetches;
+static uint64_t oldest_dirty;               // When the oldest dirty buffer was dirtied
+static bool flusher_started;
+static volatile bool flush_pending;
+static proc_queue_t flusher_queue;
+
+static int write_dirty(block_dev_t *dev, uint64_t dirtied_before);
+
+static inline int hash(block_dev_t *dev, uint64_t blk_num) {
+    uint64_t key = ((uint64_t)dev >> 4) ^ (blk_num * 0x9E3779B97F4A7C15UL);
+    return (key >> 32) % NUM_BUCKETS;
+}
+
+static buffer_t *lookup(block_dev_t *dev, uint64_t blk_num) {
+    buffer_t *buf;
+
+    for (buf = buckets[hash(dev, blk_num)]; buf != NULL; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->blk_num == blk_num) {
+            return buf;
+        }
+    }
+
+    return NULL;
+}
+
+static void hash_remove(buffer_t *buf) {
+    buffer_t **link = &buckets[hash(buf->dev, buf->blk_num)];
+
+    while (*link != buf) {
+        link = &(*link)->hash_next;
+    }
+    *link = buf->hash_next;
+}
+
+// Picks an unused clean buffer with the CLOCK algorithm, giving referenced buffers a second chance
+// Returns NULL if every buffer is in use or dirty
+static buffer_t *evict(void) {
+    buffer_t *buf;
+    int i;
+
+    for (i = 0; i < 2 * stats.num_buffers; i++) {
+        buf = buffers[clock_hand];
+        clock_hand = (clock_hand + 1) % stats.num_buffers;
+
+        if (buf->dev == NULL) return buf;
+        if (buf->refcount > 0 || buf->locked || (buf->flags & BUF_DIRTY)) continue;
+
+        if (buf->flags & BUF_REFERENCED) {
+            buf->flags &= ~BUF_REFERENCED;
+            continue;
+        }
+
+        if (buf->flags & BUF_READAHEAD) stats.ra_wasted++;
+        hash_remove(buf);
+        stats.evictions++;
+        return buf;
+    }
+
+    return NULL;
+}
+
+static buffer_t *alloc_buffer(block_dev_t *dev) {
+    buffer_t *buf;
+
+    if (stats.num_buffers < MAX_BUFFERS) {
+        buf = (buffer_t *)kmalloc(sizeof(buffer_t));
+        buf->data = (uint8_t *)kmalloc(dev->blk_size);
+        buf->size = dev->blk_size;
+        buffers[stats.num_buffers++] = buf;
+        return buf;
+    }
+
+    // With every buffer dirty, write them back here rather than fail
+    if ((buf = evict()) == NULL && stats.num_dirty > 0 && write_dirty(NULL, UINT64_MAX) == 1) {
+        buf = evict();
+    }
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    if (buf->size != dev->blk_size) {
+        kfree(buf->data);
+        buf->data = (uint8_t *)kmalloc(dev->blk_size);
+        buf->size = dev->blk_size;
+    }
+
+    return buf;
+}
+
+// Hashes a freshly allocated buffer in for the block, its data is not valid yet
+static void insert_buffer(buffer_t *buf, block_dev_t *dev, uint64_t blk_num) {
+    int bucket = hash(dev, blk_num);
+
+    buf->dev = dev;
+    buf->blk_num = blk_num;
+    buf->flags = 0;
+    buf->valid = 0;
+    buf->locked = 0;
+    buf->refcount = 0;
+    buf->hash_next = buckets[bucket];
+    buckets[bucket] = buf;
+}
+
+// Returns the buffer holding a device block with a reference held, reading it on a miss
+// Returns NULL if the read failed or no buffer could be freed
+buffer_t *BUF_read(block_dev_t *dev, uint64_t blk_num) {
+    buffer_t *buf;
+
+    if ((buf = lookup(dev, blk_num)) != NULL) {
+        stats.hits++;
+
+        // A prefetch may still be reading it in
+        wait_event_or_halt(&buffer_waiters, buf->locked);
+
+        if (buf->flags & BUF_READAHEAD) {
+            buf->flags &= ~BUF_READAHEAD;
+            stats.ra_used++;
+        }
+    } else {
+        stats.misses++;
+        if ((buf = alloc_buffer(dev)) == NULL) {
+            printk("BUF_read(): Every buffer is in use\n");
+            return NULL;
+        }
+        insert_buffer(buf, dev, blk_num);
+    }
+
+    buf->refcount++;
+    buf->flags |= BUF_REFERENCED;
+
+    // Invalid buffers stay hashed, so a failed read is retried here
+    if (!buf->valid) {
+        buf->locked = 1;
+        buf->valid = (BLK_read(dev, blk_num, 1, buf->data) == 1);
+        buf->locked = 0;
+        PROC_unblock_all(&buffer_waiters);
+
+        if (!buf->valid) {
+            BUF_release(buf);
+            return NULL;
+        }
+    }
+
+    return buf;
+}
+
+// Completes a prefetch, possibly from interrupt context
+static void prefetch_end_io(bio_t *bio) {
+    prefetch_t *prefetch = (prefetch_t *)bio->private;
+    uint16_t int_en;
+    int i;
+
+    for (i = 0; i < bio->num_vecs; i++) {
+        prefetch->bufs[i]->valid = (bio->status == 1);
+        prefetch->bufs[i]->locked = 0;
+    }
+    PROC_unblock_all(&buffer_waiters);
+
+    int_en = check_int();
+    if (int_en) CLI;
+    prefetch->next = free_prefetches;
+    free_prefetches = prefetch;
+    if (int_en) STI;
+}
+
+static prefetch_t *get_prefetch(block_dev_t *dev, uint64_t blk_num) {
+    static int initialized;
+    prefetch_t *prefetch;
+    uint16_t int_en;
+    int i;
+
+    int_en = check_int();
+    if (int_en) CLI;
+
+    if (!initialized) {
+        for (i = 0; i < NUM_PREFETCHES; i++) {
+            prefetches[i].next = free_prefetches;
+            free_prefetches = &prefetches[i];
+        }
+        initialized = 1;
+    }
+
+    if ((prefetch = free_prefetches) != NULL) {
+        free_prefetches = prefetch->next;
+    }
+
+    if (int_en) STI;
+
+    if (prefetch != NULL) {
+        BLK_bio_init(&prefetch->bio, dev, blk_num, prefetch_end_io, prefetch);
+    }
+    return prefetch;
+}
+
+// Starts asynchronous reads of the uncached blocks in the range, without waiting for them
+// Contiguous blocks are batched into one bio, and the queue is plugged so they can merge
+// Returns how many blocks were prefetched
+int BUF_prefetch(block_dev_t *dev, uint64_t blk_num, uint32_t count) {
+    prefetch_t *prefetch = NULL;
+    buffer_t *buf;
+    uint64_t blk, end = blk_num + count;
+    int issued = 0;
+
+    if (end > dev->tot_len) end = dev->tot_len;
+
+    BLK_plug(dev);
+
+    for (blk = blk_num; blk < end; blk++) {
+        // Cached blocks end the current run
+        if (lookup(dev, blk) != NULL) {
+            if (prefetch != NULL) BLK_submit(&prefetch->bio);
+            prefetch = NULL;
+            continue;
+        }
+
+        if (prefetch == NULL && (prefetch = get_prefetch(dev, blk)) == NULL) break;
+        if ((buf = alloc_buffer(dev)) == NULL) break;
+
+        insert_buffer(buf, dev, blk);
+        buf->flags = BUF_READAHEAD;
+        buf->locked = 1;
+        prefetch->bufs[prefetch->bio.num_vecs] = buf;
+        BLK_bio_add(&prefetch->bio, buf->data, dev->blk_size);
+        issued++;
+
+        if (prefetch->bio.num_vecs == BIO_MAX_VECS) {
+            BLK_submit(&prefetch->bio);
+            prefetch = NULL;
+        }
+    }
+
+    if (prefetch != NULL) {
+        if (prefetch->bio.num_vecs > 0) {
+            BLK_submit(&prefetch->bio);
+        } else {
+            prefetch_end_io(&prefetch->bio);
+        }
+    }
+
+    BLK_unplug(dev);
+
+    stats.ra_issued += issued;
+    return issued;
+}
+
+// Wakes the flusher once too much of the cache is dirty, or the oldest dirty buffer has expired
+// There is no timer, so ages are checked as buffers are used
+static void check_dirty(void) {
+    if (!flusher_started || flush_pending || stats.num_dirty == 0) return;
+
+    if (stats.num_dirty * 100 >= MAX_BUFFERS * DIRTY_RATIO || read_tsc() - oldest_dirty >= DIRTY_EXPIRE) {
+        flush_pending = true;
+        PROC_unblock_all(&flusher_queue);
+    }
+}
+
+// Drops a reference taken by BUF_read
+void BUF_release(buffer_t *buf) {
+    if (buf->refcount == 0) {
+        printk("BUF_release(): Buffer for block %ld is not referenced\n", buf->blk_num);
+        return;
+    }
+
+    buf->refcount--;
+    check_dirty();
+}
+
+// Marks the buffer as newer than the disk, which keeps it from being evicted until the flusher writes it
+void BUF_mark_dirty(buffer_t *buf) {
+    if (!(buf->flags & BUF_DIRTY)) {
+        buf->flags |= BUF_DIRTY;
+        buf->dirtied = read_tsc();
+        if (stats.num_dirty++ == 0) oldest_dirty = buf->dirtied;
+    }
+    check_dirty();
+}
+
+// Unlocks the written buffers, possibly from interrupt context
+static void writeback_end_io(bio_t *bio) {
+    writeback_t *wb = (writeback_t *)bio->private;
+    int i;
+
+    for (i = 0; i < bio->num_vecs; i++) {
+        wb->bufs[i]->locked = 0;
+    }
+    PROC_unblock_all(&buffer_waiters);
+}
+
+static inline bool buf_before(buffer_t *a, buffer_t *b) {
+    return (a->dev != b->dev) ? a->dev < b->dev : a->blk_num < b->blk_num;
+}
+
+// Writes back the dirty buffers of dev, or of every device if it is NULL, dirtied before the given TSC
+// Buffers are sorted by device and block so adjacent ones go out as one request, then all are waited for
+// Returns 1 on success, -1 if any write failed, those buffers stay dirty
+static int write_dirty(block_dev_t *dev, uint64_t dirtied_before) {
+    buffer_t **dirty, *buf;
+    writeback_t *wbs, *wb = NULL;
+    uint64_t oldest = UINT64_MAX;
+    int i, j, n = 0, num_wbs = 0, failed = 0;
+
+    dirty = (buffer_t **)kmalloc((stats.num_dirty + 1) * sizeof(buffer_t *));
+    for (i = 0; i < stats.num_buffers; i++) {
+        buf = buffers[i];
+        if ((dev != NULL && buf->dev != dev) || !(buf->flags & BUF_DIRTY)) continue;
+
+        if (buf->dirtied >= dirtied_before) {
+            if (buf->dirtied < oldest) oldest = buf->dirtied;
+            continue;
+        }
+
+        // Insertion sort by device and block number
+        for (j = n; j > 0 && buf_before(buf, dirty[j - 1]); j--) {
+            dirty[j] = dirty[j - 1];
+        }
+        dirty[j] = buf;
+        n++;
+    }
+
+    if (oldest != UINT64_MAX) oldest_dirty = oldest;
+    if (n == 0) {
+        kfree(dirty);
+        return 1;
+    }
+
+    wbs = (writeback_t *)kmalloc(n * sizeof(writeback_t));
+
+    for (i = 0; i < n; i++) {
+        buf = dirty[i];
+        if (wb == NULL || buf->dev != wb->bio.dev || buf->blk_num != wb->bio.blk_num + wb->bio.num_blks ||
+            wb->bio.num_vecs == BIO_MAX_VECS)
+        {
+            if (wb != NULL) BLK_submit(&wb->bio);
+
+            // Hold each device's requests until all of its writes are queued
+            if (wb == NULL || buf->dev != wb->bio.dev) {
+                if (wb != NULL) BLK_unplug(wb->bio.dev);
+                BLK_plug(buf->dev);
+            }
+
+            wb = &wbs[num_wbs++];
+            BLK_bio_init(&wb->bio, buf->dev, buf->blk_num, writeback_end_io, wb);
+            wb->bio.op = BIO_WRITE;
+        }
+
+        // Readers of a buffer being written wait until it is on disk
+        buf->flags &= ~BUF_DIRTY;
+        buf->locked = 1;
+        stats.num_dirty--;
+        wb->bufs[wb->bio.num_vecs] = buf;
+        BLK_bio_add(&wb->bio, buf->data, buf->size);
+    }
+
+    BLK_submit(&wb->bio);
+    BLK_unplug(wb->bio.dev);
+
+    for (i = 0; i < num_wbs; i++) {
+        wait_event_or_halt(&buffer_waiters, wbs[i].bio.status == BIO_PENDING);
+        if (wbs[i].bio.status == 1) continue;
+
+        failed = 1;
+        for (j = 0; j < wbs[i].bio.num_vecs; j++) {
+            BUF_mark_dirty(wbs[i].bufs[j]);
+        }
+    }
+
+    stats.writebacks += n;
+    kfree(wbs);
+    kfree(dirty);
+
+    if (failed) {
+        printk("write_dirty(): Failed to write back some buffers\n");
+        return -1;
+    }
+    return 1;
+}
+
+// Writes every dirty buffer of a device back and waits for them
+int BUF_sync(block_dev_t *dev) {
+    return write_dirty(dev, UINT64_MAX);
+}
+
+// Writes back expired buffers, or all of them when too much of the cache is dirty
+static void flusher_thread(void *arg) {
+    while (1) {
+        wait_event_interruptable(&flusher_queue, !flush_pending);
+
+        // Cleared before the pass, so a wakeup while it runs, or from buffers it dirties again, isn't lost
+        flush_pending = false;
+
+        if (stats.num_dirty * 100 >= MAX_BUFFERS * DIRTY_RATIO) {
+            write_dirty(NULL, UINT64_MAX);
+        } else {
+            write_dirty(NULL, read_tsc() - DIRTY_EXPIRE);
+        }
+
+        stats.flushes++;
+    }
+}
+
+// Starts the background flusher, until then dirty buffers are only written by BUF_sync
+void BUF_start_flusher(void) {
+    if (flusher_started) return;
+
+    PROC_init_queue(&flusher_queue);
+    PROC_create_kthread(flusher_thread, NULL);
+    flusher_started = true;
+}
+
+// Drops every clean, unused buffer of a device
+void BUF_invalidate(block_dev_t *dev) {
+    buffer_t *buf;
+    int i;
+
+    for (i = 0; i < stats.num_buffers; i++) {
+        buf = buffers[i];
+        if (buf->dev != dev || buf->refcount > 0 || buf->locked || (buf->flags & BUF_DIRTY)) continue;
+
+        if (buf->flags & BUF_READAHEAD) stats.ra_wasted++;
+        hash_remove(buf);
+        buf->dev = NULL;
+        buf->flags = 0;
+    }
+}
+
+void BUF_get_stats(buffer_stats_t *out) {
+    memcpy(out, &stats, sizeof(buffer_stats_t));
+}
+
+void BUF_print_stats(void) {
+    uint64_t lookups = stats.hits + stats.misses;
+
+    printk("Buffer cache: %ld hits, %ld misses (%ld%% hit rate), %ld evictions, %d buffers, %d dirty\n",
+        stats.hits, stats.misses, lookups ? stats.hits * 100 / lookups : 0, stats.evictions,
+        stats.num_buffers, stats.num_dirty);
+    printk("Readahead: %ld blocks prefetched, %ld used, %ld wasted\n",
+        stats.ra_issued, stats.ra_used, stats.ra_wasted);
+    printk("Write-back: %ld blocks written, %ld flusher runs\n", stats.writebacks, stats.flushes);
+}
@@ -0,0 +1,149 @@
+#include "dcache.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "printk.h"
+#include "inode_cache.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NUM_BUCKETS 256
+#define MAX_DENTRIES 1024
+
+static dentry_t *buckets[NUM_BUCKETS];
+static dentry_t *lru_head, *lru_tail;
+static dcache_stats_t stats;
+
+static inline bool fold_case(inode_t *parent) {
+    return parent->parent_superblock->flags & SB_CASE_INSENSITIVE;
+}
+
+// FNV-1a of the name, mixed with the parent so equal names in different directories spread out
+// Names are hashed in lower case on case-insensitive filesystems, so every spelling of a name finds its entry
+static uint32_t name_hash(inode_t *parent, const char *name) {
+    uint32_t hash = 2166136261U;
+    bool fold = fold_case(parent);
+    char c;
+
+    while ((c = *name++)) {
+        if (fold && c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+        hash = (hash ^ (uint8_t)c) * 16777619U;
+    }
+    return hash ^ (uint32_t)((uint64_t)parent >> 4);
+}
+
+static void lru_remove(dentry_t *dentry) {
+    if (dentry->lru_prev) dentry->lru_prev->lru_next = dentry->lru_next;
+    else lru_head = dentry->lru_next;
+
+    if (dentry->lru_next) dentry->lru_next->lru_prev = dentry->lru_prev;
+    else lru_tail = dentry->lru_prev;
+}
+
+static void lru_push(dentry_t *dentry) {
+    dentry->lru_prev = NULL;
+    dentry->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = dentry;
+    else lru_tail = dentry;
+    lru_head = dentry;
+}
+
+static dentry_t *find(inode_t *parent, const char *name, uint32_t hash) {
+    dentry_t *dentry;
+
+    for (dentry = buckets[hash % NUM_BUCKETS]; dentry != NULL; dentry = dentry->hash_next) {
+        if (dentry->hash == hash && dentry->parent == parent &&
+            (fold_case(parent) ? strcasecmp(dentry->name, name) : strcmp(dentry->name, name)) == 0)
+        {
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+static void drop(dentry_t *dentry) {
+    dentry_t **link;
+
+    link = &buckets[dentry->hash % NUM_BUCKETS];
+    while (*link != dentry) {
+        link = &(*link)->hash_next;
+    }
+    *link = dentry->hash_next;
+    lru_remove(dentry);
+
+    if (dentry->inode != NULL) {
+        IC_put(dentry->inode);
+    }
+    IC_put(dentry->parent);
+    kfree(dentry->name);
+    kfree(dentry);
+    stats.num_dentries--;
+}
+
+// Drops the least recently used dentry
+static void evict(void) {
+    drop(lru_tail);
+    stats.evictions++;
+}
+
+static dentry_t *insert(inode_t *parent, const char *name, uint32_t hash, inode_t *inode) {
+    dentry_t *dentry;
+
+    if (stats.num_dentries >= MAX_DENTRIES) {
+        evict();
+    }
+
+    // Pin the parent so its address can't be reused by another directory while this entry is keyed by it
+    dentry = (dentry_t *)kmalloc(sizeof(dentry_t));
+    dentry->parent = IC_get(parent);
+    dentry->hash = hash;
+    dentry->name = (char *)kmalloc(strlen(name) + 1);
+    memcpy(dentry->name, name, strlen(name) + 1);
+    dentry->inode = inode;
+
+    dentry->hash_next = buckets[hash % NUM_BUCKETS];
+    buckets[hash % NUM_BUCKETS] = dentry;
+    lru_push(dentry);
+    stats.num_dentries++;
+
+    return dentry;
+}
+
+// Returns the inode of name in the directory, or NULL if it doesn't exist
+// The filesystem's lookup only runs on a miss, names found missing are remembered as negative entries
+// The caller owns a reference to the returned inode
+inode_t *DC_lookup(inode_t *dir, const char *name) {
+    uint32_t hash = name_hash(dir, name);
+    dentry_t *dentry;
+
+    if ((dentry = find(dir, name, hash)) != NULL) {
+        if (dentry->inode != NULL) stats.hits++;
+        else stats.negative_hits++;
+
+        lru_remove(dentry);
+        lru_push(dentry);
+        return dentry->inode ? IC_get(dentry->inode) : NULL;
+    }
+
+    // The dentry keeps the reference lookup returns
+    stats.misses++;
+    dentry = insert(dir, name, hash, dir->lookup(dir, name));
+    return dentry->inode ? IC_get(dentry->inode) : NULL;
+}
+
+// Forgets what name in the directory resolved to, called after it is created or deleted
+void DC_invalidate(inode_t *dir, const char *name) {
+    dentry_t *dentry;
+
+    if ((dentry = find(dir, name, name_hash(dir, name))) != NULL) {
+        drop(dentry);
+    }
+}
+
+void DC_get_stats(dcache_stats_t *out) {
+    memcpy(out, &stats, sizeof(dcache_stats_t));
+}
+
+void DC_print_stats(void) {
+    printk("Dentry cache: %ld hits, %ld negative hits, %ld misses, %ld evictions, %d dentries\n",
+        stats.hits, stats.negative_hits, stats.misses, stats.evictions, stats.num_dentries);
+}
@@ -3,6 +3,14 @@
 #include "string.h"
 #include "printk.h"
 #include "memdef.h"
+#include "buffer_cache.h"
+#include "page_cache.h"
+#include "vma.h"
+#include "pf_alloc.h"
+#include "irq.h"
+#include "inode_cache.h"
+#include "proc.h"
+#include "free_map.h"
 #include <stdbool.h>
 #include <stdint-gcc.h>
 
@@ -14,10 +22,34 @@
 #define FAT_ATTR_ARCHIVE 0x20
 #define FAT_ATTR_LFN (FAT_ATTR_READ_ONLY | FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM | FAT_ATTR_VOLUME_ID)
 
+#define FAT_DELETED 0xE5
+#define FAT_NT_LOWER_BASE 0x08
+#define FAT_NT_LOWER_EXT 0x10
+#define FAT_LFN_LAST 0x40
+#define FAT_LFN_ORDER 0x3F
+
 #define MAX_DE_LEN 11
 #define MAX_LDE_LEN 255
 #define DIR_ENTS_PER_SECTOR 16
 #define TABLE_VAL_MAX 0x0FFFFFF8
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_ROOT_INO 1                                      // Other inode numbers are directory entry positions
+#define INIT_EXTENTS 4
+#define CHAIN_BATCH 64
+#define LFN_CHARS 13
+
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
+#define SYNC_DIRTY_PAGES 256                                // Pages written since the last sync that wake the sync thread
+#define WRITEBACK_BATCH 64
+
+#define FAT_CHUNK_SECTORS 8                                 // A page of table entries
+#define FAT_CHUNK_ENTRIES (FAT_CHUNK_SECTORS * 512 / 4)
+#define FAT_CACHE_CHUNKS 32
+#define FAT_BULK_CHUNKS 4                                   // Most uncached chunks read by one request
+#define FAT_WHOLE_MAX_SECTORS 512                           // Tables up to 256 KiB are read whole at mount
 
 typedef struct FAT_BPB {
     uint8_t jmp[3];
@@ -56,15 +88,86 @@ typedef struct FAT32 {
     uint8_t boot_sig[2];
 } __attribute__((packed)) FAT32_t;
 
+// Consecutive chunks of the table to write, contiguous in memory
+typedef struct FAT_span {
+    uint32_t index;
+    uint32_t count;
+    uint32_t *entries;
+} FAT_span_t;
+
+// A cached run of FAT sectors
+typedef struct FAT_chunk {
+    uint32_t index;         // Chunk number within the table
+    uint32_t *entries;
+    uint64_t last_used;
+    bool valid;
+    bool dirty;
+} FAT_chunk_t;
+
+typedef struct FAT_cache {
+    uint32_t *table;        // The whole first FAT, for small volumes
+    uint8_t *table_dirty;   // Chunks of the whole table changed since the last sync
+    FAT_chunk_t chunks[FAT_CACHE_CHUNKS];
+    uint64_t clock;
+} FAT_cache_t;
+
+// The FSInfo sector's allocation hints
+typedef struct FAT_fsinfo {
+    uint32_t lead_sig;
+    uint8_t reserved[480];
+    uint32_t struct_sig;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t reserved2[12];
+    uint32_t trail_sig;
+} __attribute__((packed)) FAT_fsinfo_t;
+
+typedef struct FAT_inode FAT_inode_t;
+
 typedef struct FAT_superblock {
     superblock_t superblock;
     FAT32_t fat32;
+    FAT_cache_t fat_cache;
+    uint32_t num_clusters;      // Highest cluster number + 1
+    free_map_t free_map;        // Bit set for each free cluster
+    uint32_t next_free;         // Where the next allocation search starts
+    bool fsinfo_valid;
+    FAT_inode_t *dirty_inodes;  // Inodes with data or metadata to write back, each holds a reference
+    FAT_inode_t *orphans;       // Deleted but still referenced, their entries can't be reused yet
+    uint64_t dirty_pages;       // Pages written since the last sync
+    volatile bool sync_pending; // Set to wake the sync thread
+    volatile bool syncing;
+    volatile bool unmounting;   // Set to stop the sync thread, which then frees the superblock
+    proc_queue_t sync_queue;    // The sync thread waits here
+    proc_queue_t sync_waiters;  // Callers of sync_fs wait here for a running sync
 } FAT_superblock_t;
 
-typedef struct FAT_inode {
+// A run of clusters that are contiguous both in the file and on disk
+typedef struct FAT_extent {
+    uint32_t file_cluster;
+    uint32_t disk_cluster;
+    uint32_t len;
+} FAT_extent_t;
+
+// A file's cluster chain, mapped lazily up to the furthest cluster accessed
+typedef struct FAT_extent_map {
+    FAT_extent_t *extents;
+    int num_extents;
+    int max_extents;
+    bool complete;          // Reached the end of the chain
+} FAT_extent_map_t;
+
+struct FAT_inode {
     inode_t inode;
-    uint8_t *data;
-} FAT_inode_t;
+    uint32_t first_cluster;     // 0 until data is written back to an empty file
+    FAT_extent_map_t map;       // Shared by every open of the file
+    bool dirty;                 // Size or first cluster differ from the entry on disk
+    bool on_dirty_list;
+    bool wb_failed;             // Data of the running writeback pass didn't reach the disk
+    FAT_inode_t *dirty_next;
+    FAT_inode_t *wb_next;       // Next inode of the running writeback pass
+    FAT_inode_t *orphan_next;
+};
 
 typedef struct FAT_dir_ent {
     char name[11];
@@ -81,6 +184,17 @@ typedef struct FAT_dir_ent {
     uint32_t size;
 } __attribute__((packed)) FAT_dir_ent_t;
 
+// Walks the raw entries of a directory
+typedef struct FAT_dir_iter {
+    FAT_superblock_t *sb;
+    uint32_t cluster_num;       // Cluster holding offset
+    uint64_t cluster_index;     // Position of cluster_num in the chain
+    uint64_t offset;            // Byte offset of the next entry
+    buffer_t *buf;
+    uint32_t buf_cluster;
+    int buf_sector;
+} FAT_dir_iter_t;
+
 typedef struct FAT_long_dir_ent {
     uint8_t order;
     uint16_t first[5];
@@ -92,59 +206,342 @@ typedef struct FAT_long_dir_ent {
     uint16_t last[2];
 } __attribute__((packed)) FAT_long_dir_ent_t;
 
-int FAT_readdir(inode_t *inode, readdir_cb callback, void *p);
+// An asynchronous transfer of file data between the disk and the page cache
+typedef struct FAT_io {
+    bio_t bio;
+    cached_page_t *pages[BIO_MAX_VECS];     // Page of each vec
+    struct FAT_io *next;
+} FAT_io_t;
+
+static FAT_io_t *free_ios;
+static proc_queue_t write_waiters;
+
+inode_t *FAT_lookup(inode_t *dir, const char *name);
+int FAT_getdents(file_t *file, dirent_t *ents, int count);
+inode_t *FAT_create(inode_t *dir, const char *name, mode_t mode);
+int FAT_unlink(inode_t *dir, const char *name);
+static int set_fat_entry(FAT_superblock_t *sb, uint32_t cluster_num, uint32_t value);
+static void free_chain(FAT_superblock_t *sb, uint32_t cluster_num);
 uint32_t get_next_cluster_num(FAT_superblock_t *sb, uint32_t current_cluster_num);
+int get_cluster_chain(FAT_superblock_t *sb, uint32_t cluster_num, uint32_t *chain, int max);
+unsigned long int min(unsigned long int a, unsigned long int b);
+
+static inline uint64_t cluster_to_sector(FAT32_t *fat32, uint32_t cluster_num) {
+    uint64_t sector_offset = fat32->FAT_BPB.reserved_sectors + fat32->sectors_per_fat * fat32->FAT_BPB.num_fats;
+    return sector_offset + (uint64_t)(cluster_num - 2) * fat32->FAT_BPB.sectors_per_cluster;
+}
 
-static inline int cluster_to_sector(FAT32_t *fat32, int cluster_num) {
-    int sector_offset = fat32->FAT_BPB.reserved_sectors + fat32->sectors_per_fat * fat32->FAT_BPB.num_fats;
-    return sector_offset + (cluster_num - 2);
+static inline uint32_t cluster_size(FAT32_t *fat32) {
+    return fat32->FAT_BPB.sectors_per_cluster * fat32->FAT_BPB.bytes_per_sector;
 }
 
+static inline char upcase(char c) {
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static inline char downcase(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// Formats an 8.3 entry as NAME.EXT, lowercasing the parts the NT flags mark as lowercase
 void get_dir_ent_name(FAT_dir_ent_t *dir_ent, char *buffer) {
-    strncpy(buffer, dir_ent->name, MAX_DE_LEN + 1);
+    int i, len = 0;
+
+    for (i = 0; i < 8 && dir_ent->name[i] != ' '; i++) {
+        buffer[len++] = (dir_ent->nt & FAT_NT_LOWER_BASE) ? downcase(dir_ent->name[i]) : dir_ent->name[i];
+    }
+
+    if (dir_ent->name[8] != ' ') {
+        buffer[len++] = '.';
+        for (i = 8; i < 11 && dir_ent->name[i] != ' '; i++) {
+            buffer[len++] = (dir_ent->nt & FAT_NT_LOWER_EXT) ? downcase(dir_ent->name[i]) : dir_ent->name[i];
+        }
+    }
+
+    // 0x05 stands in for a leading 0xE5, which marks deleted entries
+    if (buffer[0] == 0x05) buffer[0] = (char)FAT_DELETED;
+    buffer[len] = 0;
+}
+
+// Converts a name to the space padded, uppercase form 8.3 entries store
+// Returns false if the name doesn't fit 8.3
+static bool to_short_name(const char *name, char *short_name) {
+    const char *dot = NULL, *c;
+    int i;
+
+    for (c = name; *c; c++) {
+        if (*c == '.') dot = c;
+    }
+    if (dot == name) return false;
+    if (dot == NULL) dot = c;
+
+    if (dot - name > 8 || (*dot && strlen(dot + 1) > 3)) return false;
+
+    memset(short_name, ' ', MAX_DE_LEN);
+    for (i = 0; name + i < dot; i++) {
+        short_name[i] = upcase(name[i]);
+    }
+    for (i = 0; *dot && dot[i + 1]; i++) {
+        short_name[8 + i] = upcase(dot[i + 1]);
+    }
+    return true;
+}
+
+// Returns character i of the 13 a long directory entry holds
+static inline uint16_t lfn_char(FAT_long_dir_ent_t *dir_ent, int i) {
+    if (i < 5) return dir_ent->first[i];
+    if (i < 11) return dir_ent->middle[i - 5];
+    return dir_ent->last[i - 11];
 }
 
 // Takes a long directory entry and places its name at the correct position in the buffer
-void get_long_dir_ent_name(FAT_long_dir_ent_t *dir_ent, char *buffer) {
+// Returns false if the entry doesn't fit in a name
+bool get_long_dir_ent_name(FAT_long_dir_ent_t *dir_ent, char *buffer) {
     int i, num;
 
     // Position character pointer at beginning of this string portion
-    num = (dir_ent->order & 0x3F) - 1;
+    num = (dir_ent->order & FAT_LFN_ORDER) - 1;
+    if (num < 0 || num * 13 + 13 > MAX_LDE_LEN) return false;
     buffer += num * 13;
 
-    for (i = 0; i < 5; i++) {
-        buffer[i] = dir_ent->first[i] & 0xFF;
+    for (i = 0; i < 13; i++) {
+        buffer[i] = lfn_char(dir_ent, i) & 0xFF;
+    }
+
+    // The last fragment is stored first, terminate the name there
+    if (dir_ent->order & FAT_LFN_LAST) {
+        buffer[13] = 0;
+    }
+    return true;
+}
+
+// Compares a long directory entry against its part of name, ignoring case
+static bool lfn_matches(FAT_long_dir_ent_t *dir_ent, const char *name, int len) {
+    int i, pos, num = (dir_ent->order & FAT_LFN_ORDER) - 1;
+    uint16_t c;
+
+    if (num < 0 || num * 13 > len) return false;
+
+    // The last fragment must be the one holding the end of the name
+    if ((dir_ent->order & FAT_LFN_LAST) && len > num * 13 + 13) return false;
+
+    for (i = 0; i < 13; i++) {
+        pos = num * 13 + i;
+        c = lfn_char(dir_ent, i);
+
+        if (pos == len) return c == 0;
+        if (c > 0x7F || upcase(c) != upcase(name[pos])) return false;
     }
+    return true;
+}
 
-    for (i = 5; i < 11; i++) {
-        buffer[i] = dir_ent->middle[i - 5] & 0xFF;
+// Returns true if a deleted inode numbered ino is still referenced
+static bool is_orphan(FAT_superblock_t *sb, ino_t ino) {
+    FAT_inode_t *inode;
+
+    for (inode = sb->orphans; inode != NULL; inode = inode->orphan_next) {
+        if (inode->inode.st_ino == ino) return true;
     }
+    return false;
+}
 
-    for (i = 11; i < 13; i++) {
-        buffer[i] = dir_ent->last[i - 11] & 0xFF;
+static void remove_orphan(FAT_inode_t *inode) {
+    FAT_inode_t **link = &((FAT_superblock_t *)inode->inode.parent_superblock)->orphans;
+
+    while (*link != NULL && *link != inode) {
+        link = &(*link)->orphan_next;
+    }
+    if (*link != NULL) {
+        *link = inode->orphan_next;
     }
 }
 
+// Called by the inode cache once the inode is unused
+// A deleted file's clusters and cached pages are freed with its last reference
 void FAT_inode_free(inode_t **inode) {
     FAT_inode_t *FAT_inode = (FAT_inode_t *)*inode;
-    if (FAT_inode->data != NULL) {
-        kfree(FAT_inode->data);
+
+    if (FAT_inode->inode.st_nlink == 0) {
+        remove_orphan(FAT_inode);
+        free_chain((FAT_superblock_t *)FAT_inode->inode.parent_superblock, FAT_inode->first_cluster);
+        PC_remove_mapping(&FAT_inode->inode);
+    }
+    if (FAT_inode->map.extents != NULL) {
+        kfree(FAT_inode->map.extents);
+    }
+    if (FAT_inode->inode.parent_inode != NULL) {
+        IC_put(FAT_inode->inode.parent_inode);
     }
     kfree(FAT_inode);
+    *inode = NULL;
 }
 
-int FAT_read_cluster(superblock_t *sb, unsigned long cluster_num, uint8_t *buffer) {
+// Returns the cached buffer holding a sector of a cluster, release it with BUF_release
+// Reading the first sector prefetches the rest, so a cluster is read by one request
+buffer_t *FAT_get_cluster_sector(superblock_t *sb, unsigned long cluster_num, int sector) {
     FAT_superblock_t *FAT_sb = (FAT_superblock_t *)sb;
     block_dev_t *dev = FAT_sb->superblock.dev;
-    int sector_num = cluster_to_sector(&FAT_sb->fat32, cluster_num);
-    if (dev->read_block(dev, sector_num, buffer) == -1) {
+    uint64_t sector_num = cluster_to_sector(&FAT_sb->fat32, cluster_num);
+    buffer_t *buf;
+
+    if (sector == 0 && FAT_sb->fat32.FAT_BPB.sectors_per_cluster > 1) {
+        BUF_prefetch(dev, sector_num, FAT_sb->fat32.FAT_BPB.sectors_per_cluster);
+    }
+
+    if ((buf = BUF_read(dev, sector_num + sector)) == NULL) {
+        printk("FAT_get_cluster_sector(): Failed to read cluster %lu of block device\n", cluster_num);
+    }
+    return buf;
+}
+
+// Reads a whole cluster into buffer with one multi-block read
+int FAT_read_cluster(superblock_t *sb, unsigned long cluster_num, uint8_t *buffer) {
+    FAT_superblock_t *FAT_sb = (FAT_superblock_t *)sb;
+
+    if (BLK_read(sb->dev, cluster_to_sector(&FAT_sb->fat32, cluster_num),
+        FAT_sb->fat32.FAT_BPB.sectors_per_cluster, buffer) == -1)
+    {
         printk("FAT_read_cluster(): Failed to read cluster %lu of block device\n", cluster_num);
         return -1;
     }
     return 1;
 }
 
+unsigned long int min(unsigned long int a, unsigned long int b) {
+    if (a < b) return a;
+    return b;
+}
+
+static void append_extent(FAT_extent_map_t *map, uint32_t file_cluster, uint32_t disk_cluster) {
+    FAT_extent_t *extents;
+
+    if (map->num_extents == map->max_extents) {
+        map->max_extents = map->max_extents ? map->max_extents * 2 : INIT_EXTENTS;
+        extents = (FAT_extent_t *)kmalloc(map->max_extents * sizeof(FAT_extent_t));
+        if (map->extents != NULL) {
+            memcpy(extents, map->extents, map->num_extents * sizeof(FAT_extent_t));
+            kfree(map->extents);
+        }
+        map->extents = extents;
+    }
+
+    map->extents[map->num_extents].file_cluster = file_cluster;
+    map->extents[map->num_extents].disk_cluster = disk_cluster;
+    map->extents[map->num_extents].len = 1;
+    map->num_extents++;
+}
+
+// Follows the cluster chain past the mapped extents until index is mapped or the chain ends
+static void extend_map(FAT_inode_t *inode, uint64_t index) {
+    FAT_extent_map_t *map = &inode->map;
+    FAT_superblock_t *sb = (FAT_superblock_t *)inode->inode.parent_superblock;
+    FAT_extent_t *last;
+    uint32_t chain[CHAIN_BATCH];
+    int i, n;
+
+    if (map->complete) return;
+
+    if (map->num_extents == 0) {
+        if (inode->first_cluster < 2 || inode->first_cluster >= TABLE_VAL_MAX) {
+            map->complete = true;
+            return;
+        }
+        append_extent(map, 0, inode->first_cluster);
+    }
+
+    last = &map->extents[map->num_extents - 1];
+    while (!map->complete && last->file_cluster + last->len <= index) {
+        n = get_cluster_chain(sb, last->disk_cluster + last->len - 1, chain, CHAIN_BATCH);
+        if (n < CHAIN_BATCH) map->complete = true;
+
+        for (i = 0; i < n; i++) {
+            if (chain[i] == last->disk_cluster + last->len) {
+                last->len++;
+            } else {
+                append_extent(map, last->file_cluster + last->len, chain[i]);
+                last = &map->extents[map->num_extents - 1];
+            }
+        }
+    }
+}
+
+// Returns the disk cluster holding cluster index of the file, or TABLE_VAL_MAX past the end of the chain
+// The chain is only walked past what earlier calls mapped, lookups are a binary search of the extents
+static uint32_t FAT_file_cluster(FAT_inode_t *inode, uint64_t index) {
+    FAT_extent_map_t *map = &inode->map;
+    FAT_extent_t *ext;
+    int low = 0, high, mid;
+
+    extend_map(inode, index);
+
+    high = map->num_extents - 1;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        ext = &map->extents[mid];
+
+        if (index < ext->file_cluster) {
+            high = mid - 1;
+        } else if (index >= ext->file_cluster + ext->len) {
+            low = mid + 1;
+        } else {
+            return ext->disk_cluster + (index - ext->file_cluster);
+        }
+    }
+
+    return TABLE_VAL_MAX;
+}
+
+// Maps the whole chain, returning the number of clusters allocated to the file
+static uint32_t map_clusters(FAT_inode_t *inode) {
+    FAT_extent_t *last;
+
+    extend_map(inode, UINT32_MAX);
+    if (inode->map.num_extents == 0) return 0;
+
+    last = &inode->map.extents[inode->map.num_extents - 1];
+    return last->file_cluster + last->len;
+}
+
+// Forgets the mapping of clusters from index keep on, after they are freed
+static void truncate_map(FAT_extent_map_t *map, uint32_t keep) {
+    FAT_extent_t *last;
+
+    while (map->num_extents > 0 && map->extents[map->num_extents - 1].file_cluster >= keep) {
+        map->num_extents--;
+    }
+
+    if (map->num_extents > 0) {
+        last = &map->extents[map->num_extents - 1];
+        last->len = min(last->len, keep - last->file_cluster);
+    }
+}
+
+// Adds inode to the superblock's dirty list, which holds a reference until it is written back
+static void mark_inode_dirty(FAT_inode_t *inode) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)inode->inode.parent_superblock;
+
+    if (!inode->on_dirty_list) {
+        IC_get(&inode->inode);
+        inode->on_dirty_list = true;
+        inode->dirty_next = sb->dirty_inodes;
+        sb->dirty_inodes = inode;
+    }
+}
+
+// Wakes the superblock's sync thread to write back what is dirty
+static void wake_sync(FAT_superblock_t *sb) {
+    sb->sync_pending = true;
+    PROC_unblock_all(&sb->sync_queue);
+}
+
 int FAT_file_close(file_t **file) {
+    FAT_inode_t *inode = (FAT_inode_t *)(*file)->inode;
+
+    // Data written through this file goes to disk soon after it is closed
+    if (inode->on_dirty_list) {
+        wake_sync((FAT_superblock_t *)inode->inode.parent_superblock);
+    }
+    IC_put(&inode->inode);
     kfree(*file);
     return 1;
 }
@@ -154,209 +551,1473 @@ int FAT_file_lseek(file_t *file, off_t offset) {
     return 1;
 }
 
-unsigned long int min(unsigned long int a, unsigned long int b) {
-    if (a < b) return a;
-    return b;
+static void put_io(FAT_io_t *io) {
+    uint16_t int_en;
+
+    int_en = check_int();
+    if (int_en) CLI;
+    io->next = free_ios;
+    free_ios = io;
+    if (int_en) STI;
 }
 
+// Completes a read of file pages, possibly from interrupt context
+static void read_end_io(bio_t *bio) {
+    FAT_io_t *io = (FAT_io_t *)bio->private;
+    int i;
 
-int FAT_file_read(file_t *file, char *dst, int len) {
-    int i, n, cluster_offset = (file->cursor / 512);
-    uint64_t cluster_num = file->first_cluster;
-    int bytes_read = 0;
-    uint8_t data[512], *data_ptr, *data_end = data + 512;
+    for (i = 0; i < bio->num_vecs; i++) {
+        PC_page_io_done(io->pages[i], bio->status);
+    }
+    put_io(io);
+}
+
+// Wakes the writer waiting on a write of file pages
+static void write_end_io(bio_t *bio) {
+    PROC_unblock_all(&write_waiters);
+}
+
+static FAT_io_t *get_io(block_dev_t *dev, uint64_t blk_num, uint8_t op) {
+    FAT_io_t *io;
+    uint16_t int_en;
+
+    int_en = check_int();
+    if (int_en) CLI;
+    if ((io = free_ios) != NULL) {
+        free_ios = io->next;
+    }
+    if (int_en) STI;
+
+    if (io == NULL) {
+        io = (FAT_io_t *)kmalloc(sizeof(FAT_io_t));
+    }
 
-    // Get cluster where read will begin
-    for (i = 0; i < cluster_offset; i++) {
-        if (cluster_num >= TABLE_VAL_MAX) {
-            return bytes_read; // Attempted to read past end of file
+    BLK_bio_init(&io->bio, dev, blk_num, (op == BIO_WRITE) ? write_end_io : read_end_io, io);
+    io->bio.op = op;
+    io->next = NULL;
+    return io;
+}
+
+// Starts reading pages of a file straight into their frames, zeroing anything past the end of the file
+// Cluster runs that are contiguous on disk become one request, even across page boundaries
+int FAT_readpages(file_t *file, cached_page_t **pages, int count) {
+    FAT_inode_t *inode = (FAT_inode_t *)file->inode;
+    superblock_t *sb = file->inode->parent_superblock;
+    FAT32_t *fat32 = &((FAT_superblock_t *)sb)->fat32;
+    block_dev_t *dev = sb->dev;
+    uint32_t size = cluster_size(fat32), cluster_num, len;
+    uint64_t offset, end, sector, next_sector = 0;
+    cached_page_t *page;
+    FAT_io_t *io = NULL;
+    bio_vec_t *vec;
+    int i;
+
+    BLK_plug(dev);
+    for (i = 0; i < count; i++) {
+        page = pages[i];
+        offset = page->index * PAGE_SIZE;
+        end = min(offset + PAGE_SIZE, file->inode->st_size);
+        end = (end + 511) & ~511UL;
+        memset(page->data, 0, PAGE_SIZE);
+
+        // Holds the page locked until all of its reads are queued
+        PC_page_io_start(page);
+
+        while (offset < end) {
+            if ((cluster_num = FAT_file_cluster(inode, offset / size)) >= TABLE_VAL_MAX) break;
+
+            sector = cluster_to_sector(fat32, cluster_num) + (offset % size) / 512;
+            len = min(size - offset % size, end - offset);
+
+            vec = (io != NULL) ? &io->bio.vecs[io->bio.num_vecs - 1] : NULL;
+            if (io != NULL && sector == next_sector && io->pages[io->bio.num_vecs - 1] == page) {
+                // The next cluster of this page follows on disk
+                vec->len += len;
+                io->bio.num_blks += len / 512;
+            } else {
+                if (io == NULL || sector != next_sector || io->bio.num_vecs == BIO_MAX_VECS) {
+                    if (io != NULL) BLK_submit(&io->bio);
+                    io = get_io(dev, sector, BIO_READ);
+                }
+                BLK_bio_add(&io->bio, page->data + (offset - page->index * PAGE_SIZE), len);
+                io->pages[io->bio.num_vecs - 1] = page;
+                PC_page_io_start(page);
+            }
+
+            next_sector = sector + len / 512;
+            offset += len;
         }
-        cluster_num = get_next_cluster_num((FAT_superblock_t *)file->inode->parent_superblock, cluster_num);
+
+        PC_page_io_done(page, 1);
     }
 
-    for (; cluster_num < TABLE_VAL_MAX && bytes_read < len;
-        cluster_num = get_next_cluster_num((FAT_superblock_t *)file->inode->parent_superblock, cluster_num))
-    {
-        // Read the cluster's data
-        FAT_read_cluster(file->inode->parent_superblock, cluster_num, data);
+    if (io != NULL) BLK_submit(&io->bio);
+    BLK_unplug(dev);
+    return 1;
+}
 
-        // Position data pointer at correct offset
-        data_ptr = data + (file->cursor % 512);
+// Writes dirty pages of a file whose clusters are all allocated, and waits for them
+// Pages are written like FAT_readpages reads them, pages that fail to write are dirtied again
+static int write_pages(FAT_inode_t *inode, cached_page_t **pages, int count) {
+    superblock_t *sb = inode->inode.parent_superblock;
+    FAT32_t *fat32 = &((FAT_superblock_t *)sb)->fat32;
+    address_space_t *mapping = PC_get_mapping(&inode->inode);
+    block_dev_t *dev = sb->dev;
+    uint32_t size = cluster_size(fat32), cluster_num, len;
+    uint64_t offset, end, sector, next_sector = 0;
+    cached_page_t *page;
+    FAT_io_t *io = NULL, *head = NULL, *next;
+    bio_vec_t *vec;
+    int i, rc = 1;
 
-        // Copy data bytes into dest
-        n = min(len - bytes_read, min(data_end - data_ptr, file->inode->st_size - file->cursor));
-        // Need to also determine how many bytes are in the last cluster
-        for (i = 0; i < n; i++) {
-            dst[bytes_read + i] = data_ptr[i];
+    BLK_plug(dev);
+    for (i = 0; i < count; i++) {
+        page = pages[i];
+        offset = page->index * PAGE_SIZE;
+        end = min(offset + PAGE_SIZE, inode->inode.st_size);
+        end = (end + 511) & ~511UL;
+
+        // A write to the page from here on dirties it again
+        // Clean pages can be shrunk, so it stays pinned until written
+        PC_page_get(page);
+        PC_clear_dirty(mapping, page);
+
+        while (offset < end) {
+            if ((cluster_num = FAT_file_cluster(inode, offset / size)) >= TABLE_VAL_MAX) {
+                // Grown since its clusters were allocated, the rest goes out with the next sync
+                PC_mark_dirty(mapping, page);
+                break;
+            }
+
+            sector = cluster_to_sector(fat32, cluster_num) + (offset % size) / 512;
+            len = min(size - offset % size, end - offset);
+
+            vec = (io != NULL) ? &io->bio.vecs[io->bio.num_vecs - 1] : NULL;
+            if (io != NULL && sector == next_sector && io->pages[io->bio.num_vecs - 1] == page) {
+                vec->len += len;
+                io->bio.num_blks += len / 512;
+            } else {
+                if (io == NULL || sector != next_sector || io->bio.num_vecs == BIO_MAX_VECS) {
+                    if (io != NULL) BLK_submit(&io->bio);
+                    next = get_io(dev, sector, BIO_WRITE);
+                    if (io != NULL) io->next = next;
+                    else head = next;
+                    io = next;
+                }
+                BLK_bio_add(&io->bio, page->data + (offset - page->index * PAGE_SIZE), len);
+                io->pages[io->bio.num_vecs - 1] = page;
+            }
+
+            next_sector = sector + len / 512;
+            offset += len;
+        }
+    }
+
+    if (io != NULL) BLK_submit(&io->bio);
+    BLK_unplug(dev);
+
+    for (io = head; io != NULL; io = next) {
+        wait_event_or_halt(&write_waiters, io->bio.status == BIO_PENDING);
+        if (io->bio.status != 1) {
+            rc = -1;
+            for (i = 0; i < io->bio.num_vecs; i++) {
+                PC_mark_dirty(mapping, io->pages[i]);
+            }
+        }
+
+        next = io->next;
+        put_io(io);
+    }
+
+    for (i = 0; i < count; i++) {
+        PC_page_put(pages[i]);
+    }
+
+    return rc;
+}
+
+// File data is read through the page cache, so repeated opens are served from memory
+int FAT_file_read(file_t *file, char *dst, int len) {
+    return PC_read(file, dst, len);
+}
+
+// Writes zeroes from the end of the file up to size through the page cache
+// Clusters past the old end hold stale data, so growth is written out like any other data
+static int zero_fill(file_t *file, off_t size) {
+    FAT_inode_t *inode = (FAT_inode_t *)file->inode;
+    FAT_superblock_t *sb = (FAT_superblock_t *)inode->inode.parent_superblock;
+    off_t offset;
+    char *zeroes;
+    int n;
+
+    zeroes = (char *)kcalloc(1, PAGE_SIZE);
+    for (offset = inode->inode.st_size; offset < size; offset += n) {
+        n = min(PAGE_SIZE - offset % PAGE_SIZE, size - offset);
+        if (PC_pwrite(file, zeroes, n, offset) != n) {
+            kfree(zeroes);
+            return -1;
+        }
+        sb->dirty_pages++;
+    }
+    kfree(zeroes);
+    return 1;
+}
+
+// Writes only dirty the page cache, clusters are allocated and the data written by the sync thread
+int FAT_file_write(file_t *file, char *src, int len) {
+    FAT_inode_t *inode = (FAT_inode_t *)file->inode;
+    FAT_superblock_t *sb = (FAT_superblock_t *)inode->inode.parent_superblock;
+    off_t size = inode->inode.st_size;
+    int written;
+
+    // A write past the end would leave a hole over stale clusters
+    if (file->cursor > size) {
+        if (zero_fill(file, file->cursor) == -1) {
+            return -1;
         }
+        inode->dirty = true;
+        mark_inode_dirty(inode);
+        size = inode->inode.st_size;
+    }
 
-        bytes_read += i;
-        file->cursor += i;
+    if ((written = PC_write(file, src, len)) <= 0) {
+        return written;
     }
 
-    return bytes_read;
+    if (inode->inode.st_size != size) inode->dirty = true;
+    mark_inode_dirty(inode);
+
+    sb->dirty_pages += (written + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (sb->dirty_pages >= SYNC_DIRTY_PAGES) {
+        wake_sync(sb);
+    }
+    return written;
 }
 
-int FAT_file_mmap(file_t *file, void *vaddr) {
-    off_t orig_cursor = file->cursor;
-    char *addr = (char *)vaddr;
+// Frees the clusters past a smaller size right away, growth is zero filled through the page cache
+int FAT_file_truncate(file_t *file, off_t size) {
+    FAT_inode_t *inode = (FAT_inode_t *)file->inode;
+    FAT_superblock_t *sb = (FAT_superblock_t *)inode->inode.parent_superblock;
+    uint32_t csize = cluster_size(&sb->fat32), keep, last;
 
-    FAT_file_lseek(file, 0);
-    FAT_file_read(file, addr, file->inode->st_size);
-    FAT_file_lseek(file, orig_cursor);
+    if (size < inode->inode.st_size) {
+        PC_truncate(&inode->inode, size);
+        keep = (size + csize - 1) / csize;
+
+        if (keep < map_clusters(inode)) {
+            if (keep == 0) {
+                free_chain(sb, inode->first_cluster);
+                inode->first_cluster = 0;
+            } else {
+                last = FAT_file_cluster(inode, keep - 1);
+                free_chain(sb, get_next_cluster_num(sb, last));
+                set_fat_entry(sb, last, FAT_EOC);
+            }
+            truncate_map(&inode->map, keep);
+        }
+        inode->inode.st_size = size;
+    } else if (size > inode->inode.st_size) {
+        if (zero_fill(file, size) == -1) {
+            return -1;
+        }
+    } else {
+        return 1;
+    }
 
+    inode->dirty = true;
+    mark_inode_dirty(inode);
     return 1;
 }
 
+// Maps the whole file privately at vaddr, pages are read in as they are touched
+int FAT_file_mmap(file_t *file, void *vaddr) {
+    permission_t perms = {0};
+    size_t size = file->inode->st_size;
+
+    perms.w = 1;
+    return MMU_map_file((virtual_addr_t)vaddr, size, file, 0, size, perms);
+}
+
 file_t *FAT_file_open(inode_t *inode) {
-    file_t *file = (file_t *)kmalloc(sizeof(file_t));
+    file_t *file = (file_t *)kcalloc(1, sizeof(file_t));
+    bool writable = inode->parent_superblock->dev->write_blocks != NULL && !(inode->st_mode & S_IFDIR);
 
-    file->inode = inode;
-    file->first_cluster = inode->st_ino;
+    file->inode = IC_get(inode);
     file->cursor = 0;
     file->close = FAT_file_close;
     file->read = FAT_file_read;
-    file->write = NULL;
+    file->write = writable ? FAT_file_write : NULL;
+    file->truncate = writable ? FAT_file_truncate : NULL;
     file->lseek = FAT_file_lseek;
     file->mmap = FAT_file_mmap;
+    file->getdents = FAT_getdents;
 
     return file;
 }
 
-FAT_inode_t *FAT_init_inode(superblock_t *sb, unsigned long cluster_num) {
+FAT_inode_t *FAT_init_inode(superblock_t *sb, ino_t ino, uint32_t first_cluster) {
     FAT_inode_t *inode = (FAT_inode_t *)kcalloc(1, sizeof(FAT_inode_t));
-    
+    bool writable = sb->dev->write_blocks != NULL;
+
     // Set inode fields
-    inode->inode.st_ino = cluster_num;
+    inode->inode.st_ino = ino;
+    inode->inode.st_nlink = 1;
     inode->inode.parent_superblock = sb;
+    inode->first_cluster = first_cluster;
 
     // Set inode methods
-    inode->inode.readdir = FAT_readdir;
+    inode->inode.lookup = FAT_lookup;
     inode->inode.free = FAT_inode_free;
     inode->inode.open = FAT_file_open;
-    inode->inode.unlink = NULL;
+    inode->inode.readpages = FAT_readpages;
+    inode->inode.create = writable ? FAT_create : NULL;
+    inode->inode.unlink = writable ? FAT_unlink : NULL;
 
     return inode;
 }
 
-// Returns an allocated inode associated with the cluster number
-inode_t *FAT_read_inode(superblock_t *sb, unsigned long cluster_num) {
-    FAT_inode_t *inode = FAT_init_inode(sb, cluster_num);
-    inode->data = (uint8_t *)kmalloc(512);
+// Returns a reference to the inode of a directory entry, shared with every other lookup of it
+// dir is the directory holding the entry, if it is known
+static inode_t *FAT_dir_ent_inode(superblock_t *sb, inode_t *dir, FAT_dir_ent_t *dir_ent, ino_t ino) {
+    inode_t *inode;
 
-    if (FAT_read_cluster(sb, cluster_num, inode->data) == -1) {
-        return NULL;
+    if ((inode = IC_lookup(sb, ino)) != NULL) {
+        return inode;
     }
 
-    return (inode_t *)inode;
+    inode = (inode_t *)FAT_init_inode(sb, ino, (dir_ent->cluster_hi << 16) | dir_ent->cluster_lo);
+    inode->st_size = dir_ent->size;
+    inode->parent_inode = (dir != NULL) ? IC_get(dir) : NULL;
+    if (dir_ent->attr & FAT_ATTR_DIRECTORY) inode->st_mode |= S_IFDIR;
+    // TODO: set creation, mod times
+
+    return IC_insert(inode);
 }
 
-uint8_t *get_FAT(block_dev_t *dev, uint32_t fat_sector) {
-    static uint8_t cached_FAT[512];
-    static uint32_t cached_sector = 0;
+// Returns a reference to the inode numbered by the position of its directory entry
+inode_t *FAT_read_inode(superblock_t *sb, unsigned long ino) {
+    inode_t *inode;
+    buffer_t *buf;
 
-    if (cached_sector != fat_sector) {
-        dev->read_block(dev, fat_sector, cached_FAT);
-        cached_sector = fat_sector;
+    if (ino == FAT_ROOT_INO) {
+        return IC_get(sb->root_inode);
+    }
+    if ((inode = IC_lookup(sb, ino)) != NULL) {
+        return inode;
     }
 
-    return cached_FAT;
+    if ((buf = BUF_read(sb->dev, ino / DIR_ENTS_PER_SECTOR)) == NULL) {
+        return NULL;
+    }
+    inode = FAT_dir_ent_inode(sb, NULL, (FAT_dir_ent_t *)buf->data + ino % DIR_ENTS_PER_SECTOR, ino);
+    BUF_release(buf);
+    return inode;
 }
 
-uint32_t get_next_cluster_num(FAT_superblock_t *sb, uint32_t current_cluster_num) {
-    // Get FAT associated with inode
-    block_dev_t *dev = sb->superblock.dev;
-    int first_fat = sb->fat32.FAT_BPB.reserved_sectors;
-    uint32_t table_val;
-    
-    uint32_t fat_offset = current_cluster_num * 4;
-    uint32_t fat_sector = first_fat + (fat_offset / 512);
-    uint32_t ent_offset = fat_offset % 512;
-
-    table_val = *(uint32_t *)&get_FAT(dev, fat_sector)[ent_offset];
-    return table_val & 0x0FFFFFFF;
-}
-
-// Takes a directory inode
-// Calls the callback function on each entry associated with directory
-int FAT_readdir(inode_t *inode, readdir_cb callback, void *p) {
-    uint64_t cluster_num, ent_cluster_num;
-    uint8_t *data;
-    FAT_dir_ent_t *dir_ent;
-    char name[MAX_LDE_LEN + 1];
-    bool valid_classic_entry = true;
-    inode_t *ent_inode;
+static FAT_chunk_t *find_chunk(FAT_cache_t *cache, uint32_t index) {
+    int i;
 
-    if ((inode->st_mode & S_IFDIR) == 0) {
-        printk("FAT_readdir(): Attempted to read non directory\n");
-        return -1;
+    for (i = 0; i < FAT_CACHE_CHUNKS; i++) {
+        if (cache->chunks[i].valid && cache->chunks[i].index == index) {
+            return &cache->chunks[i];
+        }
     }
 
-    data = (uint8_t *)kmalloc(512);
+    return NULL;
+}
 
-    for (cluster_num = inode->st_ino; cluster_num < TABLE_VAL_MAX; 
-        cluster_num = get_next_cluster_num((FAT_superblock_t *)inode->parent_superblock, cluster_num))
-    {
-        // Read data associated with this cluster
-        FAT_read_cluster((superblock_t *)inode->parent_superblock, cluster_num, data);
+// Writes spans of the table, sorted by chunk index, to every copy of it
+// The writes to all copies are queued together, adjacent spans share a request, then all are waited for
+static int write_spans(FAT_superblock_t *sb, FAT_span_t *spans, int count) {
+    FAT32_t *fat32 = &sb->fat32;
+    block_dev_t *dev = sb->superblock.dev;
+    bio_t *bios, *bio;
+    uint64_t blk_num;
+    uint32_t sectors;
+    int i, f, num_bios = 0, rc = 1;
 
-        dir_ent = (FAT_dir_ent_t *)data;
+    if (count == 0) return 1;
 
-        while (dir_ent->name[0] != 0 && (uint8_t *)dir_ent < data + 512) {
-            if (dir_ent->attr == FAT_ATTR_LFN) {
-                // Long directory entries
-                get_long_dir_ent_name((FAT_long_dir_ent_t *)dir_ent, name);
-                valid_classic_entry = false;
-            } else {
-                // Normal directory entry
-                if (valid_classic_entry) {
-                    get_dir_ent_name(dir_ent, name);
-                } else {
-                    valid_classic_entry = true;
-                }
+    bios = (bio_t *)kmalloc(count * fat32->FAT_BPB.num_fats * sizeof(bio_t));
+    BLK_plug(dev);
 
-                if (name[0] != '.') {
-                    // Create inode for directory entry
-                    ent_cluster_num = (dir_ent->cluster_hi << 16) | dir_ent->cluster_lo;
-                    ent_inode = (inode_t *)FAT_init_inode(inode->parent_superblock, ent_cluster_num);
-                    ent_inode->st_size = dir_ent->size;
-                    ent_inode->parent_inode = inode;
-                    if (dir_ent->attr == FAT_ATTR_DIRECTORY) ent_inode->st_mode |= S_IFDIR;
-                    // TODO: set creation, mod times
+    for (f = 0; f < fat32->FAT_BPB.num_fats; f++) {
+        bio = NULL;
+        for (i = 0; i < count; i++) {
+            blk_num = fat32->FAT_BPB.reserved_sectors + f * fat32->sectors_per_fat + spans[i].index * FAT_CHUNK_SECTORS;
+            sectors = min(spans[i].count * FAT_CHUNK_SECTORS, fat32->sectors_per_fat - spans[i].index * FAT_CHUNK_SECTORS);
 
-                    callback(name, ent_inode, p);
-                }
+            if (bio == NULL || blk_num != bio->blk_num + bio->num_blks || bio->num_vecs == BIO_MAX_VECS) {
+                if (bio != NULL) BLK_submit(bio);
+                bio = &bios[num_bios++];
+                BLK_bio_init(bio, dev, blk_num, write_end_io, NULL);
+                bio->op = BIO_WRITE;
             }
-            
-            dir_ent++;
+            BLK_bio_add(bio, spans[i].entries, sectors * 512);
         }
+        BLK_submit(bio);
     }
 
-    kfree(data);
-    return 1;
+    BLK_unplug(dev);
+
+    for (i = 0; i < num_bios; i++) {
+        wait_event_or_halt(&write_waiters, bios[i].status == BIO_PENDING);
+        if (bios[i].status != 1) rc = -1;
+    }
+
+    if (rc == -1) {
+        printk("write_spans(): Failed to write the FAT of %s\n", dev->name);
+    }
+    kfree(bios);
+    return rc;
 }
 
-superblock_t *FAT_detect(block_dev_t *dev) {
-    FAT_superblock_t *superblock = (FAT_superblock_t *)kmalloc(sizeof(FAT_superblock_t));
+// Picks the least recently used chunk, giving it a frame on first use
+// A changed chunk is written back before it is reused
+static FAT_chunk_t *lru_chunk(FAT_superblock_t *sb) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    FAT_chunk_t *chunk = &cache->chunks[0];
+    int i;
 
-    dev->read_block(dev, 0, &superblock->fat32);
+    for (i = 1; i < FAT_CACHE_CHUNKS; i++) {
+        if (cache->chunks[i].last_used < chunk->last_used) {
+            chunk = &cache->chunks[i];
+        }
+    }
 
-    if (superblock->fat32.signature != 0x28 && superblock->fat32.signature != 0x29) {
-        printb("FAT_detect(): Failed to validate FAT signature\n");
-        kfree(superblock);
+    if (chunk->entries == NULL) {
+        chunk->entries = (uint32_t *)GET_VIRT_ADDR(MMU_pf_alloc());
+    }
+    if (chunk->valid && chunk->dirty) {
+        FAT_span_t span = {chunk->index, 1, chunk->entries};
+
+        write_spans(sb, &span, 1);
+        chunk->dirty = false;
+    }
+    return chunk;
+}
+
+// Reads the chunk at index, and the uncached chunks following it, with one multi-sector request
+// Returns the chunk at index, or NULL if the read failed
+static FAT_chunk_t *load_chunks(FAT_superblock_t *sb, uint32_t index) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    uint32_t num_sectors = sb->fat32.sectors_per_fat, sectors;
+    FAT_chunk_t *loaded[FAT_BULK_CHUNKS];
+    bio_t bio;
+    int i, n;
+
+    BLK_bio_init(&bio, sb->superblock.dev, sb->fat32.FAT_BPB.reserved_sectors + index * FAT_CHUNK_SECTORS, NULL, NULL);
+
+    for (n = 0; n < FAT_BULK_CHUNKS && (index + n) * FAT_CHUNK_SECTORS < num_sectors; n++) {
+        if (n > 0 && find_chunk(cache, index + n) != NULL) break;
+
+        loaded[n] = lru_chunk(sb);
+        loaded[n]->valid = false;
+        loaded[n]->index = index + n;
+        loaded[n]->last_used = ++cache->clock;
+
+        sectors = min(FAT_CHUNK_SECTORS, num_sectors - (index + n) * FAT_CHUNK_SECTORS);
+        BLK_bio_add(&bio, loaded[n]->entries, sectors * 512);
+    }
+
+    if (n == 0 || BLK_submit_wait(&bio) == -1) {
+        printk("load_chunks(): Failed to read FAT sectors at chunk %d\n", index);
+        for (i = 0; i < n; i++) loaded[i]->last_used = 0;
         return NULL;
     }
 
-    // Valid FAT32 FS, setup superblock
-    printb("Detected FAT32 filesystem on %s\n", dev->name);
-    superblock->superblock.type = "FAT32";
-    superblock->superblock.name = superblock->fat32.label;
-    superblock->superblock.dev = dev;
-    superblock->superblock.read_inode = FAT_read_inode;
+    for (i = 0; i < n; i++) loaded[i]->valid = true;
+    return loaded[0];
+}
 
-    // Setup root inode
-    superblock->superblock.root_inode = (inode_t *)FAT_init_inode((superblock_t *)superblock, superblock->fat32.root_cluster_number);
-    superblock->superblock.root_inode->st_mode |= S_IFDIR;
+// Reads the whole table at mount when it is small enough, otherwise chunks are cached as they are used
+static void init_fat_cache(FAT_superblock_t *sb) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    uint32_t num_sectors = sb->fat32.sectors_per_fat;
+
+    memset(cache, 0, sizeof(FAT_cache_t));
+    if (num_sectors > FAT_WHOLE_MAX_SECTORS) return;
+
+    cache->table = (uint32_t *)kmalloc(num_sectors * 512);
+    if (BLK_read(sb->superblock.dev, sb->fat32.FAT_BPB.reserved_sectors, num_sectors, cache->table) == -1) {
+        kfree(cache->table);
+        cache->table = NULL;
+        return;
+    }
+    cache->table_dirty = (uint8_t *)kcalloc(1, (num_sectors + FAT_CHUNK_SECTORS - 1) / FAT_CHUNK_SECTORS);
+}
+
+// Returns the FAT entry of a cluster, which is the next cluster in its chain
+// An unreadable FAT is treated as the end of the chain
+uint32_t get_next_cluster_num(FAT_superblock_t *sb, uint32_t current_cluster_num) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    uint32_t index = current_cluster_num / FAT_CHUNK_ENTRIES;
+    FAT_chunk_t *chunk;
+
+    if (current_cluster_num >= sb->fat32.sectors_per_fat * (512 / 4)) {
+        return TABLE_VAL_MAX;
+    }
+
+    if (cache->table != NULL) {
+        return cache->table[current_cluster_num] & 0x0FFFFFFF;
+    }
+
+    if ((chunk = find_chunk(cache, index)) == NULL && (chunk = load_chunks(sb, index)) == NULL) {
+        return TABLE_VAL_MAX;
+    }
+
+    chunk->last_used = ++cache->clock;
+    return chunk->entries[current_cluster_num % FAT_CHUNK_ENTRIES] & 0x0FFFFFFF;
+}
+
+// Sets the FAT entry of a cluster in the cache, it reaches the disk at the next sync
+static int set_fat_entry(FAT_superblock_t *sb, uint32_t cluster_num, uint32_t value) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    uint32_t index = cluster_num / FAT_CHUNK_ENTRIES, *entry;
+    FAT_chunk_t *chunk;
+
+    if (cluster_num >= sb->num_clusters) {
+        return -1;
+    }
+
+    if (cache->table != NULL) {
+        entry = &cache->table[cluster_num];
+        cache->table_dirty[index] = 1;
+    } else {
+        if ((chunk = find_chunk(cache, index)) == NULL && (chunk = load_chunks(sb, index)) == NULL) {
+            return -1;
+        }
+        chunk->last_used = ++cache->clock;
+        chunk->dirty = true;
+        entry = &chunk->entries[cluster_num % FAT_CHUNK_ENTRIES];
+    }
+
+    // The top 4 bits are reserved and kept as they are
+    *entry = (*entry & ~0x0FFFFFFF) | (value & 0x0FFFFFFF);
+    return 1;
+}
+
+// Writes the changed parts of the cached table to every copy of it in one batch
+static int write_fat(FAT_superblock_t *sb) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    uint32_t num_chunks = (sb->fat32.sectors_per_fat + FAT_CHUNK_SECTORS - 1) / FAT_CHUNK_SECTORS, i, j;
+    FAT_span_t *spans;
+    int n = 0, k, rc;
+
+    if (cache->table != NULL) {
+        // Runs of changed chunks are one span each
+        spans = (FAT_span_t *)kmalloc((num_chunks / 2 + 1) * sizeof(FAT_span_t));
+        for (i = 0; i < num_chunks; i = j + 1) {
+            for (j = i; j < num_chunks && cache->table_dirty[j]; j++) {
+                cache->table_dirty[j] = 0;
+            }
+
+            if (j > i) {
+                spans[n].index = i;
+                spans[n].count = j - i;
+                spans[n].entries = cache->table + i * FAT_CHUNK_ENTRIES;
+                n++;
+            }
+        }
+    } else {
+        spans = (FAT_span_t *)kmalloc(FAT_CACHE_CHUNKS * sizeof(FAT_span_t));
+        for (i = 0; i < FAT_CACHE_CHUNKS; i++) {
+            if (!cache->chunks[i].valid || !cache->chunks[i].dirty) continue;
+            cache->chunks[i].dirty = false;
+
+            // Insertion sort by index, so neighbouring chunks share requests
+            for (k = n; k > 0 && spans[k - 1].index > cache->chunks[i].index; k--) {
+                spans[k] = spans[k - 1];
+            }
+            spans[k].index = cache->chunks[i].index;
+            spans[k].count = 1;
+            spans[k].entries = cache->chunks[i].entries;
+            n++;
+        }
+    }
+
+    rc = write_spans(sb, spans, n);
+    kfree(spans);
+    return rc;
+}
+
+// Builds the free cluster map from the table at mount, setting runs of free clusters at once
+static void init_free_map(FAT_superblock_t *sb) {
+    uint32_t i, run = 0;
+
+    free_map_init(&sb->free_map, sb->num_clusters);
+
+    for (i = 2; i <= sb->num_clusters; i++) {
+        if (i < sb->num_clusters && get_next_cluster_num(sb, i) == 0) {
+            run++;
+        } else if (run > 0) {
+            free_map_set(&sb->free_map, i - run, run, true);
+            run = 0;
+        }
+    }
+}
+
+// Finds free clusters for want more clusters of a file, looking from goal, or the next free hint
+// Takes the first run long enough for all of them, otherwise the longest run
+// Returns the first cluster of the run, its length in len, or 0 if the volume is full
+static uint32_t alloc_clusters(FAT_superblock_t *sb, uint32_t goal, uint32_t want, uint32_t *len) {
+    uint64_t start, run;
+
+    if (goal < 2 || goal >= sb->num_clusters) goal = sb->next_free;
+
+    if ((start = free_map_find(&sb->free_map, goal, want, &run)) == FREE_MAP_NONE) {
+        return 0;
+    }
+
+    free_map_set(&sb->free_map, start, run, false);
+    sb->next_free = (start + run < sb->num_clusters) ? start + run : 2;
+
+    *len = run;
+    return start;
+}
+
+// Frees every cluster of the chain starting at cluster_num, contiguous parts are freed as one run
+static void free_chain(FAT_superblock_t *sb, uint32_t cluster_num) {
+    uint32_t next, start = cluster_num, run = 0, n;
+
+    for (n = 0; n < sb->num_clusters && cluster_num >= 2 && cluster_num < sb->num_clusters; n++) {
+        next = get_next_cluster_num(sb, cluster_num);
+        set_fat_entry(sb, cluster_num, 0);
+
+        if (run > 0 && cluster_num != start + run) {
+            free_map_set(&sb->free_map, start, run, true);
+            run = 0;
+        }
+        if (run == 0) start = cluster_num;
+        run++;
+        cluster_num = next;
+    }
+
+    if (run > 0) {
+        free_map_set(&sb->free_map, start, run, true);
+    }
+}
+
+// Appends a run of newly allocated clusters to the end of a file's chain
+static void link_clusters(FAT_inode_t *inode, uint32_t start, uint32_t len) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)inode->inode.parent_superblock;
+    FAT_extent_map_t *map = &inode->map;
+    uint32_t count = map_clusters(inode), i;
+    FAT_extent_t *last;
+
+    for (i = 0; i + 1 < len; i++) {
+        set_fat_entry(sb, start + i, start + i + 1);
+    }
+    set_fat_entry(sb, start + len - 1, FAT_EOC);
+
+    if (count == 0) {
+        inode->first_cluster = start;
+        inode->dirty = true;
+    } else {
+        set_fat_entry(sb, FAT_file_cluster(inode, count - 1), start);
+    }
+
+    last = (map->num_extents > 0) ? &map->extents[map->num_extents - 1] : NULL;
+    if (last != NULL && last->disk_cluster + last->len == start) {
+        last->len += len;
+    } else {
+        append_extent(map, count, start);
+        map->extents[map->num_extents - 1].len = len;
+    }
+}
+
+// Reads the free count and next free hints from the FSInfo sector
+static void read_fsinfo(FAT_superblock_t *sb) {
+    uint16_t sector = sb->fat32.fsinfo_sector;
+    FAT_fsinfo_t *info;
+    buffer_t *buf;
+
+    sb->next_free = 2;
+    if (sector == 0 || sector == 0xFFFF || (buf = BUF_read(sb->superblock.dev, sector)) == NULL) {
+        return;
+    }
+
+    info = (FAT_fsinfo_t *)buf->data;
+    if (info->lead_sig == FSINFO_LEAD_SIG && info->struct_sig == FSINFO_STRUCT_SIG) {
+        sb->fsinfo_valid = true;
+        if (info->next_free >= 2 && info->next_free < sb->num_clusters) {
+            sb->next_free = info->next_free;
+        }
+        if (info->free_count != FSINFO_UNKNOWN && info->free_count != sb->free_map.num_free) {
+            printb("FAT_detect(): FSInfo free count %u is stale, %lu clusters are free\n",
+                info->free_count, sb->free_map.num_free);
+        }
+    }
+    BUF_release(buf);
+}
+
+// Updates the FSInfo hints through the buffer cache
+static void write_fsinfo(FAT_superblock_t *sb) {
+    FAT_fsinfo_t *info;
+    buffer_t *buf;
+
+    if (!sb->fsinfo_valid || (buf = BUF_read(sb->superblock.dev, sb->fat32.fsinfo_sector)) == NULL) {
+        return;
+    }
+
+    info = (FAT_fsinfo_t *)buf->data;
+    if (info->free_count != sb->free_map.num_free || info->next_free != sb->next_free) {
+        info->free_count = sb->free_map.num_free;
+        info->next_free = sb->next_free;
+        BUF_mark_dirty(buf);
+    }
+    BUF_release(buf);
+}
+
+// Places up to max clusters following cluster_num in its chain into chain
+// Returns the number of clusters placed, fewer than max if the chain ended
+int get_cluster_chain(FAT_superblock_t *sb, uint32_t cluster_num, uint32_t *chain, int max) {
+    int n;
+
+    for (n = 0; n < max; n++) {
+        cluster_num = get_next_cluster_num(sb, cluster_num);
+        if (cluster_num < 2 || cluster_num >= TABLE_VAL_MAX) break;
+        chain[n] = cluster_num;
+    }
+
+    return n;
+}
+
+static void dir_iter_init(FAT_dir_iter_t *iter, inode_t *dir, uint64_t offset) {
+    iter->sb = (FAT_superblock_t *)dir->parent_superblock;
+    iter->cluster_num = ((FAT_inode_t *)dir)->first_cluster;
+    iter->cluster_index = 0;
+    iter->offset = offset;
+    iter->buf = NULL;
+}
+
+static void dir_iter_end(FAT_dir_iter_t *iter) {
+    if (iter->buf != NULL) {
+        BUF_release(iter->buf);
+        iter->buf = NULL;
+    }
+}
+
+// Returns the next raw entry of the directory, valid until the next call
+// Returns NULL at the end of the cluster chain, unlike dir_iter_next empty entries are returned
+static FAT_dir_ent_t *dir_iter_raw(FAT_dir_iter_t *iter) {
+    uint32_t size = cluster_size(&iter->sb->fat32);
+    FAT_dir_ent_t *dir_ent;
+    int sector = (iter->offset % size) / 512;
+
+    // Follow the chain to the cluster holding the offset
+    while (iter->cluster_index < iter->offset / size && iter->cluster_num < TABLE_VAL_MAX) {
+        iter->cluster_num = get_next_cluster_num(iter->sb, iter->cluster_num);
+        iter->cluster_index++;
+    }
+    if (iter->cluster_num < 2 || iter->cluster_num >= TABLE_VAL_MAX) {
+        return NULL;
+    }
+
+    if (iter->buf == NULL || iter->buf_cluster != iter->cluster_num || iter->buf_sector != sector) {
+        dir_iter_end(iter);
+        if ((iter->buf = FAT_get_cluster_sector((superblock_t *)iter->sb, iter->cluster_num, sector)) == NULL) {
+            return NULL;
+        }
+        iter->buf_cluster = iter->cluster_num;
+        iter->buf_sector = sector;
+    }
+
+    dir_ent = (FAT_dir_ent_t *)(iter->buf->data + iter->offset % 512);
+    iter->offset += sizeof(FAT_dir_ent_t);
+    return dir_ent;
+}
+
+// Returns the next entry of the directory, valid until the next call
+// Returns NULL at the end of the directory
+static FAT_dir_ent_t *dir_iter_next(FAT_dir_iter_t *iter) {
+    FAT_dir_ent_t *dir_ent = dir_iter_raw(iter);
+
+    // An empty entry ends the directory
+    if (dir_ent != NULL && dir_ent->name[0] == 0) {
+        iter->offset -= sizeof(FAT_dir_ent_t);
+        return NULL;
+    }
+    return dir_ent;
+}
+
+// Returns the inode number of the entry last returned, its position on disk
+static inline ino_t dir_iter_ino(FAT_dir_iter_t *iter) {
+    return iter->buf->blk_num * DIR_ENTS_PER_SECTOR + ((iter->offset - sizeof(FAT_dir_ent_t)) % 512) / sizeof(FAT_dir_ent_t);
+}
+
+// Returns true for entries that don't name a file, like volume labels and deleted or dot entries
+static inline bool skip_dir_ent(FAT_dir_ent_t *dir_ent) {
+    return (uint8_t)dir_ent->name[0] == FAT_DELETED || dir_ent->name[0] == '.' ||
+        (dir_ent->attr & FAT_ATTR_VOLUME_ID);
+}
+
+// Finds a name in a directory, stopping at the first match
+// Names are compared against the raw 8.3 and long entries, so nothing is allocated for the others
+// Returns the 8.3 entry, held by the iterator until dir_iter_end, and the offset of its first long entry in start
+static FAT_dir_ent_t *find_dir_ent(inode_t *dir, const char *name, FAT_dir_iter_t *iter, uint64_t *start) {
+    FAT_dir_ent_t *dir_ent;
+    char short_name[MAX_DE_LEN];
+    bool has_short_name = to_short_name(name, short_name), in_lfn = false, lfn_match = false;
+    uint64_t lfn_start = 0;
+    int len = strlen(name);
+
+    dir_iter_init(iter, dir, 0);
+    if ((dir->st_mode & S_IFDIR) == 0 || len == 0 || len > MAX_LDE_LEN) {
+        return NULL;
+    }
+
+    while ((dir_ent = dir_iter_next(iter)) != NULL) {
+        if ((uint8_t)dir_ent->name[0] == FAT_DELETED) {
+            in_lfn = lfn_match = false;
+        } else if (dir_ent->attr == FAT_ATTR_LFN) {
+            // Long entries run from the last fragment to the first, every one must match
+            if (((FAT_long_dir_ent_t *)dir_ent)->order & FAT_LFN_LAST) {
+                lfn_start = iter->offset - sizeof(FAT_dir_ent_t);
+                in_lfn = lfn_match = true;
+            }
+            lfn_match = lfn_match && lfn_matches((FAT_long_dir_ent_t *)dir_ent, name, len);
+        } else {
+            if (!skip_dir_ent(dir_ent) &&
+                (lfn_match || (has_short_name && memcmp(dir_ent->name, short_name, MAX_DE_LEN) == 0)))
+            {
+                *start = in_lfn ? lfn_start : iter->offset - sizeof(FAT_dir_ent_t);
+                return dir_ent;
+            }
+            in_lfn = lfn_match = false;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns a reference to the named file of the directory, or NULL if it doesn't exist
+inode_t *FAT_lookup(inode_t *dir, const char *name) {
+    FAT_dir_iter_t iter;
+    FAT_dir_ent_t *dir_ent;
+    inode_t *inode = NULL;
+    uint64_t start;
+
+    if ((dir_ent = find_dir_ent(dir, name, &iter, &start)) != NULL) {
+        inode = FAT_dir_ent_inode(dir->parent_superblock, dir, dir_ent, dir_iter_ino(&iter));
+    }
+    dir_iter_end(&iter);
+
+    return inode;
+}
+
+// Reads up to count entries of an open directory, starting from its cursor
+// The cursor is the byte offset of the next entry, so reads resume where the last batch ended
+int FAT_getdents(file_t *file, dirent_t *ents, int count) {
+    FAT_dir_iter_t iter;
+    FAT_dir_ent_t *dir_ent;
+    char name[MAX_LDE_LEN + 1];
+    bool has_long_name = false;
+    int n = 0;
+
+    if ((file->inode->st_mode & S_IFDIR) == 0) {
+        printk("FAT_getdents(): Attempted to read non directory\n");
+        return -1;
+    }
+
+    dir_iter_init(&iter, file->inode, file->cursor);
+    while (n < count && (dir_ent = dir_iter_next(&iter)) != NULL) {
+        if ((uint8_t)dir_ent->name[0] == FAT_DELETED) {
+            has_long_name = false;
+        } else if (dir_ent->attr == FAT_ATTR_LFN) {
+            // Long directory entries
+            has_long_name = get_long_dir_ent_name((FAT_long_dir_ent_t *)dir_ent, name);
+        } else {
+            // Normal directory entry
+            if (!skip_dir_ent(dir_ent)) {
+                if (!has_long_name) {
+                    get_dir_ent_name(dir_ent, name);
+                }
+
+                ents[n].d_ino = dir_iter_ino(&iter);
+                ents[n].d_mode = (dir_ent->attr & FAT_ATTR_DIRECTORY) ? S_IFDIR : S_IFREG;
+                ents[n].d_size = dir_ent->size;
+                strncpy(ents[n].d_name, name, NAME_MAX + 1);
+                n++;
+            }
+
+            has_long_name = false;
+            file->cursor = iter.offset;
+        }
+    }
+    dir_iter_end(&iter);
+
+    return n;
+}
+
+// Returns true for characters an 8.3 name can hold
+static inline bool short_char_ok(char c) {
+    return c > 0x20 && c < 0x7F && strchr("\"*+,./:;<=>?[\\]|", c) == NULL;
+}
+
+// Converts a name that fits 8.3 to the form its entry stores, with NT flags for a lowercase base or extension
+// Returns false if a long name is needed, for names too long, with other characters or in mixed case
+static bool fits_short_name(const char *name, char *short_name, uint8_t *nt) {
+    bool upper[2] = {false, false}, lower[2] = {false, false};
+    const char *dot = NULL, *c;
+    int part = 0;
+
+    if (!to_short_name(name, short_name)) return false;
+
+    for (c = name; *c; c++) {
+        if (*c == '.') dot = c;
+    }
+
+    for (c = name; *c; c++) {
+        if (c == dot) {
+            part = 1;
+            continue;
+        }
+        if (!short_char_ok(*c)) return false;
+        if (*c >= 'a' && *c <= 'z') lower[part] = true;
+        if (*c >= 'A' && *c <= 'Z') upper[part] = true;
+    }
+
+    if ((lower[0] && upper[0]) || (lower[1] && upper[1])) return false;
+    *nt = (lower[0] ? FAT_NT_LOWER_BASE : 0) | (lower[1] ? FAT_NT_LOWER_EXT : 0);
+    return true;
+}
+
+static bool short_name_exists(inode_t *dir, const char *short_name) {
+    FAT_dir_iter_t iter;
+    FAT_dir_ent_t *dir_ent;
+    bool found = false;
+
+    dir_iter_init(&iter, dir, 0);
+    while (!found && (dir_ent = dir_iter_next(&iter)) != NULL) {
+        found = dir_ent->attr != FAT_ATTR_LFN && (uint8_t)dir_ent->name[0] != FAT_DELETED &&
+            memcmp(dir_ent->name, short_name, MAX_DE_LEN) == 0;
+    }
+    dir_iter_end(&iter);
+
+    return found;
+}
+
+// Generates the BASIS~N 8.3 name stored alongside a long name, unique within the directory
+static bool make_short_name(inode_t *dir, const char *name, char *short_name) {
+    char base[8], ext[3], suffix[8];
+    const char *dot = NULL, *c;
+    int base_len = 0, ext_len = 0, suffix_len, len, i, n;
+
+    // Leading dots don't start an extension
+    for (c = name; *c; c++) {
+        if (*c == '.' && c != name) dot = c;
+    }
+
+    for (c = name; *c && c != dot; c++) {
+        if (*c == '.' || *c == ' ') continue;
+        if (base_len < 8) base[base_len++] = short_char_ok(*c) ? upcase(*c) : '_';
+    }
+    for (c = (dot != NULL) ? dot + 1 : c; *c; c++) {
+        if (*c == '.' || *c == ' ') continue;
+        if (ext_len < 3) ext[ext_len++] = short_char_ok(*c) ? upcase(*c) : '_';
+    }
+    if (base_len == 0) base[base_len++] = '_';
+
+    for (n = 1; n < 1000000; n++) {
+        suffix_len = 0;
+        for (i = n; i > 0; i /= 10) {
+            suffix[suffix_len++] = '0' + i % 10;
+        }
+        suffix[suffix_len++] = '~';
+
+        memset(short_name, ' ', MAX_DE_LEN);
+        len = min(base_len, 8 - suffix_len);
+        memcpy(short_name, base, len);
+        for (i = 0; i < suffix_len; i++) {
+            short_name[len + i] = suffix[suffix_len - 1 - i];
+        }
+        memcpy(short_name + 8, ext, ext_len);
+
+        if (!short_name_exists(dir, short_name)) return true;
+    }
+
+    return false;
+}
+
+// Checksum of the 8.3 name, stored in each of its long entries
+static uint8_t lfn_checksum(const char *short_name) {
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < MAX_DE_LEN; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i];
+    }
+    return sum;
+}
+
+// Fills long entry number order, holding characters (order - 1) * 13 on of name
+static void fill_lfn(FAT_long_dir_ent_t *dir_ent, const char *name, int len, int order, bool last, uint8_t checksum) {
+    uint16_t c;
+    int i, pos;
+
+    memset(dir_ent, 0, sizeof(FAT_long_dir_ent_t));
+    dir_ent->order = order | (last ? FAT_LFN_LAST : 0);
+    dir_ent->attr = FAT_ATTR_LFN;
+    dir_ent->checksum = checksum;
+
+    // The name is null terminated if it doesn't fill the entry, and padded with 0xFFFF after that
+    for (i = 0; i < LFN_CHARS; i++) {
+        pos = (order - 1) * LFN_CHARS + i;
+        c = (pos < len) ? (uint8_t)name[pos] : (pos == len) ? 0 : 0xFFFF;
+
+        if (i < 5) dir_ent->first[i] = c;
+        else if (i < 11) dir_ent->middle[i - 5] = c;
+        else dir_ent->last[i - 11] = c;
+    }
+}
+
+// Returns the entry at offset in the directory, held in buf until BUF_release
+static FAT_dir_ent_t *get_dir_ent(inode_t *dir, uint64_t offset, buffer_t **buf) {
+    uint32_t size = cluster_size(&((FAT_superblock_t *)dir->parent_superblock)->fat32), cluster_num;
+
+    if ((cluster_num = FAT_file_cluster((FAT_inode_t *)dir, offset / size)) >= TABLE_VAL_MAX) {
+        return NULL;
+    }
+    if ((*buf = FAT_get_cluster_sector(dir->parent_superblock, cluster_num, (offset % size) / 512)) == NULL) {
+        return NULL;
+    }
+    return (FAT_dir_ent_t *)((*buf)->data + offset % 512);
+}
+
+// Grows a directory by count zeroed clusters
+static int extend_dir(FAT_inode_t *dir, uint32_t count) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)dir->inode.parent_superblock;
+    uint32_t have = map_clusters(dir), start, len, i, j;
+    buffer_t *buf;
+
+    while (count > 0) {
+        if ((start = alloc_clusters(sb, have ? FAT_file_cluster(dir, have - 1) + 1 : 0, count, &len)) == 0) {
+            printk("extend_dir(): No free clusters\n");
+            return -1;
+        }
+        link_clusters(dir, start, len);
+
+        // Zeroed through the buffer cache, which directory reads go through
+        for (i = 0; i < len; i++) {
+            for (j = 0; j < sb->fat32.FAT_BPB.sectors_per_cluster; j++) {
+                if ((buf = FAT_get_cluster_sector(&sb->superblock, start + i, j)) == NULL) return -1;
+                memset(buf->data, 0, buf->size);
+                BUF_mark_dirty(buf);
+                BUF_release(buf);
+            }
+        }
+
+        have += len;
+        count -= len;
+    }
+    return 1;
+}
+
+// Finds count consecutive unused entries in a directory, growing it if there aren't any
+// The 8.3 entry of a deleted file that is still open isn't reused, it is still that file's inode number
+// Returns 1 and the offset of the first entry, or -1 on failure
+static int find_free_slots(inode_t *dir, int count, uint64_t *offset) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)dir->parent_superblock;
+    uint32_t size = cluster_size(&sb->fat32);
+    FAT_dir_iter_t iter;
+    FAT_dir_ent_t *dir_ent;
+    uint64_t end;
+    int run = 0;
+
+    dir_iter_init(&iter, dir, 0);
+    while (run < count && (dir_ent = dir_iter_raw(&iter)) != NULL) {
+        if (dir_ent->name[0] == 0 ||
+            ((uint8_t)dir_ent->name[0] == FAT_DELETED && (sb->orphans == NULL || !is_orphan(sb, dir_iter_ino(&iter)))))
+        {
+            if (run++ == 0) *offset = iter.offset - sizeof(FAT_dir_ent_t);
+        } else {
+            run = 0;
+        }
+    }
+    end = iter.offset;
+    dir_iter_end(&iter);
+
+    if (run == count) return 1;
+
+    // Stopped short of the end of the chain by a failed read
+    if (end < (uint64_t)map_clusters((FAT_inode_t *)dir) * size) return -1;
+
+    // Free entries at the end continue into the new clusters
+    if (run == 0) *offset = end;
+    return extend_dir((FAT_inode_t *)dir, ((count - run) * sizeof(FAT_dir_ent_t) + size - 1) / size);
+}
+
+// Allocates and zeroes the first cluster of a new directory, holding its . and .. entries
+// Returns the cluster, or 0 on failure
+static uint32_t alloc_dir_cluster(FAT_superblock_t *sb, inode_t *parent) {
+    uint32_t cluster_num, parent_cluster, len;
+    FAT_dir_ent_t *dir_ent;
+    buffer_t *buf;
+    int i;
+
+    if ((cluster_num = alloc_clusters(sb, 0, 1, &len)) == 0) {
+        return 0;
+    }
+    set_fat_entry(sb, cluster_num, FAT_EOC);
+
+    // .. of a directory in the root points at cluster 0
+    parent_cluster = (parent->st_ino == FAT_ROOT_INO) ? 0 : ((FAT_inode_t *)parent)->first_cluster;
+
+    for (i = 0; i < sb->fat32.FAT_BPB.sectors_per_cluster; i++) {
+        if ((buf = FAT_get_cluster_sector(&sb->superblock, cluster_num, i)) == NULL) {
+            free_chain(sb, cluster_num);
+            return 0;
+        }
+        memset(buf->data, 0, buf->size);
+
+        if (i == 0) {
+            dir_ent = (FAT_dir_ent_t *)buf->data;
+            memcpy(dir_ent[0].name, ".          ", 11);
+            dir_ent[0].attr = FAT_ATTR_DIRECTORY;
+            dir_ent[0].cluster_hi = cluster_num >> 16;
+            dir_ent[0].cluster_lo = cluster_num & 0xFFFF;
+            memcpy(dir_ent[1].name, "..         ", 11);
+            dir_ent[1].attr = FAT_ATTR_DIRECTORY;
+            dir_ent[1].cluster_hi = parent_cluster >> 16;
+            dir_ent[1].cluster_lo = parent_cluster & 0xFFFF;
+        }
+
+        BUF_mark_dirty(buf);
+        BUF_release(buf);
+    }
+
+    return cluster_num;
+}
+
+// Adds an empty file or directory to a directory, with long entries if the name doesn't fit 8.3
+// A file's clusters are only allocated once data is written back, a directory gets its first one here
+// The caller checks the name is unused
+inode_t *FAT_create(inode_t *dir, const char *name, mode_t mode) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)dir->parent_superblock;
+    FAT_dir_ent_t short_ent, *dir_ent;
+    buffer_t *buf;
+    uint64_t offset;
+    uint32_t cluster_num = 0;
+    uint8_t checksum;
+    int len = strlen(name), slots = 1, i;
+    ino_t ino = 0;
+
+    if ((dir->st_mode & S_IFDIR) == 0 || len == 0 || len > MAX_LDE_LEN || strchr(name, '/') != NULL) {
+        return NULL;
+    }
+
+    memset(&short_ent, 0, sizeof(FAT_dir_ent_t));
+    short_ent.attr = (mode & S_IFDIR) ? FAT_ATTR_DIRECTORY : FAT_ATTR_ARCHIVE;
+    if (!fits_short_name(name, short_ent.name, &short_ent.nt)) {
+        if (!make_short_name(dir, name, short_ent.name)) {
+            printk("FAT_create(): No unique short name for %s\n", name);
+            return NULL;
+        }
+        slots += (len + LFN_CHARS - 1) / LFN_CHARS;
+    }
+
+    if (find_free_slots(dir, slots, &offset) == -1) {
+        printk("FAT_create(): No room in directory for %s\n", name);
+        return NULL;
+    }
+
+    if (mode & S_IFDIR) {
+        if ((cluster_num = alloc_dir_cluster(sb, dir)) == 0) {
+            printk("FAT_create(): No cluster for directory %s\n", name);
+            return NULL;
+        }
+        short_ent.cluster_hi = cluster_num >> 16;
+        short_ent.cluster_lo = cluster_num & 0xFFFF;
+    }
+
+    // Long entries come first, from the last fragment of the name to the first
+    checksum = lfn_checksum(short_ent.name);
+    for (i = 0; i < slots; i++) {
+        if ((dir_ent = get_dir_ent(dir, offset + i * sizeof(FAT_dir_ent_t), &buf)) == NULL) {
+            if (cluster_num != 0) free_chain(sb, cluster_num);
+            return NULL;
+        }
+
+        if (i < slots - 1) {
+            fill_lfn((FAT_long_dir_ent_t *)dir_ent, name, len, slots - 1 - i, i == 0, checksum);
+        } else {
+            memcpy(dir_ent, &short_ent, sizeof(FAT_dir_ent_t));
+            ino = buf->blk_num * DIR_ENTS_PER_SECTOR + (dir_ent - (FAT_dir_ent_t *)buf->data);
+        }
+
+        BUF_mark_dirty(buf);
+        BUF_release(buf);
+    }
+
+    // The table has changed, only the sync thread writes it
+    if (cluster_num != 0) {
+        wake_sync(sb);
+    }
+    return FAT_dir_ent_inode(&sb->superblock, dir, &short_ent, ino);
+}
+
+// Deletes a file's entries from a directory
+// Its clusters are freed once the last reference to the inode is dropped, so open files stay readable
+int FAT_unlink(inode_t *dir, const char *name) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)dir->parent_superblock;
+    FAT_dir_iter_t iter;
+    FAT_dir_ent_t *dir_ent;
+    buffer_t *buf;
+    inode_t *inode;
+    uint64_t start, end, offset;
+
+    if ((dir_ent = find_dir_ent(dir, name, &iter, &start)) == NULL || (dir_ent->attr & FAT_ATTR_DIRECTORY)) {
+        dir_iter_end(&iter);
+        return -1;
+    }
+    inode = FAT_dir_ent_inode(dir->parent_superblock, dir, dir_ent, dir_iter_ino(&iter));
+    end = iter.offset;
+    dir_iter_end(&iter);
+
+    for (offset = start; offset < end; offset += sizeof(FAT_dir_ent_t)) {
+        if ((dir_ent = get_dir_ent(dir, offset, &buf)) == NULL) {
+            IC_put(inode);
+            return -1;
+        }
+        dir_ent->name[0] = (char)FAT_DELETED;
+        BUF_mark_dirty(buf);
+        BUF_release(buf);
+    }
+
+    // Readers that still hold the file keep its pages, a file created in its entry gets new ones
+    IC_remove(inode);
+    PC_unhash_mapping(inode);
+    if (inode->refcount > 1) {
+        ((FAT_inode_t *)inode)->orphan_next = sb->orphans;
+        sb->orphans = (FAT_inode_t *)inode;
+    }
+    IC_put(inode);
+    wake_sync(sb);
+    return 1;
+}
+
+// Allocates clusters for everything written to the file since the last sync, then writes its dirty pages
+// Delaying allocation until here lets the whole growth be placed as one contiguous run
+static int writeback_inode(FAT_superblock_t *sb, FAT_inode_t *inode) {
+    uint32_t size = cluster_size(&sb->fat32), have, need, start, len;
+    cached_page_t *pages[WRITEBACK_BATCH];
+    address_space_t *mapping;
+    uint64_t index = 0;
+    int n, rc = 1;
+
+    // A deleted file's data is dropped with it
+    if (inode->inode.st_nlink == 0) {
+        return 1;
+    }
+
+    have = map_clusters(inode);
+    need = (inode->inode.st_size + size - 1) / size;
+    while (have < need) {
+        if ((start = alloc_clusters(sb, have ? FAT_file_cluster(inode, have - 1) + 1 : 0, need - have, &len)) == 0) {
+            printk("writeback_inode(): No free clusters for inode %ld\n", inode->inode.st_ino);
+            return -1;
+        }
+        link_clusters(inode, start, len);
+        have += len;
+    }
+
+    mapping = PC_get_mapping(&inode->inode);
+    while ((n = PC_dirty_pages(mapping, index, pages, WRITEBACK_BATCH)) > 0) {
+        if (write_pages(inode, pages, n) == -1) rc = -1;
+        index = pages[n - 1]->index + 1;
+    }
+
+    return rc;
+}
+
+// Updates the size and first cluster in the file's 8.3 entry, the inode number locates it
+// Returns 1 on success, -1 on failure
+static int write_dir_ent(FAT_superblock_t *sb, FAT_inode_t *inode) {
+    FAT_dir_ent_t *dir_ent;
+    buffer_t *buf;
+
+    if (inode->dirty && inode->inode.st_nlink > 0 && inode->inode.st_ino != FAT_ROOT_INO) {
+        if ((buf = BUF_read(sb->superblock.dev, inode->inode.st_ino / DIR_ENTS_PER_SECTOR)) == NULL) {
+            return -1;
+        }
+        dir_ent = (FAT_dir_ent_t *)buf->data + inode->inode.st_ino % DIR_ENTS_PER_SECTOR;
+        dir_ent->size = inode->inode.st_size;
+        dir_ent->cluster_hi = inode->first_cluster >> 16;
+        dir_ent->cluster_lo = inode->first_cluster & 0xFFFF;
+        BUF_mark_dirty(buf);
+        BUF_release(buf);
+        inode->dirty = false;
+    }
+
+    return 1;
+}
+
+// Writes back dirty files and the table, and updates FSInfo
+// Directory and FSInfo blocks are only dirtied in the buffer cache, its flusher writes them later
+static int writeback_fs(FAT_superblock_t *sb) {
+    FAT_inode_t *list, *inode, *next;
+    bool fat_failed;
+    int rc = 1;
+
+    // One sync runs at a time, later callers wait for it and then run their own
+    wait_event_or_halt(&sb->sync_waiters, sb->syncing);
+    sb->syncing = true;
+
+    list = sb->dirty_inodes;
+    sb->dirty_inodes = NULL;
+    sb->dirty_pages = 0;
+
+    // Files dirtied again while the pass blocks are queued for the next one, so the pass keeps its own links
+    for (inode = list; inode != NULL; inode = inode->wb_next) {
+        inode->wb_next = inode->dirty_next;
+        inode->on_dirty_list = false;
+    }
+
+    // Data, then the table, then the entries, so a crash never leaves an entry claiming clusters or a size
+    // that isn't on disk yet
+    for (inode = list; inode != NULL; inode = inode->wb_next) {
+        if ((inode->wb_failed = (writeback_inode(sb, inode) == -1))) rc = -1;
+    }
+
+    if ((fat_failed = (write_fat(sb) == -1))) rc = -1;
+
+    for (inode = list; inode != NULL; inode = next) {
+        next = inode->wb_next;
+
+        if (inode->wb_failed || fat_failed || write_dir_ent(sb, inode) == -1) {
+            rc = -1;
+            mark_inode_dirty(inode);
+        }
+        IC_put(&inode->inode);
+    }
+
+    write_fsinfo(sb);
+
+    sb->syncing = false;
+    PROC_unblock_all(&sb->sync_waiters);
+    return rc;
+}
+
+// Writes back everything dirty on the filesystem, forcing out its buffers, and waits for all of it
+int FAT_sync_fs(superblock_t *superblock) {
+    int rc = writeback_fs((FAT_superblock_t *)superblock);
+
+    if (BUF_sync(superblock->dev) == -1) rc = -1;
+    return rc;
+}
+
+// Frees a superblock that was never mounted, with the caches built for it at detection
+static void free_super(FAT_superblock_t *sb) {
+    FAT_cache_t *cache = &sb->fat_cache;
+    int i;
+
+    IC_forget(sb->superblock.root_inode);
+    if (cache->table != NULL) {
+        kfree(cache->table);
+        kfree(cache->table_dirty);
+    }
+    for (i = 0; i < FAT_CACHE_CHUNKS; i++) {
+        if (cache->chunks[i].entries != NULL) {
+            MMU_pf_free(GET_PHYS_ADDR((virtual_addr_t)cache->chunks[i].entries));
+        }
+    }
+    free_map_destroy(&sb->free_map);
+    kfree(sb);
+}
+
+// Writes back dirty data in batches whenever woken, so writers don't wait for the disk
+static void sync_thread(void *arg) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)arg;
+
+    while (1) {
+        wait_event_interruptable(&sb->sync_queue, !sb->sync_pending && !sb->unmounting);
+        if (sb->unmounting) break;
+
+        sb->sync_pending = false;
+        writeback_fs(sb);
+    }
+
+    free_super(sb);
+}
+
+// Releases a superblock that failed to mount
+// Nothing of it was used, so there is nothing to write back
+void FAT_put_super(superblock_t *superblock) {
+    FAT_superblock_t *sb = (FAT_superblock_t *)superblock;
+
+    if (superblock->dev->write_blocks == NULL) {
+        free_super(sb);
+        return;
+    }
+
+    // The sync thread may hold the superblock, it frees it on its way out
+    sb->unmounting = true;
+    PROC_unblock_all(&sb->sync_queue);
+}
+
+superblock_t *FAT_detect(block_dev_t *dev) {
+    FAT_superblock_t *superblock;
+    uint64_t total_sectors, data_start;
+    buffer_t *buf;
+
+    if ((buf = BUF_read(dev, 0)) == NULL) {
+        printb("FAT_detect(): Failed to read boot sector\n");
+        return NULL;
+    }
+
+    superblock = (FAT_superblock_t *)kcalloc(1, sizeof(FAT_superblock_t));
+    memcpy(&superblock->fat32, buf->data, sizeof(FAT32_t));
+    BUF_release(buf);
+
+    if (superblock->fat32.signature != 0x28 && superblock->fat32.signature != 0x29) {
+        printb("FAT_detect(): Failed to validate FAT signature\n");
+        kfree(superblock);
+        return NULL;
+    }
+
+    if (superblock->fat32.FAT_BPB.bytes_per_sector != dev->blk_size || superblock->fat32.FAT_BPB.sectors_per_cluster == 0) {
+        printb("FAT_detect(): Unsupported geometry, %d byte sectors, %d sectors per cluster\n",
+            superblock->fat32.FAT_BPB.bytes_per_sector, superblock->fat32.FAT_BPB.sectors_per_cluster);
+        kfree(superblock);
+        return NULL;
+    }
+
+    total_sectors = superblock->fat32.FAT_BPB.tot_sectors ? superblock->fat32.FAT_BPB.tot_sectors :
+        superblock->fat32.FAT_BPB.large_sector_count;
+    data_start = cluster_to_sector(&superblock->fat32, 2);
+    if (total_sectors <= data_start) {
+        printb("FAT_detect(): No data region\n");
+        kfree(superblock);
+        return NULL;
+    }
+    superblock->num_clusters = min((total_sectors - data_start) / superblock->fat32.FAT_BPB.sectors_per_cluster + 2,
+        superblock->fat32.sectors_per_fat * (512 / 4));
+
+    // Valid FAT32 FS, setup superblock
+    printb("Detected FAT32 filesystem on %s\n", dev->name);
+    superblock->superblock.type = "FAT32";
+    superblock->superblock.name = superblock->fat32.label;
+    superblock->superblock.dev = dev;
+    superblock->superblock.flags = SB_CASE_INSENSITIVE;
+    superblock->superblock.read_inode = FAT_read_inode;
+    superblock->superblock.sync_fs = FAT_sync_fs;
+    superblock->superblock.put_super = FAT_put_super;
+    init_fat_cache(superblock);
+    init_free_map(superblock);
+    read_fsinfo(superblock);
+    printb("%lu of %u clusters free\n", superblock->free_map.num_free, superblock->num_clusters - 2);
+
+    // Setup root inode
+    superblock->superblock.root_inode = IC_insert((inode_t *)FAT_init_inode((superblock_t *)superblock,
+        FAT_ROOT_INO, superblock->fat32.root_cluster_number));
+    superblock->superblock.root_inode->st_mode |= S_IFDIR;
+
+    if (dev->write_blocks != NULL) {
+        PROC_init_queue(&superblock->sync_queue);
+        PROC_init_queue(&superblock->sync_waiters);
+        PROC_create_kthread(sync_thread, superblock);
+    }
 
     return (superblock_t *)superblock;
 }
\ No newline at end of file
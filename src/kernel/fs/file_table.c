@@ -0,0 +1,281 @@
+#include "file_table.h"
+#include "vfs.h"
+#include "inode_cache.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "printk.h"
+#include "memdef.h"
+#include "syscall.h"
+#include "splice.h"
+#include "vma.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SYS_ERR ((uint64_t)-1)
+#define MAX_IO_LEN 0x7FFFFFFF       // File ops move at most an int of bytes
+
+// Returns the open file behind a descriptor of a process, or NULL
+file_t *FD_get(process_t *proc, uint64_t fd) {
+    return (fd < PROC_MAX_FILES) ? proc->files[fd] : NULL;
+}
+
+static inline file_t *get_file(uint64_t fd) {
+    return FD_get(curr_proc, fd);
+}
+
+// Reads or writes len bytes between user memory at buf and a process's file
+// offset is where to start in the file, or IO_CURSOR to start at the file's cursor
+// Either way the cursor ends up after the bytes moved
+// Returns the number of bytes moved, or -1 on failure
+int64_t FD_transfer(process_t *proc, uint64_t fd, uint64_t buf, uint64_t len, int64_t offset, bool write) {
+    file_t *file = FD_get(proc, fd);
+    int (*op)(file_t *, char *, int);
+
+    if (file == NULL || len > MAX_IO_LEN || !user_range(buf, len)) {
+        return -1;
+    }
+    if ((op = write ? file->write : file->read) == NULL) {
+        return -1;
+    }
+    if (offset != IO_CURSOR && (offset < 0 || file->lseek == NULL || file->lseek(file, offset) != 1)) {
+        return -1;
+    }
+    return op(file, (char *)buf, (int)len);
+}
+
+// Moves data for each buffer of a user iovec array in turn, stopping early at a short transfer
+// Returns the total moved, or -1 if nothing could be
+static int64_t transfer_vec(uint64_t fd, uint64_t user_iov, uint64_t count, bool write) {
+    iovec_t *iov = (iovec_t *)user_iov;
+    int64_t total = 0, n;
+    uint64_t i;
+
+    if (count > IOV_MAX || !user_range(user_iov, count * sizeof(iovec_t))) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (iov[i].iov_len == 0) continue;
+
+        if ((n = FD_transfer(curr_proc, fd, (uint64_t)iov[i].iov_base, iov[i].iov_len, IO_CURSOR, write)) < 0) {
+            return (total > 0) ? total : -1;
+        }
+        total += n;
+        if ((uint64_t)n < iov[i].iov_len) break;
+    }
+
+    return total;
+}
+
+// Places a file in the lowest free descriptor, returns it or -1 if the table is full
+static int alloc_fd(file_t *file) {
+    int fd;
+
+    for (fd = 0; fd < PROC_MAX_FILES; fd++) {
+        if (curr_proc->files[fd] == NULL) {
+            curr_proc->files[fd] = file;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Copies a path out of user memory, returns NULL if it isn't terminated within PATH_MAX
+static char *copy_path(uint64_t user_path) {
+    char *src = (char *)user_path, *path;
+    int len;
+
+    for (len = 0; len < PATH_MAX && user_range(user_path, len + 1) && src[len]; len++);
+    if (len == 0 || len == PATH_MAX || !user_range(user_path, len + 1)) {
+        return NULL;
+    }
+
+    path = (char *)kmalloc(len + 1);
+    memcpy(path, src, len + 1);
+    return path;
+}
+
+// int open(const char *path)
+// Absolute paths start from the root mount, relative ones too as processes have no working directory
+uint64_t open_sys_call(uint64_t user_path, uint64_t arg2, uint64_t arg3) {
+    char *path;
+    inode_t *inode;
+    file_t *file;
+    int fd;
+
+    if ((path = copy_path(user_path)) == NULL || FS_root() == NULL) {
+        if (path != NULL) kfree(path);
+        return SYS_ERR;
+    }
+    inode = FS_inode_for_path(path, FS_root());
+    kfree(path);
+
+    if (inode == NULL) {
+        return SYS_ERR;
+    }
+    file = inode->open(inode);
+    IC_put(inode);
+
+    if ((fd = alloc_fd(file)) == -1) {
+        file->close(&file);
+        return SYS_ERR;
+    }
+    return fd;
+}
+
+// int read(int fd, void *buf, int len)
+uint64_t read_sys_call(uint64_t fd, uint64_t buf, uint64_t len) {
+    return (uint64_t)FD_transfer(curr_proc, fd, buf, (int)len, IO_CURSOR, false);
+}
+
+// long readv(int fd, const struct iovec *iov, int count)
+// Fills the buffers in order from one trap
+uint64_t readv_sys_call(uint64_t fd, uint64_t iov, uint64_t count) {
+    return (uint64_t)transfer_vec(fd, iov, count, false);
+}
+
+// long writev(int fd, const struct iovec *iov, int count)
+uint64_t writev_sys_call(uint64_t fd, uint64_t iov, uint64_t count) {
+    return (uint64_t)transfer_vec(fd, iov, count, true);
+}
+
+// long lseek(int fd, long offset, int whence)
+// Returns the new cursor
+uint64_t lseek_sys_call(uint64_t fd, uint64_t offset, uint64_t whence) {
+    file_t *file = get_file(fd);
+    int64_t base;
+
+    if (file == NULL || file->lseek == NULL) {
+        return SYS_ERR;
+    }
+
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = file->cursor; break;
+        case SEEK_END: base = file->inode->st_size; break;
+        default: return SYS_ERR;
+    }
+
+    if (base + (int64_t)offset < 0 || file->lseek(file, base + (int64_t)offset) != 1) {
+        return SYS_ERR;
+    }
+    return file->cursor;
+}
+
+// int close(int fd)
+uint64_t close_sys_call(uint64_t fd, uint64_t arg2, uint64_t arg3) {
+    file_t *file = get_file(fd);
+
+    if (file == NULL) {
+        return SYS_ERR;
+    }
+    curr_proc->files[fd] = NULL;
+    file->close(&file);
+    return 0;
+}
+
+// void *mmap(int fd, void *addr)
+// Maps the whole file at a page aligned address, private to the process
+// The range must not overlap anything already mapped
+// The mapping opens the file again, so it outlives the descriptor until munmap or exit
+uint64_t mmap_sys_call(uint64_t fd, uint64_t addr, uint64_t arg3) {
+    file_t *file = get_file(fd), *map_file;
+    int slot;
+
+    if (file == NULL || file->mmap == NULL || addr == 0 || addr % PAGE_SIZE != 0 ||
+        !user_range(addr, file->inode->st_size) || MMU_range_used(addr, file->inode->st_size))
+    {
+        return SYS_ERR;
+    }
+
+    for (slot = 0; slot < PROC_MAX_MAPS && curr_proc->maps[slot] != 0; slot++);
+    if (slot == PROC_MAX_MAPS) {
+        return SYS_ERR;
+    }
+
+    map_file = file->inode->open(file->inode);
+    if (map_file->mmap(map_file, (void *)addr) != 1) {
+        map_file->close(&map_file);
+        return SYS_ERR;
+    }
+    curr_proc->maps[slot] = addr;
+    return addr;
+}
+
+// Removes a mapping and closes the file behind it
+static void unmap(process_t *proc, int slot) {
+    file_t *file = MMU_unmap_file(proc->maps[slot]);
+
+    if (file != NULL) {
+        file->close(&file);
+    }
+    proc->maps[slot] = 0;
+}
+
+// int munmap(void *addr)
+// Takes down a mapping made by mmap at addr
+uint64_t munmap_sys_call(uint64_t addr, uint64_t arg2, uint64_t arg3) {
+    int slot;
+
+    for (slot = 0; slot < PROC_MAX_MAPS; slot++) {
+        if (addr != 0 && curr_proc->maps[slot] == addr) {
+            unmap(curr_proc, slot);
+            return 0;
+        }
+    }
+    return SYS_ERR;
+}
+
+// long sendfile(int out_fd, int in_fd, long len)
+// Moves up to len bytes from in_fd's cursor to a different file, the serial port, or the console
+// The data goes from the page cache to the destination without passing through user memory
+uint64_t sendfile_sys_call(uint64_t out_fd, uint64_t in_fd, uint64_t len) {
+    file_t *in = get_file(in_fd), *out;
+    int64_t moved;
+
+    if (in == NULL || (int64_t)len < 0) {
+        return SYS_ERR;
+    }
+
+    if ((int)out_fd == SENDFILE_SERIAL) {
+        moved = SPLICE_to_sink(in, &in->cursor, len, &SPLICE_serial);
+    } else if ((int)out_fd == SENDFILE_CONSOLE) {
+        moved = SPLICE_to_sink(in, &in->cursor, len, &SPLICE_console);
+    } else if ((out = get_file(out_fd)) != NULL && out->inode != in->inode) {
+        moved = SPLICE_to_file(in, &in->cursor, len, out);
+    } else {
+        return SYS_ERR;
+    }
+
+    return (uint64_t)moved;
+}
+
+// Closes every file a process left open or mapped as it exits
+void FD_close_all(process_t *proc) {
+    int fd, slot;
+
+    for (slot = 0; slot < PROC_MAX_MAPS; slot++) {
+        if (proc->maps[slot] != 0) {
+            unmap(proc, slot);
+        }
+    }
+
+    for (fd = 0; fd < PROC_MAX_FILES; fd++) {
+        if (proc->files[fd] != NULL) {
+            proc->files[fd]->close(&proc->files[fd]);
+            proc->files[fd] = NULL;
+        }
+    }
+}
+
+void FD_init(void) {
+    set_sys_call(OPEN_SYS_CALL, open_sys_call);
+    set_sys_call(READ_SYS_CALL, read_sys_call);
+    set_sys_call(LSEEK_SYS_CALL, lseek_sys_call);
+    set_sys_call(CLOSE_SYS_CALL, close_sys_call);
+    set_sys_call(MMAP_SYS_CALL, mmap_sys_call);
+    set_sys_call(MUNMAP_SYS_CALL, munmap_sys_call);
+    set_sys_call(SENDFILE_SYS_CALL, sendfile_sys_call);
+    set_sys_call(READV_SYS_CALL, readv_sys_call);
+    set_sys_call(WRITEV_SYS_CALL, writev_sys_call);
+}
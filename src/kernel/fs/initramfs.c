@@ -0,0 +1,122 @@
+#include "initramfs.h"
+#include "inode_cache.h"
+#include "string.h"
+#include "printk.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define CPIO_MAGIC "070701"
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_IFMT 0170000
+
+// Header of each entry of a newc cpio archive, numbers are 8 hex digits
+typedef struct cpio_header {
+    char magic[6];
+    char ino[8];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char nlink[8];
+    char mtime[8];
+    char filesize[8];
+    char devmajor[8];
+    char devminor[8];
+    char rdevmajor[8];
+    char rdevminor[8];
+    char namesize[8];
+    char check[8];
+} __attribute__((packed)) cpio_header_t;
+
+static inline uint64_t align4(uint64_t offset) {
+    return (offset + 3) & ~3UL;
+}
+
+static bool parse_hex(const char *field, uint32_t *value) {
+    int i;
+
+    *value = 0;
+    for (i = 0; i < 8; i++) {
+        if (field[i] >= '0' && field[i] <= '9') *value = (*value << 4) | (field[i] - '0');
+        else if (field[i] >= 'a' && field[i] <= 'f') *value = (*value << 4) | (field[i] - 'a' + 10);
+        else if (field[i] >= 'A' && field[i] <= 'F') *value = (*value << 4) | (field[i] - 'A' + 10);
+        else return false;
+    }
+    return true;
+}
+
+// Creates one entry of the archive under root, copying a file's data in with a single write
+static int unpack_entry(inode_t *root, char *name, uint32_t mode, uint8_t *data, uint32_t size) {
+    inode_t *inode;
+    file_t *file;
+    int rc = 1;
+
+    if ((inode = FS_create(name, root, ((mode & CPIO_IFMT) == S_IFDIR) ? S_IFDIR : S_IFREG)) == NULL) {
+        return -1;
+    }
+
+    if ((mode & CPIO_IFMT) == S_IFREG && size > 0) {
+        file = inode->open(inode);
+        if (file->write == NULL || file->write(file, (char *)data, size) != (int)size) {
+            rc = -1;
+        }
+        file->close(&file);
+    }
+
+    IC_put(inode);
+    return rc;
+}
+
+// Unpacks a newc cpio archive into the directory root
+// Archives list directories before their contents, other kinds of entries are skipped
+// Returns the number of entries unpacked, or -1 if the archive is malformed
+int INITRAMFS_unpack(inode_t *root, uint8_t *archive, uint64_t len) {
+    cpio_header_t *header;
+    uint64_t offset = 0;
+    uint32_t mode, size, namesize;
+    char *name;
+    int count = 0;
+
+    while (offset + sizeof(cpio_header_t) <= len) {
+        header = (cpio_header_t *)(archive + offset);
+        if (memcmp(header->magic, CPIO_MAGIC, 6) != 0 || !parse_hex(header->mode, &mode) ||
+            !parse_hex(header->filesize, &size) || !parse_hex(header->namesize, &namesize))
+        {
+            printk("INITRAMFS_unpack(): Bad header at offset %lu\n", offset);
+            return -1;
+        }
+
+        name = (char *)(header + 1);
+        if (namesize == 0 || offset + sizeof(cpio_header_t) + namesize > len || name[namesize - 1] != 0) {
+            printk("INITRAMFS_unpack(): Bad name at offset %lu\n", offset);
+            return -1;
+        }
+        if (strcmp(name, CPIO_TRAILER) == 0) {
+            return count;
+        }
+
+        offset = align4(offset + sizeof(cpio_header_t) + namesize);
+        if (offset + size > len) {
+            printk("INITRAMFS_unpack(): %s is truncated\n", name);
+            return -1;
+        }
+
+        // Names are relative to the archive's root
+        while (name[0] == '.' && name[1] == '/') name += 2;
+        while (name[0] == '/') name++;
+
+        if (name[0] != 0 && strcmp(name, ".") != 0) {
+            if ((mode & CPIO_IFMT) != S_IFDIR && (mode & CPIO_IFMT) != S_IFREG) {
+                printk("INITRAMFS_unpack(): Skipping %s, mode 0x%x\n", name, mode);
+            } else if (unpack_entry(root, name, mode, archive + offset, size) == -1) {
+                printk("INITRAMFS_unpack(): Failed to unpack %s\n", name);
+            } else {
+                count++;
+            }
+        }
+
+        offset = align4(offset + size);
+    }
+
+    printk("INITRAMFS_unpack(): Archive has no trailer\n");
+    return count;
+}
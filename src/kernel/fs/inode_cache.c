@@ -0,0 +1,153 @@
+#include "inode_cache.h"
+#include "pf_alloc.h"
+#include "string.h"
+#include "printk.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NUM_BUCKETS 256
+
+static inode_t *buckets[NUM_BUCKETS];
+static inode_t *unused_head, *unused_tail;
+static inode_cache_stats_t stats;
+
+static inline int hash(superblock_t *sb, ino_t ino) {
+    return ((((uint64_t)sb >> 4) ^ (ino * 0x9E3779B97F4A7C15UL)) >> 32) % NUM_BUCKETS;
+}
+
+static void unused_remove(inode_t *inode) {
+    if (inode->unused_prev) inode->unused_prev->unused_next = inode->unused_next;
+    else unused_head = inode->unused_next;
+
+    if (inode->unused_next) inode->unused_next->unused_prev = inode->unused_prev;
+    else unused_tail = inode->unused_prev;
+
+    stats.num_unused--;
+}
+
+static void unused_push(inode_t *inode) {
+    inode->unused_prev = NULL;
+    inode->unused_next = unused_head;
+    if (unused_head) unused_head->unused_prev = inode;
+    else unused_tail = inode;
+    unused_head = inode;
+
+    stats.num_unused++;
+}
+
+static void hash_remove(inode_t *inode) {
+    inode_t **link = &buckets[hash(inode->parent_superblock, inode->st_ino)];
+
+    while (*link != inode) {
+        link = &(*link)->hash_next;
+    }
+    *link = inode->hash_next;
+}
+
+// Returns a reference to the cached inode, or NULL if it isn't cached
+inode_t *IC_lookup(superblock_t *sb, ino_t ino) {
+    inode_t *inode;
+
+    for (inode = buckets[hash(sb, ino)]; inode != NULL; inode = inode->hash_next) {
+        if (inode->parent_superblock == sb && inode->st_ino == ino) {
+            stats.hits++;
+            return IC_get(inode);
+        }
+    }
+
+    stats.misses++;
+    return NULL;
+}
+
+// Caches a newly read inode, returning it with one reference
+inode_t *IC_insert(inode_t *inode) {
+    int bucket = hash(inode->parent_superblock, inode->st_ino);
+
+    inode->refcount = 1;
+    inode->hash_next = buckets[bucket];
+    buckets[bucket] = inode;
+    stats.num_inodes++;
+
+    return inode;
+}
+
+// Called once a file's name is deleted, so lookups can't find it and its number can be reused
+// The inode is freed when the last open of it is closed
+void IC_remove(inode_t *inode) {
+    if (inode->st_nlink > 0) {
+        hash_remove(inode);
+        inode->st_nlink = 0;
+    }
+}
+
+// Takes another reference to an inode
+inode_t *IC_get(inode_t *inode) {
+    if (inode->refcount++ == 0) {
+        unused_remove(inode);
+    }
+    return inode;
+}
+
+static void destroy(inode_t *inode) {
+    if (inode->st_nlink > 0) {
+        hash_remove(inode);
+    }
+    stats.num_inodes--;
+    inode->free(&inode);
+}
+
+// Drops a reference, unused inodes stay cached until the shrinker frees them
+// Deleted inodes are freed right away
+void IC_put(inode_t *inode) {
+    if (--inode->refcount > 0) {
+        return;
+    }
+
+    if (inode->st_nlink == 0) {
+        destroy(inode);
+    } else {
+        unused_push(inode);
+    }
+}
+
+// Frees an inode of a filesystem that is going away, the caller holds its only reference
+void IC_forget(inode_t *inode) {
+    destroy(inode);
+}
+
+// Returns true if freeing the inode drops the last reference to a deleted parent
+// Freeing that parent releases its clusters, which allocates, so it can't happen inside an allocation
+static inline bool frees_deleted_parent(inode_t *inode) {
+    inode_t *parent = inode->parent_inode;
+
+    return parent != NULL && parent->refcount == 1 && parent->st_nlink == 0;
+}
+
+// Frees up to nr_to_scan of the least recently used unreferenced inodes
+// Runs from kmalloc, so inodes whose free would allocate are left cached
+// Returns how many were freed
+uint64_t IC_shrink(uint64_t nr_to_scan) {
+    inode_t *inode = unused_tail, *prev;
+    uint64_t freed = 0;
+
+    for (; freed < nr_to_scan && inode != NULL; inode = prev) {
+        prev = inode->unused_prev;
+        if (frees_deleted_parent(inode)) continue;
+
+        unused_remove(inode);
+        destroy(inode);
+        freed++;
+    }
+
+    stats.shrunk += freed;
+    return freed;
+}
+
+void IC_get_stats(inode_cache_stats_t *out) {
+    memcpy(out, &stats, sizeof(inode_cache_stats_t));
+}
+
+void IC_print_stats(void) {
+    printk("Inode cache: %ld hits, %ld misses, %ld shrunk, %d inodes, %d unused\n",
+        stats.hits, stats.misses, stats.shrunk, stats.num_inodes, stats.num_unused);
+}
@@ -0,0 +1,187 @@
+#include "io_ring.h"
+#include "file_table.h"
+#include "pf_alloc.h"
+#include "page_table.h"
+#include "kmalloc.h"
+#include "vma.h"
+#include "string.h"
+#include "printk.h"
+#include "syscall.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SYS_ERR ((uint64_t)-1)
+#define POLL_IDLE_ROUNDS 64     // Empty passes over the ring before the poller sleeps
+
+// Kernel side of a process's ring
+struct ring_ctx {
+    io_ring_t *ring;            // Through the direct map, the process can't move it
+    virtual_addr_t addr;        // Where the ring is mapped for the process
+    uint64_t size;
+    uint32_t entries;           // Trusted copy of ring->entries
+    process_t *owner;           // NULL once the process exits
+    process_t *exited;          // Owner that exited during a drain, freed by the poller once it is done
+    process_t *poller;
+    proc_queue_t poll_queue;    // The poller sleeps here while IO_RING_NEED_WAKEUP is set
+    bool draining;
+};
+
+static int64_t do_sqe(process_t *proc, io_sqe_t *sqe) {
+    switch (sqe->op) {
+        case IO_OP_NOP:
+            return 0;
+        case IO_OP_READ:
+            return FD_transfer(proc, sqe->fd, sqe->addr, sqe->len, sqe->offset, false);
+        case IO_OP_WRITE:
+            return FD_transfer(proc, sqe->fd, sqe->addr, sqe->len, sqe->offset, true);
+        default:
+            return -1;
+    }
+}
+
+// Runs every queued request that has room for its completion, in order
+// Requests may block on I/O, so a second drain started meanwhile returns at once
+// Returns the number of requests completed
+static int drain(ring_ctx_t *ctx) {
+    io_ring_t *ring = ctx->ring;
+    uint32_t mask = ctx->entries - 1;
+    io_sqe_t sqe;
+    io_cqe_t *cqe;
+    int n = 0;
+
+    if (ctx->draining) return 0;
+    ctx->draining = true;
+
+    while (ctx->owner != NULL && ring->sq_head != ring->sq_tail && ring->cq_tail - ring->cq_head < ctx->entries) {
+        // Copied first, so the process can't change the request while it runs
+        memcpy(&sqe, &IO_RING_SQES(ring)[ring->sq_head & mask], sizeof(io_sqe_t));
+        ring->sq_head++;
+
+        cqe = &IO_RING_CQES(ring)[ring->cq_tail & mask];
+        cqe->res = do_sqe(ctx->owner, &sqe);
+        cqe->user_data = sqe.user_data;
+        ring->cq_tail++;
+        n++;
+    }
+
+    ctx->draining = false;
+    return n;
+}
+
+// Unmaps the ring and returns its frames
+static void free_ctx(ring_ctx_t *ctx) {
+    uint64_t i;
+
+    for (i = 0; i < ctx->size; i += PAGE_SIZE) {
+        MMU_unmap_user_page(ctx->addr + i);
+        MMU_pf_free(GET_PHYS_ADDR((virtual_addr_t)ctx->ring) + i);
+    }
+    kfree(ctx);
+}
+
+// Drains the ring whenever the scheduler gets to it, sleeping once it stays empty
+static void poll_thread(void *arg) {
+    ring_ctx_t *ctx = (ring_ctx_t *)arg;
+    int idle = 0;
+
+    while (ctx->owner != NULL) {
+        if (drain(ctx) > 0) {
+            idle = 0;
+        } else if (++idle >= POLL_IDLE_ROUNDS) {
+            ctx->ring->flags |= IO_RING_NEED_WAKEUP;
+            wait_event_interruptable(&ctx->poll_queue, ctx->owner != NULL && (ctx->ring->flags & IO_RING_NEED_WAKEUP));
+            idle = 0;
+        }
+        yield();
+    }
+
+    if (ctx->exited != NULL) {
+        PROC_free(ctx->exited);
+    }
+    free_ctx(ctx);
+}
+
+// int io_ring_setup(io_ring_t *ring, int entries, int flags)
+// Maps a zeroed ring of entries requests at a page aligned user address
+uint64_t io_ring_setup_sys_call(uint64_t addr, uint64_t entries, uint64_t flags) {
+    permission_t perms = {0};
+    ring_ctx_t *ctx;
+    physical_addr_t frames;
+    uint64_t size, i;
+
+    if (curr_proc->io_ring != NULL || entries == 0 || entries > IO_RING_MAX_ENTRIES || (entries & (entries - 1)) ||
+        addr == 0 || addr % PAGE_SIZE != 0)
+    {
+        return SYS_ERR;
+    }
+    size = (IO_RING_SIZE(entries) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (!user_range(addr, size) || MMU_range_used(addr, size)) {
+        return SYS_ERR;
+    }
+
+    // Contiguous frames, so the kernel reaches the whole ring through the direct map
+    frames = MMU_pf_alloc_contig(size / PAGE_SIZE);
+    perms.w = 1;
+    for (i = 0; i < size; i += PAGE_SIZE) {
+        MMU_map_user_page(addr + i, frames + i, perms);
+    }
+
+    ctx = (ring_ctx_t *)kcalloc(1, sizeof(ring_ctx_t));
+    ctx->ring = (io_ring_t *)GET_VIRT_ADDR(frames);
+    ctx->addr = addr;
+    ctx->size = size;
+    memset(ctx->ring, 0, size);
+    ctx->ring->entries = ctx->entries = entries;
+    ctx->owner = curr_proc;
+    PROC_init_queue(&ctx->poll_queue);
+    curr_proc->io_ring = ctx;
+
+    if (flags & IO_RING_SQPOLL) {
+        ctx->poller = PROC_create_kthread(poll_thread, ctx);
+    }
+    return 0;
+}
+
+// int io_ring_enter(int flags)
+// Drains the ring in one trap, returns the number of requests completed
+uint64_t io_ring_enter_sys_call(uint64_t flags, uint64_t arg2, uint64_t arg3) {
+    ring_ctx_t *ctx = curr_proc->io_ring;
+
+    if (ctx == NULL) {
+        return SYS_ERR;
+    }
+
+    if ((flags & IO_ENTER_WAKEUP) && ctx->poller != NULL && (ctx->ring->flags & IO_RING_NEED_WAKEUP)) {
+        ctx->ring->flags &= ~IO_RING_NEED_WAKEUP;
+        PROC_unblock_all(&ctx->poll_queue);
+    }
+    return drain(ctx);
+}
+
+// Detaches an exiting process from its ring, the poller frees the ring on its way out
+// A request the poller is running still uses the process's files and memory
+// Returns 1 if the process can be freed now, 0 if the poller frees it once the request is done
+int RING_release(process_t *proc) {
+    ring_ctx_t *ctx = proc->io_ring;
+
+    if (ctx == NULL) return 1;
+    proc->io_ring = NULL;
+    ctx->owner = NULL;
+
+    if (ctx->poller == NULL) {
+        free_ctx(ctx);
+        return 1;
+    }
+
+    // Only the poller can be draining, the process is exiting rather than in io_ring_enter
+    if (ctx->draining) {
+        ctx->exited = proc;
+    }
+    PROC_unblock_all(&ctx->poll_queue);
+    return ctx->exited == NULL;
+}
+
+void RING_init(void) {
+    set_sys_call(IO_RING_SETUP_SYS_CALL, io_ring_setup_sys_call);
+    set_sys_call(IO_RING_ENTER_SYS_CALL, io_ring_enter_sys_call);
+}
@@ -0,0 +1,56 @@
+#include "block.h"
+#include "string.h"
+#include "registers.h"
+#include <stddef.h>
+
+// Dispatches requests in the order they were submitted, for devices without seek cost
+static blk_request_t *noop_next(blk_queue_t *q) {
+    return q->fifo_head;
+}
+
+// Sweeps upward through block numbers (C-SCAN), unless the oldest request has expired
+static blk_request_t *deadline_next(blk_queue_t *q) {
+    blk_request_t *rq = q->fifo_head;
+
+    if (rq == NULL || read_tsc() >= rq->expires) {
+        return rq;
+    }
+
+    for (rq = q->sort_head; rq != NULL && rq->blk_num < q->head_pos; rq = rq->sort_next);
+
+    return (rq != NULL) ? rq : q->sort_head;
+}
+
+// Sweeps back and forth through block numbers (SCAN), reversing at the last request
+static blk_request_t *elevator_next(blk_queue_t *q) {
+    blk_request_t *rq, *below = NULL;
+
+    for (rq = q->sort_head; rq != NULL && rq->blk_num < q->head_pos; rq = rq->sort_next) {
+        below = rq;
+    }
+
+    if ((q->direction > 0) ? rq == NULL : below == NULL) {
+        q->direction = -q->direction;
+    }
+
+    return (q->direction > 0) ? rq : below;
+}
+
+static blk_sched_t schedulers[] = {
+    {"noop", noop_next},
+    {"deadline", deadline_next},
+    {"elevator", elevator_next}
+};
+
+// Returns the scheduler with the given name, or NULL
+blk_sched_t *BLK_find_scheduler(const char *name) {
+    int i;
+
+    for (i = 0; i < sizeof(schedulers) / sizeof(blk_sched_t); i++) {
+        if (strcmp(schedulers[i].name, name) == 0) {
+            return &schedulers[i];
+        }
+    }
+
+    return NULL;
+}
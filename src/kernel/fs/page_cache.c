@@ -0,0 +1,525 @@
+#include "page_cache.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "printk.h"
+#include "pf_alloc.h"
+#include "page_table.h"
+#include "irq.h"
+#include "proc.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NUM_BUCKETS 64
+#define RA_INIT_PAGES 4
+#define RA_MAX_PAGES 32
+#define SHRINK_BATCH 32
+
+static address_space_t *buckets[NUM_BUCKETS];
+static int clock_bucket;
+static page_cache_stats_t stats;
+static proc_queue_t page_waiters;
+
+static inline int hash(superblock_t *sb, ino_t ino) {
+    return (((uint64_t)sb >> 4) ^ (ino * 0x9E3779B97F4A7C15UL)) % NUM_BUCKETS;
+}
+
+static address_space_t *find_mapping(superblock_t *sb, ino_t ino) {
+    address_space_t *mapping;
+
+    for (mapping = buckets[hash(sb, ino)]; mapping != NULL; mapping = mapping->hash_next) {
+        if (mapping->sb == sb && mapping->ino == ino) {
+            return mapping;
+        }
+    }
+    return NULL;
+}
+
+static void hash_remove(address_space_t *mapping) {
+    address_space_t **link = &buckets[hash(mapping->sb, mapping->ino)];
+
+    while (*link != mapping) {
+        link = &(*link)->hash_next;
+    }
+    *link = mapping->hash_next;
+    mapping->flags |= MAPPING_UNHASHED;
+}
+
+// Returns the page cache of the inode's file, creating it on first use
+// The inode holds its mapping, the hash of (superblock, inode number) finds it again once a shrunk inode is reread
+address_space_t *PC_get_mapping(inode_t *inode) {
+    superblock_t *sb = inode->parent_superblock;
+    address_space_t *mapping;
+    int bucket;
+
+    if (inode->mapping != NULL) {
+        return inode->mapping;
+    }
+    if ((mapping = find_mapping(sb, inode->st_ino)) != NULL) {
+        inode->mapping = mapping;
+        return mapping;
+    }
+
+    bucket = hash(sb, inode->st_ino);
+    mapping = (address_space_t *)kcalloc(1, sizeof(address_space_t));
+    mapping->sb = sb;
+    mapping->ino = inode->st_ino;
+    radix_init(&mapping->pages);
+    mapping->hash_next = buckets[bucket];
+    buckets[bucket] = mapping;
+    inode->mapping = mapping;
+
+    return mapping;
+}
+
+// Called once a file is deleted, so a new file given its inode number starts with an empty cache
+// The deleted file's pages stay reachable through its inode until PC_remove_mapping
+void PC_unhash_mapping(inode_t *inode) {
+    address_space_t *mapping = (inode->mapping != NULL) ? inode->mapping : find_mapping(inode->parent_superblock,
+        inode->st_ino);
+
+    if (mapping == NULL || (mapping->flags & MAPPING_UNHASHED)) {
+        return;
+    }
+    inode->mapping = mapping;
+    hash_remove(mapping);
+}
+
+static cached_page_t *new_page(address_space_t *mapping, uint64_t index) {
+    cached_page_t *page = (cached_page_t *)kcalloc(1, sizeof(cached_page_t));
+
+    page->frame = MMU_pf_alloc();
+    page->data = (uint8_t *)GET_VIRT_ADDR(page->frame);
+    page->index = index;
+
+    // Inserting may allocate tree nodes, and the shrinker must not delete from the tree meanwhile
+    mapping->flags |= MAPPING_BUSY;
+    radix_insert(&mapping->pages, index, page);
+    mapping->flags &= ~MAPPING_BUSY;
+    mapping->num_pages++;
+    stats.num_pages++;
+    return page;
+}
+
+// Marks the pages locked and hands them to the inode's readpages
+static void start_reads(file_t *file, cached_page_t **pages, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        pages[i]->locked = 1;
+        pages[i]->error = 0;
+    }
+    file->inode->readpages(file, pages, count);
+}
+
+// Pins a page, so neither the shrinker nor truncation frees it while it is used
+// Anything that may block or allocate while holding a page must pin it
+void PC_page_get(cached_page_t *page) {
+    page->refcount++;
+}
+
+void PC_page_put(cached_page_t *page) {
+    page->refcount--;
+}
+
+// Counts one more read filling the page
+void PC_page_io_start(cached_page_t *page) {
+    uint16_t int_en = check_int();
+
+    if (int_en) CLI;
+    page->pending++;
+    if (int_en) STI;
+}
+
+// Finishes one read of the page, unlocking it once none are left
+// Safe to call from interrupt context
+void PC_page_io_done(cached_page_t *page, int status) {
+    uint16_t int_en = check_int();
+
+    if (int_en) CLI;
+    if (status != 1) page->error = 1;
+    if (--page->pending == 0) {
+        page->valid = !page->error;
+        page->locked = 0;
+        PROC_unblock_all(&page_waiters);
+    }
+    if (int_en) STI;
+}
+
+// Called on every access to a page of the file
+// Once reads are sequential, the next window is read ahead as soon as the reader enters the last one,
+// doubling in size each time so the disk stays ahead of the reader
+void PC_readahead(file_t *file, uint64_t index) {
+    file_ra_t *ra = &file->ra;
+    address_space_t *mapping;
+    cached_page_t *batch[RA_MAX_PAGES];
+    uint64_t num_pages = (file->inode->st_size + PAGE_SIZE - 1) / PAGE_SIZE, i;
+    int n = 0;
+
+    // Rereading the same page
+    if (index + 1 == ra->next_index) return;
+
+    if (index != ra->next_index) {
+        ra->next_index = index + 1;
+        ra->size = 0;
+        return;
+    }
+    ra->next_index = index + 1;
+
+    if (ra->size == 0) {
+        ra->start = index + 1;
+        ra->size = RA_INIT_PAGES;
+    } else if (index >= ra->start) {
+        ra->start = ra->end;
+        ra->size = (ra->size * 2 > RA_MAX_PAGES) ? RA_MAX_PAGES : ra->size * 2;
+    } else {
+        return;
+    }
+
+    ra->end = ra->start + ra->size;
+    if (ra->end > num_pages) ra->end = num_pages;
+
+    // Batch runs of uncached pages so the filesystem can read them with few large requests
+    mapping = PC_get_mapping(file->inode);
+    for (i = ra->start; i < ra->end; i++) {
+        if (radix_lookup(&mapping->pages, i) != NULL) {
+            if (n > 0) start_reads(file, batch, n);
+            n = 0;
+            continue;
+        }
+
+        batch[n] = new_page(mapping, i);
+        batch[n]->flags |= PAGE_READAHEAD;
+        n++;
+        stats.ra_issued++;
+    }
+
+    if (n > 0) start_reads(file, batch, n);
+}
+
+// Returns the cached page at index of the file, reading it in with the inode's readpages on a miss
+// Returns NULL on failure
+cached_page_t *PC_get_page(file_t *file, uint64_t index) {
+    inode_t *inode = file->inode;
+    address_space_t *mapping = PC_get_mapping(inode);
+    block_dev_t *dev = inode->parent_superblock->dev;
+    cached_page_t *page;
+
+    if (inode->readpages == NULL) {
+        printk("PC_get_page(): Inode %ld has no readpages\n", inode->st_ino);
+        return NULL;
+    }
+
+    if ((page = (cached_page_t *)radix_lookup(&mapping->pages, index)) != NULL) {
+        stats.hits++;
+        if (page->flags & PAGE_READAHEAD) {
+            page->flags &= ~PAGE_READAHEAD;
+            stats.ra_used++;
+        }
+    } else {
+        stats.misses++;
+        page = new_page(mapping, index);
+    }
+    page->flags |= PAGE_REFERENCED;
+
+    // Readahead allocates frames, which may shrink the cache
+    PC_page_get(page);
+
+    // The page and the readahead window are queued together so they can merge
+    if (dev != NULL) BLK_plug(dev);
+    if (!page->valid && !page->locked) {
+        start_reads(file, &page, 1);
+    }
+    PC_readahead(file, index);
+    if (dev != NULL) BLK_unplug(dev);
+
+    wait_event_or_halt(&page_waiters, page->locked);
+    PC_page_put(page);
+    return page->valid ? page : NULL;
+}
+
+// Returns the page at index of the inode's file if it is cached, never reads it in
+cached_page_t *PC_find_page(inode_t *inode, uint64_t index) {
+    return (cached_page_t *)radix_lookup(&PC_get_mapping(inode)->pages, index);
+}
+
+// Copies up to len bytes at offset in the file, stopping at the end of the file
+// Returns the number of bytes read, or -1 if nothing could be read
+int PC_pread(file_t *file, char *dst, int len, off_t offset) {
+    off_t size = file->inode->st_size;
+    cached_page_t *page;
+    int bytes_read = 0, page_offset, n;
+
+    while (bytes_read < len && offset < size) {
+        if ((page = PC_get_page(file, offset / PAGE_SIZE)) == NULL) {
+            return (bytes_read > 0) ? bytes_read : -1;
+        }
+
+        page_offset = offset % PAGE_SIZE;
+        n = PAGE_SIZE - page_offset;
+        if (n > len - bytes_read) n = len - bytes_read;
+        if (n > size - offset) n = size - offset;
+
+        // Faulting in dst may allocate frames
+        PC_page_get(page);
+        memcpy(dst + bytes_read, page->data + page_offset, n);
+        PC_page_put(page);
+        bytes_read += n;
+        offset += n;
+    }
+
+    return bytes_read;
+}
+
+// Copies up to len bytes from the file's cursor, advancing it
+int PC_read(file_t *file, char *dst, int len) {
+    int bytes_read = PC_pread(file, dst, len, file->cursor);
+
+    if (bytes_read > 0) {
+        file->cursor += bytes_read;
+    }
+    return bytes_read;
+}
+
+// Marks a page as newer than the file on disk, the filesystem writes it back later
+// Pages of in-memory filesystems have nowhere to go, so they stay clean
+void PC_mark_dirty(address_space_t *mapping, cached_page_t *page) {
+    if (!(page->flags & PAGE_DIRTY) && !(mapping->flags & MAPPING_NO_WRITEBACK)) {
+        page->flags |= PAGE_DIRTY;
+        mapping->num_dirty++;
+        stats.num_dirty++;
+    }
+}
+
+// Called by the filesystem as it starts writing a page back
+// A write to the page after this dirties it again
+void PC_clear_dirty(address_space_t *mapping, cached_page_t *page) {
+    if (page->flags & PAGE_DIRTY) {
+        page->flags &= ~PAGE_DIRTY;
+        mapping->num_dirty--;
+        stats.num_dirty--;
+    }
+}
+
+// Copies len bytes into the file at offset, growing it if they go past the end
+// Pages are only dirtied here, pages that are overwritten whole or past the end of the file aren't read first
+// Returns the number of bytes written, or -1 if nothing could be written
+int PC_pwrite(file_t *file, const char *src, int len, off_t offset) {
+    inode_t *inode = file->inode;
+    address_space_t *mapping = PC_get_mapping(inode);
+    cached_page_t *page;
+    int written = 0, page_offset, n;
+    uint64_t index;
+
+    while (written < len) {
+        index = offset / PAGE_SIZE;
+        page_offset = offset % PAGE_SIZE;
+        n = PAGE_SIZE - page_offset;
+        if (n > len - written) n = len - written;
+
+        page = (cached_page_t *)radix_lookup(&mapping->pages, index);
+        if (page == NULL && (index * PAGE_SIZE >= inode->st_size || n == PAGE_SIZE)) {
+            page = new_page(mapping, index);
+            memset(page->data, 0, PAGE_SIZE);
+            page->valid = 1;
+        } else if ((page = PC_get_page(file, index)) == NULL) {
+            return (written > 0) ? written : -1;
+        }
+
+        PC_page_get(page);
+        memcpy(page->data + page_offset, src + written, n);
+        PC_page_put(page);
+        PC_mark_dirty(mapping, page);
+        written += n;
+        offset += n;
+
+        if (offset > inode->st_size) {
+            inode->st_size = offset;
+        }
+    }
+
+    return written;
+}
+
+// Copies len bytes to the file's cursor, advancing it
+int PC_write(file_t *file, const char *src, int len) {
+    int written = PC_pwrite(file, src, len, file->cursor);
+
+    if (written > 0) {
+        file->cursor += written;
+    }
+    return written;
+}
+
+typedef struct page_collect {
+    uint64_t start;
+    cached_page_t **pages;
+    int count;
+    int max;
+    bool dirty_only;
+} page_collect_t;
+
+static int collect_cb(uint64_t index, void *item, void *p) {
+    page_collect_t *collect = (page_collect_t *)p;
+    cached_page_t *page = (cached_page_t *)item;
+
+    if (index < collect->start || (collect->dirty_only && !(page->flags & PAGE_DIRTY))) return 1;
+    if (collect->count == collect->max) return -1;
+
+    collect->pages[collect->count++] = page;
+    return 1;
+}
+
+// Places up to max dirty pages of the file, from index start on, into pages in index order
+// Returns the number of pages placed
+int PC_dirty_pages(address_space_t *mapping, uint64_t start, cached_page_t **pages, int max) {
+    page_collect_t collect = {start, pages, 0, max, true};
+
+    if (mapping->num_dirty == 0) return 0;
+    radix_for_each(&mapping->pages, collect_cb, &collect);
+    return collect.count;
+}
+
+// Removes an unmapped, unlocked page from the file's cache and frees its frame
+static void free_page(address_space_t *mapping, cached_page_t *page) {
+    if (page->flags & PAGE_READAHEAD) {
+        stats.ra_wasted++;
+    }
+
+    PC_clear_dirty(mapping, page);
+    radix_delete(&mapping->pages, page->index);
+    mapping->num_pages--;
+    stats.num_pages--;
+    MMU_pf_free(page->frame);
+    kfree(page);
+}
+
+// Drops the cached pages from index start on, waiting for reads of them to finish
+// Pages still pinned, by a process mapping them or a blocked reader, are left cached
+static void drop_pages(address_space_t *mapping, uint64_t start) {
+    page_collect_t collect = {start, NULL, 0, mapping->num_pages, false};
+    cached_page_t *page;
+    int i;
+
+    if (mapping->num_pages == 0) return;
+
+    collect.pages = (cached_page_t **)kmalloc(mapping->num_pages * sizeof(cached_page_t *));
+    radix_for_each(&mapping->pages, collect_cb, &collect);
+
+    // Held while waiting, so the shrinker can't free them first
+    for (i = 0; i < collect.count; i++) {
+        PC_page_get(collect.pages[i]);
+    }
+
+    for (i = 0; i < collect.count; i++) {
+        page = collect.pages[i];
+        wait_event_or_halt(&page_waiters, page->locked);
+        PC_page_put(page);
+        if (page->refcount > 0) continue;
+
+        free_page(mapping, page);
+    }
+
+    kfree(collect.pages);
+}
+
+// Drops cached pages past a new end of the file, and zeroes the tail of the last page past it
+void PC_truncate(inode_t *inode, off_t size) {
+    address_space_t *mapping = PC_get_mapping(inode);
+    cached_page_t *page;
+
+    drop_pages(mapping, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    if (size % PAGE_SIZE && (page = (cached_page_t *)radix_lookup(&mapping->pages, size / PAGE_SIZE)) != NULL) {
+        PC_page_get(page);
+        wait_event_or_halt(&page_waiters, page->locked);
+        memset(page->data + size % PAGE_SIZE, 0, PAGE_SIZE - size % PAGE_SIZE);
+        PC_page_put(page);
+    }
+}
+
+// Forgets a deleted file's cached pages
+void PC_remove_mapping(inode_t *inode) {
+    address_space_t *mapping;
+
+    PC_unhash_mapping(inode);
+    if ((mapping = inode->mapping) == NULL) {
+        return;
+    }
+    inode->mapping = NULL;
+
+    drop_pages(mapping, 0);
+    if (mapping->num_pages > 0) {
+        // Still mapped somewhere, keep it
+        return;
+    }
+    kfree(mapping);
+}
+
+typedef struct page_shrink {
+    cached_page_t *pages[SHRINK_BATCH];
+    int count;
+} page_shrink_t;
+
+// Picks clean, valid pages nobody holds, giving referenced pages a second chance
+static int shrink_cb(uint64_t index, void *item, void *p) {
+    page_shrink_t *shrink = (page_shrink_t *)p;
+    cached_page_t *page = (cached_page_t *)item;
+
+    if (shrink->count == SHRINK_BATCH) return -1;
+    if (page->refcount > 0 || page->locked || !page->valid || (page->flags & PAGE_DIRTY)) return 1;
+
+    if (page->flags & PAGE_REFERENCED) {
+        page->flags &= ~PAGE_REFERENCED;
+        return 1;
+    }
+
+    shrink->pages[shrink->count++] = page;
+    return 1;
+}
+
+// Frees up to nr_to_scan clean pages of files, their frames go straight back to the frame allocator
+// Mappings are visited round robin, pages of in-memory filesystems are their only copy and are kept
+// A mapping in the middle of an insert is skipped, the shrinker may be running from that insert's allocation
+// Runs when the frame allocator is empty, so it never allocates
+// Returns how many pages were freed
+uint64_t PC_shrink(uint64_t nr_to_scan) {
+    page_shrink_t shrink;
+    address_space_t *mapping;
+    uint64_t freed = 0;
+    int i, passes;
+
+    // Two sweeps, the first may only clear referenced flags
+    for (passes = 0; passes < 2 * NUM_BUCKETS && freed < nr_to_scan; passes++) {
+        for (mapping = buckets[clock_bucket]; mapping != NULL && freed < nr_to_scan; mapping = mapping->hash_next) {
+            if (mapping->flags & (MAPPING_NO_WRITEBACK | MAPPING_BUSY)) continue;
+
+            do {
+                shrink.count = 0;
+                radix_for_each(&mapping->pages, shrink_cb, &shrink);
+                for (i = 0; i < shrink.count && freed < nr_to_scan; i++) {
+                    free_page(mapping, shrink.pages[i]);
+                    freed++;
+                }
+            } while (shrink.count == SHRINK_BATCH && freed < nr_to_scan);
+        }
+
+        if (freed < nr_to_scan) {
+            clock_bucket = (clock_bucket + 1) % NUM_BUCKETS;
+        }
+    }
+
+    stats.shrunk += freed;
+    return freed;
+}
+
+void PC_get_stats(page_cache_stats_t *out) {
+    memcpy(out, &stats, sizeof(page_cache_stats_t));
+}
+
+void PC_print_stats(void) {
+    printk("Page cache: %ld hits, %ld misses, %ld pages, %ld dirty\n",
+        stats.hits, stats.misses, stats.num_pages, stats.num_dirty);
+    printk("Readahead: %ld pages read ahead, %ld used, %ld wasted\n", stats.ra_issued, stats.ra_used,
+        stats.ra_wasted);
+    printk("Shrinker: %ld pages freed\n", stats.shrunk);
+}
@@ -3,10 +3,19 @@
 #include "printk.h"
 #include "kmalloc.h"
 #include "string.h"
+#include "buffer_cache.h"
+#include "crc32.h"
+#include <stddef.h>
 #include <stdint-gcc.h>
+#include <stdbool.h>
 
-#define BLOCK_SIZE 512
-#define FAT32_LBA_TYPE 0xC
+#define MBR_PARTITIONS 4
+#define EXTENDED_CHS_TYPE 0x05
+#define EXTENDED_LBA_TYPE 0x0F
+#define GPT_PROTECTIVE_TYPE 0xEE
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_LBA 1
+#define GPT_MIN_HEADER_SIZE 92
 
 typedef struct part_entry {
     uint8_t status;
@@ -17,6 +26,32 @@ typedef struct part_entry {
     uint32_t num_sectors;
 } part_entry_t;
 
+typedef struct gpt_header {
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;          // Over header_size bytes, with this field zeroed
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;         // Where the other copy of the header is
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t entries_crc32;
+} __attribute__((packed)) gpt_header_t;
+
+typedef struct gpt_entry {
+    uint8_t type_guid[16];          // All zero for an unused entry
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;              // Inclusive
+    uint64_t attributes;
+    uint16_t name[36];              // UTF-16
+} __attribute__((packed)) gpt_entry_t;
+
 void print_part(part_entry_t *part, int n) {
     if (part->type == 0) {
         printb("Partition %d - None\n", n);
@@ -33,62 +68,246 @@ int part_read_block(block_dev_t *dev, uint64_t blk_num, void *dst) {
         return -1;
     }
 
-    return ATA_read_block(dev, blk_num + part->lba_offset, dst);
+    return part->parent->read_block(part->parent, blk_num + part->lba_offset, dst);
+}
+
+int part_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst) {
+    part_block_dev_t *part = (part_block_dev_t *)dev;
+
+    if (blk_num + count > part->num_sectors) {
+        return -1;
+    }
+
+    return part->parent->read_blocks(part->parent, blk_num + part->lba_offset, count, dst);
+}
+
+int part_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src) {
+    part_block_dev_t *part = (part_block_dev_t *)dev;
+
+    if (blk_num + count > part->num_sectors) {
+        return -1;
+    }
+
+    return part->parent->write_blocks(part->parent, blk_num + part->lba_offset, count, src);
+}
+
+// Remaps a bio onto the parent drive, whose request queue the partition shares
+void part_submit_bio(block_dev_t *dev, bio_t *bio) {
+    part_block_dev_t *part = (part_block_dev_t *)dev;
+
+    if (bio->blk_num + bio->num_blks > part->num_sectors) {
+        bio->status = -1;
+        bio->end_io(bio);
+        return;
+    }
+
+    bio->blk_num += part->lba_offset;
+    bio->dev = part->parent;
+    BLK_submit(bio);
+}
+
+// Stacks a partition device over blocks [start, start + len) of a drive, named by its index
+// Every request is range checked and forwarded to the drive, so partitions get the drive's multi-block and
+// asynchronous paths, and share its request queue
+static part_block_dev_t *create_part(block_dev_t *drive, int index, uint64_t start, uint64_t len) {
+    part_block_dev_t *dev = (part_block_dev_t *)kmalloc(sizeof(part_block_dev_t));
+    char *part_name, digits[4];
+    int name_len = strlen(drive->name), n = 0;
+
+    memcpy(&dev->dev, drive, sizeof(block_dev_t));
+    dev->parent = drive;
+    dev->lba_offset = start;
+    dev->num_sectors = len;
+    dev->dev.tot_len = len;
+    dev->dev.type = PARTITION;
+    dev->dev.read_block = part_read_block;
+    dev->dev.read_blocks = (drive->read_blocks != NULL) ? part_read_blocks : NULL;
+    dev->dev.write_blocks = (drive->write_blocks != NULL) ? part_write_blocks : NULL;
+    dev->dev.submit_bio = part_submit_bio;
+    dev->dev.next = NULL;
+
+    // Set partition name, the drive's followed by the index
+    do {
+        digits[n++] = (char)('0' + index % 10);
+        index /= 10;
+    } while (index > 0 && n < 3);
+
+    part_name = (char *)kmalloc(name_len + n + 1);
+    memcpy(part_name, drive->name, name_len);
+    while (n > 0) {
+        part_name[name_len++] = digits[--n];
+    }
+    part_name[name_len] = '\0';
+    dev->dev.name = part_name;
+
+    BLK_register((block_dev_t *)dev);
+    return dev;
+}
+
+// Reads and validates a GPT header and its entry array, returns the entries or NULL
+// The CRCs of both are checked, so a torn or stale copy is never used
+static gpt_entry_t *read_gpt(block_dev_t *drive, uint64_t lba, gpt_header_t *header) {
+    buffer_t *buf;
+    uint8_t *entries, *copy;
+    uint64_t bytes, blocks;
+    uint32_t crc;
+
+    if (lba >= drive->tot_len || (buf = BUF_read(drive, lba)) == NULL) {
+        return NULL;
+    }
+    memcpy(header, buf->data, sizeof(gpt_header_t));
+
+    if (memcmp(header->signature, GPT_SIGNATURE, 8) != 0 || header->header_size < GPT_MIN_HEADER_SIZE ||
+        header->header_size > drive->blk_size || header->my_lba != lba)
+    {
+        BUF_release(buf);
+        return NULL;
+    }
+
+    // The CRC covers the header with its own field zeroed, checked on a copy so the cached block is untouched
+    copy = (uint8_t *)kmalloc(header->header_size);
+    memcpy(copy, buf->data, header->header_size);
+    BUF_release(buf);
+    ((gpt_header_t *)copy)->header_crc32 = 0;
+    crc = crc32(copy, header->header_size);
+    kfree(copy);
+
+    if (header->header_crc32 != crc) {
+        printb("read_gpt(): Header at LBA %lu fails its CRC\n", lba);
+        return NULL;
+    }
+    if (header->entry_size < sizeof(gpt_entry_t) || header->entry_size % 8 != 0 || header->num_entries == 0 ||
+        header->num_entries > 1024)
+    {
+        printb("read_gpt(): Unsupported entry array, %u entries of %u bytes\n",
+            header->num_entries, header->entry_size);
+        return NULL;
+    }
+
+    bytes = (uint64_t)header->num_entries * header->entry_size;
+    blocks = (bytes + drive->blk_size - 1) / drive->blk_size;
+    if (header->entries_lba >= drive->tot_len || blocks > drive->tot_len - header->entries_lba) {
+        return NULL;
+    }
+
+    entries = (uint8_t *)kmalloc(blocks * drive->blk_size);
+    if (BLK_read(drive, header->entries_lba, blocks, entries) == -1 || crc32(entries, bytes) != header->entries_crc32) {
+        printb("read_gpt(): Entry array of the header at LBA %lu is unreadable or fails its CRC\n", lba);
+        kfree(entries);
+        return NULL;
+    }
+
+    return (gpt_entry_t *)entries;
+}
+
+// Parses the GUID partition table on a drive, falling back to the backup copy at the end of it
+// Places a partition device for each used entry, in entry order
+// Returns 1 on success, -1 on failure
+int parse_GPT(block_dev_t *drive, part_block_dev_t **partitions, int max) {
+    gpt_header_t header;
+    gpt_entry_t *entries, *entry;
+    static const uint8_t unused[16];
+    uint32_t i;
+    int n = 0;
+
+    printb("Parsing GPT on %s\n", drive->name);
+
+    if ((entries = read_gpt(drive, GPT_HEADER_LBA, &header)) == NULL &&
+        (entries = read_gpt(drive, drive->tot_len - 1, &header)) == NULL)
+    {
+        printb("parse_GPT(): No valid GPT header\n");
+        return -1;
+    }
+
+    for (i = 0; i < header.num_entries && n < max; i++) {
+        entry = (gpt_entry_t *)((uint8_t *)entries + i * header.entry_size);
+        if (memcmp(entry->type_guid, unused, 16) == 0) {
+            continue;
+        }
+
+        // The header's usable range is only checksummed, not checked against the drive
+        if (entry->first_lba < header.first_usable_lba || entry->last_lba < entry->first_lba ||
+            entry->last_lba > header.last_usable_lba || entry->last_lba >= drive->tot_len)
+        {
+            printb("Partition %d - Bad range 0x%lx - 0x%lx\n", n, entry->first_lba, entry->last_lba);
+            continue;
+        }
+
+        printb("Partition %d - GPT entry %u, Size: %lu, Start LBA: 0x%lx\n",
+            n, i, entry->last_lba - entry->first_lba + 1, entry->first_lba);
+        partitions[n] = create_part(drive, n, entry->first_lba, entry->last_lba - entry->first_lba + 1);
+        n++;
+    }
+
+    while (n < max) {
+        partitions[n++] = NULL;
+    }
+
+    kfree(entries);
+    return 1;
 }
 
-// Parses the master boot record on the primary master drive
-// Places partition devices 
+// Parses the master boot record on a drive
+// Places a partition device for each primary partition, leaving unused, extended and GPT protective entries NULL
 // Returns 1 on success, -1 on failure
-int parse_MBR(ATA_block_dev_t *drive, part_block_dev_t **partitions) {
-    uint8_t block[BLOCK_SIZE];
-    part_entry_t *part;
-    part_block_dev_t *dev;
-    char *part_name;
-    int i = 0, len;
+int parse_MBR(block_dev_t *drive, part_block_dev_t **partitions, int max) {
+    part_entry_t parts[MBR_PARTITIONS];
+    buffer_t *buf;
+    int i;
 
-    printb("Parsing MBR on %s\n", drive->dev.name);
+    printb("Parsing MBR on %s\n", drive->name);
 
     // Read the first block (MBR)
-    drive->dev.read_block((block_dev_t *)drive, 0, block);
+    if ((buf = BUF_read(drive, 0)) == NULL) {
+        printb("parse_MBR(): failed to read MBR\n");
+        return -1;
+    }
 
     // Validate the boot signature
-    if (block[510] != 0x55 || block[511] != 0xAA) {
+    if (buf->data[510] != 0x55 || buf->data[511] != 0xAA) {
         printb("parse_MBR(): failed to validate boot signature\n");
+        BUF_release(buf);
         return -1;
     }
-    
+    memcpy(parts, &buf->data[446], sizeof(parts));
+    BUF_release(buf);
+
     // Parse partitions
-    part = (part_entry_t *)(&block[446]);
-    for (i = 0; i < 4; i++) {
-        print_part(part, i);
+    for (i = 0; i < max; i++) {
+        partitions[i] = NULL;
+        if (i >= MBR_PARTITIONS) continue;
 
-        if (part->type != FAT32_LBA_TYPE) {
-            partitions[i] = NULL;
-            part++;
+        print_part(&parts[i], i);
+        if (parts[i].type == 0 || parts[i].type == EXTENDED_CHS_TYPE || parts[i].type == EXTENDED_LBA_TYPE ||
+            parts[i].type == GPT_PROTECTIVE_TYPE || parts[i].num_sectors == 0 || (uint64_t)parts[i].lba_addr + parts[i].num_sectors > drive->tot_len)
+        {
             continue;
         }
 
         // Create and register a partition block device
-        dev = (part_block_dev_t *)kmalloc(sizeof(part_block_dev_t));
-        memcpy(dev, drive, sizeof(ATA_block_dev_t));
-        dev->lba_offset = part->lba_addr;
-        dev->num_sectors = part->num_sectors;
-        dev->ata.dev.type = PARTITION;
-        dev->ata.dev.read_block = part_read_block;
+        partitions[i] = create_part(drive, i, parts[i].lba_addr, parts[i].num_sectors);
+    }
 
-        // Set partition name
-        len = strlen(drive->dev.name);
-        part_name = (char *)kmalloc(len + 2);
-        memcpy(part_name, drive->dev.name, len);
-        part_name[len] = (char)('0' + i);
-        part_name[len + 1] = '\0';
-        dev->ata.dev.name = part_name;
+    return 1;
+}
 
-        BLK_register((block_dev_t *)dev);
+// Parses whichever partition table a drive has, GPT when the MBR only holds its protective entry
+// Fills max slots of partitions, unused ones NULL
+// Returns 1 on success, -1 on failure
+int parse_partitions(block_dev_t *drive, part_block_dev_t **partitions, int max) {
+    buffer_t *buf;
+    bool gpt = false;
+    int i;
 
-        partitions[i] = dev;
-        part++;
+    if ((buf = BUF_read(drive, 0)) != NULL) {
+        for (i = 0; i < MBR_PARTITIONS; i++) {
+            if (((part_entry_t *)&buf->data[446])[i].type == GPT_PROTECTIVE_TYPE) gpt = true;
+        }
+        BUF_release(buf);
     }
 
-    return 1;
-}
\ No newline at end of file
+    if (gpt && parse_GPT(drive, partitions, max) == 1) {
+        return 1;
+    }
+    return parse_MBR(drive, partitions, max);
+}
@@ -0,0 +1,319 @@
+#include "ramfs.h"
+#include "page_cache.h"
+#include "inode_cache.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "printk.h"
+#include "vma.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define RAMFS_ROOT_INO 1
+#define MIN_BUCKETS 8
+#define MAX_LOAD 2              // Average entries per bucket before a directory's table doubles
+
+typedef struct RAMFS_dir_ent RAMFS_dir_ent_t;
+
+struct RAMFS_dir_ent {
+    char *name;
+    uint32_t hash;
+    uint64_t pos;               // Cursor of the entry for getdents, increasing in creation order
+    inode_t *inode;             // Holds a reference, so linked inodes are never shrunk
+    RAMFS_dir_ent_t *hash_next;
+    RAMFS_dir_ent_t *prev;      // Entries in creation order
+    RAMFS_dir_ent_t *next;
+};
+
+// File data lives only in the page cache, directories are hash tables of entries
+typedef struct RAMFS_inode {
+    inode_t inode;
+    RAMFS_dir_ent_t **buckets;
+    uint32_t num_buckets;
+    uint32_t num_entries;
+    uint64_t next_pos;
+    RAMFS_dir_ent_t *head, *tail;
+} RAMFS_inode_t;
+
+typedef struct RAMFS_superblock {
+    superblock_t superblock;
+    ino_t next_ino;             // Numbers are never reused, so page cache mappings can't be shared
+} RAMFS_superblock_t;
+
+static RAMFS_inode_t *init_inode(superblock_t *sb, ino_t ino, mode_t mode);
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261U;
+
+    while (*name) {
+        hash = (hash ^ (uint8_t)*name++) * 16777619U;
+    }
+    return hash;
+}
+
+static RAMFS_dir_ent_t *find_ent(RAMFS_inode_t *dir, const char *name, uint32_t hash) {
+    RAMFS_dir_ent_t *ent;
+
+    for (ent = dir->buckets[hash % dir->num_buckets]; ent != NULL; ent = ent->hash_next) {
+        if (ent->hash == hash && strcmp(ent->name, name) == 0) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+// Doubles a directory's hash table, so lookups stay constant time as it grows
+static void grow_dir(RAMFS_inode_t *dir) {
+    RAMFS_dir_ent_t **buckets, *ent;
+    uint32_t num_buckets = dir->num_buckets * 2;
+
+    buckets = (RAMFS_dir_ent_t **)kcalloc(num_buckets, sizeof(RAMFS_dir_ent_t *));
+    for (ent = dir->head; ent != NULL; ent = ent->next) {
+        ent->hash_next = buckets[ent->hash % num_buckets];
+        buckets[ent->hash % num_buckets] = ent;
+    }
+
+    kfree(dir->buckets);
+    dir->buckets = buckets;
+    dir->num_buckets = num_buckets;
+}
+
+// Called by the inode cache once the last reference to a deleted inode is dropped
+void RAMFS_inode_free(inode_t **inode) {
+    RAMFS_inode_t *ram_inode = (RAMFS_inode_t *)*inode;
+
+    if (ram_inode->buckets != NULL) {
+        kfree(ram_inode->buckets);
+    } else {
+        PC_remove_mapping(&ram_inode->inode);
+    }
+    if (ram_inode->inode.parent_inode != NULL) {
+        IC_put(ram_inode->inode.parent_inode);
+    }
+    kfree(ram_inode);
+    *inode = NULL;
+}
+
+// Pages not yet written are holes, and read as zeroes
+int RAMFS_readpages(file_t *file, cached_page_t **pages, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        memset(pages[i]->data, 0, PAGE_SIZE);
+        PC_page_io_start(pages[i]);
+        PC_page_io_done(pages[i], 1);
+    }
+    return 1;
+}
+
+int RAMFS_file_close(file_t **file) {
+    IC_put((*file)->inode);
+    kfree(*file);
+    return 1;
+}
+
+int RAMFS_file_read(file_t *file, char *dst, int len) {
+    return PC_read(file, dst, len);
+}
+
+int RAMFS_file_write(file_t *file, char *src, int len) {
+    return PC_write(file, src, len);
+}
+
+// Growth needs no zero filling, pages past the end are zeroed as they are cached
+int RAMFS_file_truncate(file_t *file, off_t size) {
+    if (size < file->inode->st_size) {
+        PC_truncate(file->inode, size);
+    }
+    file->inode->st_size = size;
+    return 1;
+}
+
+int RAMFS_file_lseek(file_t *file, off_t offset) {
+    file->cursor = offset;
+    return 1;
+}
+
+// Maps the whole file privately at vaddr
+int RAMFS_file_mmap(file_t *file, void *vaddr) {
+    permission_t perms = {0};
+    size_t size = file->inode->st_size;
+
+    perms.w = 1;
+    return MMU_map_file((virtual_addr_t)vaddr, size, file, 0, size, perms);
+}
+
+// The cursor is the position of the next entry, so entries deleted between batches don't shift it
+int RAMFS_getdents(file_t *file, dirent_t *ents, int count) {
+    RAMFS_inode_t *dir = (RAMFS_inode_t *)file->inode;
+    RAMFS_dir_ent_t *ent;
+    int n = 0;
+
+    if ((dir->inode.st_mode & S_IFDIR) == 0) {
+        printk("RAMFS_getdents(): Attempted to read non directory\n");
+        return -1;
+    }
+
+    for (ent = dir->head; ent != NULL && ent->pos < file->cursor; ent = ent->next);
+
+    for (; ent != NULL && n < count; ent = ent->next) {
+        ents[n].d_ino = ent->inode->st_ino;
+        ents[n].d_mode = ent->inode->st_mode;
+        ents[n].d_size = ent->inode->st_size;
+        strncpy(ents[n].d_name, ent->name, NAME_MAX + 1);
+        file->cursor = ent->pos + 1;
+        n++;
+    }
+
+    return n;
+}
+
+file_t *RAMFS_file_open(inode_t *inode) {
+    file_t *file = (file_t *)kcalloc(1, sizeof(file_t));
+    bool is_dir = (inode->st_mode & S_IFDIR) != 0;
+
+    file->inode = IC_get(inode);
+    file->cursor = 0;
+    file->close = RAMFS_file_close;
+    file->read = RAMFS_file_read;
+    file->write = is_dir ? NULL : RAMFS_file_write;
+    file->truncate = is_dir ? NULL : RAMFS_file_truncate;
+    file->lseek = RAMFS_file_lseek;
+    file->mmap = RAMFS_file_mmap;
+    file->getdents = RAMFS_getdents;
+
+    return file;
+}
+
+inode_t *RAMFS_lookup(inode_t *dir, const char *name) {
+    RAMFS_dir_ent_t *ent;
+
+    if (strcmp(name, ".") == 0) {
+        return IC_get(dir);
+    }
+    if (strcmp(name, "..") == 0) {
+        return IC_get((dir->parent_inode != NULL) ? dir->parent_inode : dir);
+    }
+
+    ent = find_ent((RAMFS_inode_t *)dir, name, name_hash(name));
+    return (ent != NULL) ? IC_get(ent->inode) : NULL;
+}
+
+// Returns a reference to a new, empty file or directory
+inode_t *RAMFS_create(inode_t *dir, const char *name, mode_t mode) {
+    RAMFS_inode_t *ram_dir = (RAMFS_inode_t *)dir;
+    RAMFS_superblock_t *sb = (RAMFS_superblock_t *)dir->parent_superblock;
+    RAMFS_dir_ent_t *ent;
+    uint32_t hash = name_hash(name);
+    int len = strlen(name);
+
+    if ((dir->st_mode & S_IFDIR) == 0 || dir->st_nlink == 0 || len == 0 || len > NAME_MAX ||
+        strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        find_ent(ram_dir, name, hash) != NULL)
+    {
+        return NULL;
+    }
+
+    ent = (RAMFS_dir_ent_t *)kmalloc(sizeof(RAMFS_dir_ent_t));
+    ent->name = (char *)kmalloc(len + 1);
+    memcpy(ent->name, name, len + 1);
+    ent->hash = hash;
+    ent->pos = ram_dir->next_pos++;
+    ent->inode = IC_insert((inode_t *)init_inode(&sb->superblock, sb->next_ino++, mode));
+    ent->inode->parent_inode = IC_get(dir);
+
+    ent->hash_next = ram_dir->buckets[hash % ram_dir->num_buckets];
+    ram_dir->buckets[hash % ram_dir->num_buckets] = ent;
+    ent->prev = ram_dir->tail;
+    ent->next = NULL;
+    if (ram_dir->tail) ram_dir->tail->next = ent;
+    else ram_dir->head = ent;
+    ram_dir->tail = ent;
+
+    if (++ram_dir->num_entries > ram_dir->num_buckets * MAX_LOAD) {
+        grow_dir(ram_dir);
+    }
+
+    return IC_get(ent->inode);
+}
+
+// Deletes a file or an empty directory, its pages are freed once the last open of it is closed
+int RAMFS_unlink(inode_t *dir, const char *name) {
+    RAMFS_inode_t *ram_dir = (RAMFS_inode_t *)dir;
+    RAMFS_dir_ent_t *ent, **link;
+    uint32_t hash = name_hash(name);
+
+    if ((dir->st_mode & S_IFDIR) == 0 || (ent = find_ent(ram_dir, name, hash)) == NULL) {
+        return -1;
+    }
+    if (((RAMFS_inode_t *)ent->inode)->num_entries > 0) {
+        printk("RAMFS_unlink(): Directory %s isn't empty\n", name);
+        return -1;
+    }
+
+    link = &ram_dir->buckets[hash % ram_dir->num_buckets];
+    while (*link != ent) {
+        link = &(*link)->hash_next;
+    }
+    *link = ent->hash_next;
+
+    if (ent->prev) ent->prev->next = ent->next;
+    else ram_dir->head = ent->next;
+    if (ent->next) ent->next->prev = ent->prev;
+    else ram_dir->tail = ent->prev;
+    ram_dir->num_entries--;
+
+    IC_remove(ent->inode);
+    IC_put(ent->inode);
+    kfree(ent->name);
+    kfree(ent);
+    return 1;
+}
+
+// Every live inode holds a reference from its directory entry, so it is always cached
+inode_t *RAMFS_read_inode(superblock_t *sb, unsigned long ino) {
+    return IC_lookup(sb, ino);
+}
+
+static RAMFS_inode_t *init_inode(superblock_t *sb, ino_t ino, mode_t mode) {
+    RAMFS_inode_t *inode = (RAMFS_inode_t *)kcalloc(1, sizeof(RAMFS_inode_t));
+
+    // Set inode fields
+    inode->inode.st_ino = ino;
+    inode->inode.st_mode = (mode & S_IFDIR) ? S_IFDIR : S_IFREG;
+    inode->inode.st_nlink = 1;
+    inode->inode.parent_superblock = sb;
+
+    // Set inode methods
+    inode->inode.open = RAMFS_file_open;
+    inode->inode.free = RAMFS_inode_free;
+    inode->inode.readpages = RAMFS_readpages;
+
+    if (mode & S_IFDIR) {
+        inode->inode.lookup = RAMFS_lookup;
+        inode->inode.create = RAMFS_create;
+        inode->inode.unlink = RAMFS_unlink;
+        inode->num_buckets = MIN_BUCKETS;
+        inode->buckets = (RAMFS_dir_ent_t **)kcalloc(MIN_BUCKETS, sizeof(RAMFS_dir_ent_t *));
+    } else {
+        PC_get_mapping(&inode->inode)->flags |= MAPPING_NO_WRITEBACK;
+    }
+
+    return inode;
+}
+
+// Creates an empty filesystem held entirely in memory, ready to be mounted
+superblock_t *RAMFS_init(const char *name) {
+    RAMFS_superblock_t *superblock = (RAMFS_superblock_t *)kcalloc(1, sizeof(RAMFS_superblock_t));
+
+    superblock->superblock.type = "ramfs";
+    superblock->superblock.name = name;
+    superblock->superblock.dev = NULL;
+    superblock->superblock.read_inode = RAMFS_read_inode;
+    superblock->next_ino = RAMFS_ROOT_INO + 1;
+
+    // The superblock keeps the root's reference
+    superblock->superblock.root_inode = IC_insert((inode_t *)init_inode(&superblock->superblock,
+        RAMFS_ROOT_INO, S_IFDIR));
+
+    return (superblock_t *)superblock;
+}
@@ -0,0 +1,81 @@
+#include "splice.h"
+#include "page_cache.h"
+#include "serial.h"
+#include "vga.h"
+#include "printk.h"
+#include <stddef.h>
+
+static int serial_write(splice_sink_t *sink, const char *data, int len) {
+    return SER_send(data, len);
+}
+
+// Echoes to the screen and serial, like putc
+static int console_write(splice_sink_t *sink, const char *data, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        VGA_display_char(data[i]);
+    }
+    return SER_send(data, len);
+}
+
+static int file_write(splice_sink_t *sink, const char *data, int len) {
+    return sink->file->write(sink->file, (char *)data, len);
+}
+
+splice_sink_t SPLICE_serial = {serial_write, NULL};
+splice_sink_t SPLICE_console = {console_write, NULL};
+
+// Streams up to len bytes of a file from *offset into a sink, a page cache page at a time
+// Each page is held while the sink consumes it, so it can't be truncated away under a blocked sink
+// The file's size is taken once, so data a sink appends to the file isn't streamed again
+// Advances *offset, returns the number of bytes moved, 0 at the end of the file, or -1 if nothing could be
+int64_t SPLICE_to_sink(file_t *in, off_t *offset, uint64_t len, splice_sink_t *sink) {
+    cached_page_t *page;
+    uint64_t moved = 0, n;
+    off_t off = *offset, size = in->inode->st_size;
+    int written = 0;
+
+    if (in->inode->readpages == NULL) {
+        printk("SPLICE_to_sink(): Inode %ld isn't in the page cache\n", in->inode->st_ino);
+        return -1;
+    }
+
+    while (moved < len && off < size) {
+        if ((page = PC_get_page(in, off / PAGE_SIZE)) == NULL) {
+            written = -1;
+            break;
+        }
+
+        n = PAGE_SIZE - off % PAGE_SIZE;
+        if (n > len - moved) n = len - moved;
+        if (n > size - off) n = size - off;
+
+        PC_page_get(page);
+        written = sink->write(sink, (char *)page->data + off % PAGE_SIZE, n);
+        PC_page_put(page);
+
+        if (written <= 0) {
+            written = -1;
+            break;
+        }
+        moved += written;
+        off += written;
+        if ((uint64_t)written < n) {
+            break;
+        }
+    }
+
+    *offset = off;
+    return (moved == 0 && written == -1) ? -1 : (int64_t)moved;
+}
+
+// Copies between files through the page cache, out's write takes the data from in's cached pages directly
+int64_t SPLICE_to_file(file_t *in, off_t *offset, uint64_t len, file_t *out) {
+    splice_sink_t sink = {file_write, out};
+
+    if (out->write == NULL) {
+        return -1;
+    }
+    return SPLICE_to_sink(in, offset, len, &sink);
+}
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include "string.h"
 #include "memdef.h"
+#include "dcache.h"
+#include "inode_cache.h"
 
 typedef struct FS_impl {
     FS_detect_cb probe;
@@ -12,8 +14,7 @@ typedef struct FS_impl {
 } FS_impl_t;
 
 static FS_impl_t *head, *tail;
-
-inode_t *FS_inode_for_path_helper(char *path, inode_t *cwd);
+static mount_t *mounts, *mounts_tail;       // The root mount first
 
 // Registers a FS implementation with the VFS
 void FS_register(FS_detect_cb probe) {
@@ -34,6 +35,7 @@ superblock_t *FS_probe(block_dev_t *dev) {
         if ((sb = impl->probe(dev)) != NULL) {
             return sb;
         }
+        impl = impl->next;
     }
 
     printk("FS_probe(): Failed to find supported filesystem\n");
@@ -44,104 +46,244 @@ superblock_t *FS_probe(block_dev_t *dev) {
 int copy_path_item(char *path, char *dst) {
     int i = 0;
 
+    // Items longer than NAME_MAX are cut short in dst, callers reject them by the returned length
     for (i = 0; path[i] && path[i] != '/'; i++) {
-        dst[i] = path[i];
+        if (i < NAME_MAX) dst[i] = path[i];
     }
-    dst[i] = 0;
+    dst[(i < NAME_MAX) ? i : NAME_MAX] = 0;
 
     return i;
 }
 
-typedef struct path_search {
-    char *name;
-    inode_t *result;
-} path_search_t;
+// Swaps a referenced mountpoint for the root of the filesystem mounted on it
+// The mountpoint caches what is mounted, so crossing costs no lookup
+static inode_t *cross_mounts(inode_t *inode) {
+    inode_t *root;
 
-void replace_slashes_with_null(char *str) {
-    while (*str) {
-        if (*str == '/') *str = 0;
-        str++;
+    while (inode->mounted != NULL) {
+        root = IC_get(inode->mounted->root_inode);
+        IC_put(inode);
+        inode = root;
     }
+    return inode;
 }
 
-int path_cb(const char *ent_name, inode_t *inode, void *p) {
-    path_search_t *path_search = (path_search_t *)p;
-
-    if (strcmp(ent_name, path_search->name) == 0) {
-        path_search->result = inode;
-    } else {
-        inode->free(&inode);
-    }
-    return 1;
+// Returns the root directory of the namespace, without taking a reference
+inode_t *FS_root(void) {
+    return (mounts != NULL) ? mounts->sb->root_inode : NULL;
 }
 
-// Walks directory trees
+// Walks directory trees through the dentry cache, crossing into mounted filesystems
+// Absolute paths start at the root mount, or the root of cwd's filesystem if nothing is mounted
+// Returns a reference to the inode, drop it with IC_put
 inode_t *FS_inode_for_path(char *path, inode_t *cwd) {
-    path_search_t path_search;
-    char path_item[255];
+    char path_item[NAME_MAX + 1];
+    inode_t *next;
     int offset;
 
     if (path[0] == '/') {
         path++;
-        cwd = cwd->parent_superblock->root_inode;
+        cwd = (mounts != NULL) ? FS_root() : cwd->parent_superblock->root_inode;
     }
-
-    if (*path == 0) return cwd;
+    cwd = cross_mounts(IC_get(cwd));
 
     while (*path) {
         // Get single entry
         offset = copy_path_item(path, path_item);
-        path_search.name = path_item;
 
-        // Read directories, store result
-        if ((cwd->st_mode & S_IFDIR) == 0) {
-            return NULL;
+        if (offset > 0) {
+            next = (cwd->st_mode & S_IFDIR && offset <= NAME_MAX) ? DC_lookup(cwd, path_item) : NULL;
+            IC_put(cwd);
+
+            if ((cwd = next) == NULL) {
+                return NULL;
+            }
+            cwd = cross_mounts(cwd);
         }
 
-        cwd->readdir(cwd, path_cb, (void *)&path_search);
+        // Iterate to next level of directory, and next path item
+        path += offset;
+        if (*path == '/') path++;
+    }
+
+    return cwd;
+}
 
-        // Handle no result
-        if (path_search.result == NULL) {
-            return NULL;
+// In-memory filesystems have no device, they go by their own name
+static inline const char *mount_source(superblock_t *sb) {
+    return (sb->dev != NULL) ? sb->dev->name : sb->name;
+}
+
+// Attaches a filesystem at an absolute path, the first mount must be the root at "/"
+// Returns 1 on success, -1 on failure
+int FS_mount(superblock_t *sb, char *path) {
+    mount_t *mount;
+    inode_t *dir = NULL;
+
+    for (mount = mounts; mount != NULL; mount = mount->next) {
+        if (mount->sb == sb) {
+            printk("FS_mount(): %s is already mounted at %s\n", mount_source(sb), mount->path);
+            return -1;
         }
+    }
 
-        // Check if result is final
-        if (*(path + offset) == 0) {
-            break;
+    if (mounts == NULL) {
+        if (strcmp(path, "/") != 0) {
+            printk("FS_mount(): The root must be mounted before %s\n", path);
+            return -1;
+        }
+    } else {
+        if (path[0] != '/' || (dir = FS_inode_for_path(path, FS_root())) == NULL) {
+            printk("FS_mount(): Mountpoint %s doesn't exist\n", path);
+            return -1;
+        }
+        if ((dir->st_mode & S_IFDIR) == 0 || dir == sb->root_inode) {
+            printk("FS_mount(): Can't mount on %s\n", path);
+            IC_put(dir);
+            return -1;
         }
 
-        // Iterate to next level of directory, and next path item
-        cwd = path_search.result;
-        path += offset + 1;
+        // The mount keeps the reference, so the mountpoint stays cached with its mounted field
+        dir->mounted = sb;
+    }
+
+    mount = (mount_t *)kmalloc(sizeof(mount_t));
+    mount->sb = sb;
+    mount->mountpoint = dir;
+    mount->path = (char *)kmalloc(strlen(path) + 1);
+    memcpy(mount->path, path, strlen(path) + 1);
+    LL_APPEND(mounts, mounts_tail, mount);
+
+    printk("Mounted %s filesystem on %s at %s\n", sb->type, mount_source(sb), path);
+    return 1;
+}
+
+// Returns the path of the first filesystem of a type to be mounted, or NULL if none is
+char *FS_mount_path(const char *type) {
+    mount_t *mount;
+
+    for (mount = mounts; mount != NULL; mount = mount->next) {
+        if (strcmp(mount->sb->type, type) == 0) {
+            return mount->path;
+        }
+    }
+    return NULL;
+}
+
+void FS_print_mounts(void) {
+    mount_t *mount;
+
+    printk("\nMounts:\n");
+    for (mount = mounts; mount != NULL; mount = mount->next) {
+        printk("%s on %s type %s\n", mount_source(mount->sb), mount->path, mount->sb->type);
+    }
+}
+
+// Returns a reference to the directory holding the last item of path, which is copied to name
+static inode_t *parent_for_path(char *path, inode_t *cwd, char *name) {
+    int len = strlen(path), start;
+    char *dir_path;
+    inode_t *dir;
+
+    while (len > 1 && path[len - 1] == '/') len--;
+    for (start = len; start > 0 && path[start - 1] != '/'; start--);
+
+    if (len - start == 0 || len - start > NAME_MAX) {
+        return NULL;
+    }
+    memcpy(name, path + start, len - start);
+    name[len - start] = 0;
+
+    dir_path = (char *)kmalloc(start + 1);
+    memcpy(dir_path, path, start);
+    dir_path[start] = 0;
+    dir = FS_inode_for_path(dir_path, cwd);
+    kfree(dir_path);
+
+    if (dir != NULL && (dir->st_mode & S_IFDIR) == 0) {
+        IC_put(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+// Returns a reference to the file at path, creating it if it doesn't exist
+inode_t *FS_create(char *path, inode_t *cwd, mode_t mode) {
+    char name[NAME_MAX + 1];
+    inode_t *dir, *inode;
+
+    if ((dir = parent_for_path(path, cwd, name)) == NULL) {
+        printk("FS_create(): No directory for %s\n", path);
+        return NULL;
+    }
+
+    if ((inode = DC_lookup(dir, name)) == NULL) {
+        if (dir->create != NULL) {
+            inode = dir->create(dir, name, mode);
+        } else {
+            printk("FS_create(): %s is on a read only filesystem\n", path);
+        }
+
+        // Drop the negative entry the lookup left
+        DC_invalidate(dir, name);
+    }
+
+    IC_put(dir);
+    return inode;
+}
+
+// Deletes the name at path, the file is freed once the last open of it is closed
+int FS_unlink(char *path, inode_t *cwd) {
+    char name[NAME_MAX + 1];
+    inode_t *dir;
+    int rc = -1;
+
+    if ((dir = parent_for_path(path, cwd, name)) == NULL) {
+        printk("FS_unlink(): No directory for %s\n", path);
+        return -1;
+    }
+
+    if (dir->unlink != NULL) {
+        rc = dir->unlink(dir, name);
+        DC_invalidate(dir, name);
     }
 
-    return path_search.result;
+    IC_put(dir);
+    return rc;
 }
 
-int readfs_cb(const char *ent_name, inode_t *inode, void *p) {
-    int n_tabs = *(int *)p, i, next_tabs = n_tabs + 1;
+#define DIRENT_BATCH 4
+
+// Prints a directory tree, reading each directory in batches of entries
+static void print_dir(inode_t *dir, int n_tabs) {
+    dirent_t *ents = (dirent_t *)kmalloc(DIRENT_BATCH * sizeof(dirent_t));
+    file_t *file = dir->open(dir);
+    inode_t *inode;
     char tabs[(n_tabs * 4) + 1];
+    int i, n;
 
     for (i = 0; i < (n_tabs * 4); i++) {
         tabs[i] = ' ';
     }
     tabs[n_tabs * 4] = 0;
 
-    printb("%s/%s\n", tabs, ent_name);
-    if (inode->st_mode & S_IFDIR) {
-        inode->readdir(inode, readfs_cb, (void *)&next_tabs);
+    while ((n = file->getdents(file, ents, DIRENT_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            printb("%s/%s\n", tabs, ents[i].d_name);
+            if ((ents[i].d_mode & S_IFDIR) && (inode = DC_lookup(dir, ents[i].d_name)) != NULL) {
+                print_dir(inode, n_tabs + 1);
+                IC_put(inode);
+            }
+        }
     }
 
-    inode->free(&inode);
-
-    return 1;
+    file->close(&file);
+    kfree(ents);
 }
 
 void FS_print(superblock_t *superblock) {
-    int ntabs = 0;
-
     printk("\nFilesystem entries:\n");
-    superblock->root_inode->readdir(superblock->root_inode, readfs_cb, (void *)&ntabs);
+    print_dir(superblock->root_inode, 0);
 }
 
 void FS_print_file(char *path, superblock_t *superblock) {
@@ -149,6 +291,7 @@ void FS_print_file(char *path, superblock_t *superblock) {
     inode_t *inode;
     inode = FS_inode_for_path(path, superblock->root_inode);
     file = inode->open(inode);
+    IC_put(inode);
     char buffer[513];
     int len;
     buffer[512] = 0;
@@ -0,0 +1,37 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "block.h"
+#include "proc_queue.h"
+#include "memdef.h"
+#include <stdbool.h>
+
+#define AHCI_NUM_SLOTS 32
+
+typedef struct AHCI_block_dev AHCI_block_dev_t;
+typedef struct AHCI_port_regs AHCI_port_regs_t;
+typedef struct AHCI_cmd_header AHCI_cmd_header_t;
+typedef struct AHCI_cmd_table AHCI_cmd_table_t;
+
+struct AHCI_block_dev {
+    block_dev_t dev;
+    volatile AHCI_port_regs_t *regs;
+    uint8_t port;
+    bool ncq;
+    uint8_t queue_depth;
+    AHCI_cmd_header_t *cmd_list;
+    AHCI_cmd_table_t *cmd_tables;
+    volatile uint32_t slots_busy;       // Slots holding a command or reserved for one
+    volatile uint32_t slots_issued;     // Slots the HBA is working on
+    volatile uint32_t slots_failed;
+    volatile bool exclusive;            // A non-queued command is running, queued ones must wait
+    proc_queue_t blocked;
+    AHCI_block_dev_t *next;
+};
+
+AHCI_block_dev_t *AHCI_probe(void);
+int AHCI_read_block(block_dev_t *dev, uint64_t blk_num, void *dst);
+int AHCI_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst);
+int AHCI_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src);
+
+#endif
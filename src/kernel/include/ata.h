@@ -2,18 +2,46 @@
 #define ATA_H
 
 #include "block.h"
+#include "proc_queue.h"
+#include "memdef.h"
 #include <stdbool.h>
 
 typedef struct ATA_block_dev ATA_block_dev_t;
+typedef struct ATA_channel ATA_channel_t;
+
+// Physical region descriptor, one per DMA buffer segment
+typedef struct ATA_prd {
+    uint32_t addr;
+    uint16_t byte_count;
+    uint16_t flags;
+} __attribute__((packed)) ATA_prd_t;
+
+// Bus master DMA state, shared by both drives on an IDE channel
+struct ATA_channel {
+    uint16_t ata_base;
+    uint16_t bmide_base;        // Bus master registers, 0 if DMA is unavailable
+    uint8_t irq;
+    ATA_prd_t *prd_table;
+    physical_addr_t prd_phys;
+    uint8_t *bounce;            // Contiguous buffer for non DMA-able destinations
+    physical_addr_t bounce_phys;
+    volatile bool busy;
+    volatile bool dma_done;
+    volatile uint8_t dma_status;
+    proc_queue_t blocked;
+};
 
 struct ATA_block_dev {
     block_dev_t dev;
     uint16_t ata_base;
     uint8_t slave;
+    ATA_channel_t *channel;
 };
 
 ATA_block_dev_t *ATA_probe(uint16_t base, uint8_t slave, const char *name, uint8_t irq);
 int ATA_read_block(block_dev_t *dev, uint64_t blk_num, void *dst);
+int ATA_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst);
+int ATA_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src);
 
 // PIO Bus Addresses
 #define PRIMARY_BASE 0x1F0
@@ -23,4 +51,4 @@ int ATA_read_block(block_dev_t *dev, uint64_t blk_num, void *dst);
 #define PRIMARY_IRQ 46
 #define SECONDARY_IRQ 47
 
-#endif
\ No newline at end of file
+#endif
@@ -3,9 +3,29 @@
 
 #include <stdint-gcc.h>
 
+#define BIO_MAX_VECS 16
+#define BIO_PENDING 0
+
+// Bio and request directions
+#define BIO_READ 0
+#define BIO_WRITE 1
+
 enum block_dev_type {MASS_STORAGE, PARTITION};
 typedef struct block_dev block_dev_t;
+typedef struct bio bio_t;
+typedef struct blk_request blk_request_t;
+typedef struct blk_queue blk_queue_t;
+typedef struct blk_sched blk_sched_t;
+
 typedef int (*read_block_f)(block_dev_t *dev, uint64_t blk_num, void *dst);
+typedef int (*read_blocks_f)(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst);
+typedef int (*write_blocks_f)(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src);
+// Starts a batch of requests, completing each later with BLK_end_request
+// Returns how many requests were accepted, the rest are requeued
+typedef int (*queue_rq_f)(block_dev_t *dev, blk_request_t **rqs, int count);
+// Redirects a bio to another device instead of queueing it (used by stacked devices like partitions)
+typedef void (*submit_bio_f)(block_dev_t *dev, bio_t *bio);
+typedef void (*bio_end_io_f)(bio_t *bio);
 
 struct block_dev {
     uint64_t tot_len;
@@ -15,8 +35,105 @@ struct block_dev {
     const char *name;
     uint8_t fs_type;
     block_dev_t *next;
+    read_blocks_f read_blocks;      // Optional, multi-block reads into one buffer
+    queue_rq_f queue_rq;            // Optional, requests are read synchronously without it
+    submit_bio_f submit_bio;        // Optional
+    blk_queue_t *queue;
+    write_blocks_f write_blocks;    // Optional, the device is read only without it
 };
 
+// One buffer of a bio's scatter-gather list, a multiple of the block size long
+typedef struct bio_vec {
+    void *buff;
+    uint32_t len;
+} bio_vec_t;
+
+// An I/O on a range of blocks, completed asynchronously through end_io
+struct bio {
+    block_dev_t *dev;
+    uint64_t blk_num;
+    uint32_t num_blks;
+    bio_vec_t vecs[BIO_MAX_VECS];
+    int num_vecs;
+    uint8_t op;                     // BIO_READ or BIO_WRITE
+    volatile int status;            // BIO_PENDING until completed, then 1 or -1
+    bio_end_io_f end_io;
+    void *private;
+    bio_t *next;                    // Next bio of the same request
+};
+
+// Adjacent bios merged into one contiguous range of blocks
+struct blk_request {
+    block_dev_t *dev;
+    uint64_t blk_num;
+    uint32_t num_blks;
+    uint32_t num_segs;              // Buffers of all its bios, at most this many segments
+    uint8_t op;
+    bio_t *bio;
+    bio_t *bio_tail;
+    uint64_t expires;               // TSC deadline, used by the deadline scheduler
+    int status;                     // Free for the driver to use while dispatched
+    uint32_t pending;               // Free for the driver to use while dispatched
+    blk_request_t *sort_prev;       // Pending requests sorted by block number
+    blk_request_t *sort_next;
+    blk_request_t *fifo_prev;       // Pending requests in submission order
+    blk_request_t *fifo_next;
+};
+
+// Picks which pending request is dispatched next
+struct blk_sched {
+    const char *name;
+    blk_request_t *(*next_request)(blk_queue_t *q);
+};
+
+// Shared by a disk and its partitions
+struct blk_queue {
+    block_dev_t *dev;               // Device the queue dispatches to
+    blk_sched_t *sched;
+    blk_request_t *sort_head;
+    blk_request_t *fifo_head;
+    blk_request_t *fifo_tail;
+    blk_request_t *requeue;         // Requests the driver didn't accept, dispatched first
+    blk_request_t *free_rqs;
+    uint64_t head_pos;              // Block after the last dispatched request
+    int direction;                  // Elevator sweep direction, 1 up or -1 down
+    uint32_t max_blocks;            // Largest request merging may build
+    uint32_t max_segments;          // Most buffers a merged request may have, set by drivers with a limit
+    uint32_t max_in_flight;
+    uint32_t in_flight;
+    uint32_t num_pending;
+    uint32_t plugged;
+    uint8_t dispatching;
+    uint8_t rerun;
+    uint64_t merges;
+    uint64_t dispatched;
+};
+
+// Walks a request's buffers as contiguous segments
+typedef struct blk_seg_iter {
+    bio_t *bio;
+    int vec;
+    uint32_t offset;
+} blk_seg_iter_t;
+
 int BLK_register(block_dev_t *dev);
+block_dev_t *BLK_get(const char *name);
+int BLK_set_scheduler(block_dev_t *dev, const char *name);
+
+void BLK_bio_init(bio_t *bio, block_dev_t *dev, uint64_t blk_num, bio_end_io_f end_io, void *private);
+int BLK_bio_add(bio_t *bio, void *buff, uint32_t len);
+void BLK_submit(bio_t *bio);
+int BLK_submit_wait(bio_t *bio);
+void BLK_plug(block_dev_t *dev);
+void BLK_unplug(block_dev_t *dev);
+void BLK_run_queue(block_dev_t *dev);
+void BLK_end_request(blk_request_t *rq, int status);
+int BLK_read(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst);
+int BLK_write(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src);
+
+void BLK_seg_init(blk_seg_iter_t *iter, blk_request_t *rq);
+int BLK_next_segment(blk_seg_iter_t *iter, uint32_t max_len, uint8_t **buff, uint32_t *len);
+
+blk_sched_t *BLK_find_scheduler(const char *name);
 
-#endif
\ No newline at end of file
+#endif
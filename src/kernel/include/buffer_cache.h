@@ -0,0 +1,50 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include "block.h"
+#include <stdint-gcc.h>
+
+#define BUF_DIRTY 0x1
+#define BUF_REFERENCED 0x2  // Used since the clock hand last passed
+#define BUF_READAHEAD 0x4   // Prefetched and not used yet
+
+typedef struct buffer buffer_t;
+
+// One cached block of a device
+struct buffer {
+    block_dev_t *dev;
+    uint64_t blk_num;
+    uint8_t *data;
+    uint32_t size;
+    uint8_t flags;
+    volatile uint8_t valid;     // Data matches the disk, or is newer if dirty
+    volatile uint8_t locked;    // Read in progress, cleared by the completion
+    uint32_t refcount;
+    uint64_t dirtied;           // TSC when it was last dirtied while clean
+    buffer_t *hash_next;
+};
+
+typedef struct buffer_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t ra_issued;         // Blocks prefetched
+    uint64_t ra_used;           // Prefetched blocks later read
+    uint64_t ra_wasted;         // Prefetched blocks evicted without being read
+    uint64_t writebacks;        // Dirty blocks written back
+    uint64_t flushes;           // Runs of the background flusher
+    uint32_t num_buffers;
+    uint32_t num_dirty;
+} buffer_stats_t;
+
+buffer_t *BUF_read(block_dev_t *dev, uint64_t blk_num);
+int BUF_prefetch(block_dev_t *dev, uint64_t blk_num, uint32_t count);
+void BUF_release(buffer_t *buf);
+void BUF_mark_dirty(buffer_t *buf);
+int BUF_sync(block_dev_t *dev);
+void BUF_start_flusher(void);
+void BUF_invalidate(block_dev_t *dev);
+void BUF_get_stats(buffer_stats_t *stats);
+void BUF_print_stats(void);
+
+#endif
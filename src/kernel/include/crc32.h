@@ -0,0 +1,8 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint-gcc.h>
+
+uint32_t crc32(const void *data, uint64_t len);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "vfs.h"
+#include <stdint-gcc.h>
+
+typedef struct dentry dentry_t;
+
+// A name in a directory, and the inode it resolves to
+struct dentry {
+    inode_t *parent;
+    uint32_t hash;
+    char *name;
+    inode_t *inode;             // NULL for a negative entry, the name doesn't exist
+    dentry_t *hash_next;
+    dentry_t *lru_prev;         // Most recently used first
+    dentry_t *lru_next;
+};
+
+typedef struct dcache_stats {
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t num_dentries;
+} dcache_stats_t;
+
+inode_t *DC_lookup(inode_t *dir, const char *name);
+void DC_invalidate(inode_t *dir, const char *name);
+void DC_get_stats(dcache_stats_t *stats);
+void DC_print_stats(void);
+
+#endif
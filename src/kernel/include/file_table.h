@@ -0,0 +1,19 @@
+#ifndef FILE_TABLE_H
+#define FILE_TABLE_H
+
+#include "proc.h"
+#include "vfs.h"
+#include "memdef.h"
+#include <stdbool.h>
+
+// Returns true if [addr, addr + len) lies in user space
+static inline bool user_range(uint64_t addr, uint64_t len) {
+    return addr + len >= addr && addr + len <= USER_SPACE_END;
+}
+
+void FD_init(void);
+void FD_close_all(process_t *proc);
+file_t *FD_get(process_t *proc, uint64_t fd);
+int64_t FD_transfer(process_t *proc, uint64_t fd, uint64_t buf, uint64_t len, int64_t offset, bool write);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef FREE_MAP_H
+#define FREE_MAP_H
+
+#include <stdint-gcc.h>
+#include <stdbool.h>
+
+#define FREE_MAP_NONE UINT64_MAX
+#define FREE_BLOCK_WORDS 64         // Words of bits stored together, 4096 bits
+
+// Free runs within the bits a tree node covers
+typedef struct free_summary {
+    uint32_t pre;                   // Free bits at the start
+    uint32_t suf;                   // Free bits at the end
+    uint32_t best;                  // Longest free run
+} free_summary_t;
+
+// A bitmap of free units, set bits are free
+// Blocks that are entirely free or used aren't stored, the summary tree above them says which they are
+// The tree holds a summary of each 64 bit word and merges them upwards, so runs are found in log time
+typedef struct free_map {
+    uint64_t num_bits;
+    uint64_t num_free;
+    uint64_t leaves;                // Words covered by the tree, a power of two
+    uint64_t **blocks;              // NULL while uniform
+    free_summary_t *tree;           // Root at 1, the summary of word w at leaves + w
+} free_map_t;
+
+void free_map_init(free_map_t *map, uint64_t num_bits);
+void free_map_destroy(free_map_t *map);
+bool free_map_test(free_map_t *map, uint64_t bit);
+void free_map_set(free_map_t *map, uint64_t start, uint64_t len, bool free);
+uint64_t free_map_find(free_map_t *map, uint64_t goal, uint64_t want, uint64_t *len);
+
+#endif
@@ -3,7 +3,8 @@
 
 #include <stdint-gcc.h>
 
-typedef uint64_t (*sys_call_f)(uint64_t);
+// Arguments arrive in rsi, rdx and rcx, after the sys call number in rdi
+typedef uint64_t (*sys_call_f)(uint64_t arg, uint64_t arg2, uint64_t arg3);
 #define SYS_CALL_IRQ 206
 
 void init_sys_calls();
@@ -0,0 +1,9 @@
+#ifndef INITRAMFS_H
+#define INITRAMFS_H
+
+#include "vfs.h"
+#include <stdint-gcc.h>
+
+int INITRAMFS_unpack(inode_t *root, uint8_t *archive, uint64_t len);
+
+#endif
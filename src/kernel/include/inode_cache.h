@@ -0,0 +1,25 @@
+#ifndef INODE_CACHE_H
+#define INODE_CACHE_H
+
+#include "vfs.h"
+#include <stdint-gcc.h>
+
+typedef struct inode_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t shrunk;            // Unused inodes freed by the shrinker
+    uint32_t num_inodes;
+    uint32_t num_unused;
+} inode_cache_stats_t;
+
+inode_t *IC_lookup(superblock_t *sb, ino_t ino);
+inode_t *IC_insert(inode_t *inode);
+void IC_remove(inode_t *inode);
+inode_t *IC_get(inode_t *inode);
+void IC_put(inode_t *inode);
+void IC_forget(inode_t *inode);
+uint64_t IC_shrink(uint64_t nr_to_scan);
+void IC_get_stats(inode_cache_stats_t *stats);
+void IC_print_stats(void);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include "proc.h"
+
+typedef struct ring_ctx ring_ctx_t;
+
+void RING_init(void);
+int RING_release(process_t *proc);
+
+#endif
@@ -13,6 +13,7 @@ typedef void (*irq_handler_t)(uint8_t irq, uint32_t error_code, void *arg);
 // IRQ Interface
 void IRQ_init();
 void IRQ_set_handler(uint8_t irq, irq_handler_t handler, void *arg);
+void IRQ_set_ist(uint8_t irq, uint8_t ist);
 
 // PIC Interface
 void IRQ_set_mask(uint8_t irq);
@@ -2,10 +2,12 @@
 #define KMALLOC_H
 
 #include <stddef.h>
+#include "pf_alloc.h"
 
 // Kernel heap allocator
 void kfree(void *addr);
 void *kmalloc(size_t size);
 void *kcalloc(size_t nmemb, size_t size);
+void kmalloc_register_shrinker(shrinker_f shrink);
 
 #endif
\ No newline at end of file
@@ -5,11 +5,13 @@
 
 #define KERNEL_TEXT_START       0xffffffff80000000  // Last 2GB
 #define KERNEL_STACKS_START     0xffffff8000000000  // PML4[511]
+#define KERNEL_MMIO_START       0xffff810000000000  // PML4[258]
 #define KERNEL_HEAP_START       0xffff808000000000  // PML4[257]
 #define KERNEL_MMAP_START       0xffff800000000000  // PML4[256]
 
 #define USER_TEXT_START     0x400000
 #define USER_STACK_START    0x40000000
+#define USER_SPACE_END      0x0000800000000000  // Top of the lower canonical half
 
 typedef uint64_t virtual_addr_t;
 typedef uint64_t physical_addr_t;
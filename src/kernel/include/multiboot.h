@@ -35,6 +35,7 @@ struct mem_region {
 typedef struct mmap {
     struct mem_region kernel;
     struct mem_region multiboot;
+    struct mem_region initrd;       // First boot module, empty if there is none
     struct mem_region physical_regions[MAX_REGIONS];
     uint8_t num_regions;
     struct multiboot_elf_tag *elf_tag; // Should be moved
@@ -47,5 +48,7 @@ struct multiboot_info {
 
 void parse_multiboot_tags(struct multiboot_info *);
 char *get_elf_section_name(int section_name_index);
+struct mem_region *get_initrd(void);
+void free_initrd(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include "block.h"
+#include "proc_queue.h"
+#include "memdef.h"
+
+#define NVME_MAX_IO_QUEUES 8
+#define NVME_QUEUE_SIZE 64
+#define NVME_QUEUE_SLOTS (NVME_QUEUE_SIZE - 1)    // A full queue keeps one entry empty
+
+typedef struct NVME_block_dev NVME_block_dev_t;
+typedef struct NVME_ctrl NVME_ctrl_t;
+typedef struct NVME_queue NVME_queue_t;
+typedef struct NVME_sqe NVME_sqe_t;
+typedef struct NVME_cqe NVME_cqe_t;
+
+// A submission / completion queue pair
+struct NVME_queue {
+    uint16_t qid;
+    uint16_t size;
+    NVME_sqe_t *sq;
+    volatile NVME_cqe_t *cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint8_t phase;
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint64_t *prp_lists[NVME_QUEUE_SLOTS];     // One PRP list frame per command slot
+    physical_addr_t prp_phys[NVME_QUEUE_SLOTS];
+    volatile uint16_t status[NVME_QUEUE_SLOTS];
+    blk_request_t *slot_rqs[NVME_QUEUE_SLOTS];  // Block layer request a slot's command belongs to
+    volatile uint64_t slots_busy;
+    volatile uint64_t slots_done;
+    proc_queue_t blocked;
+};
+
+struct NVME_ctrl {
+    volatile uint8_t *regs;
+    uint32_t doorbell_stride;
+    uint32_t max_cmd_pages;
+    NVME_queue_t admin;
+    NVME_queue_t io[NVME_MAX_IO_QUEUES];
+    int num_io_queues;
+    block_dev_t *ns;
+};
+
+struct NVME_block_dev {
+    block_dev_t dev;
+    NVME_ctrl_t *ctrl;
+    uint32_t nsid;
+};
+
+NVME_block_dev_t *NVME_probe(void);
+int NVME_read_block(block_dev_t *dev, uint64_t blk_num, void *dst);
+int NVME_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst);
+int NVME_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src);
+int NVME_queue_rq(block_dev_t *dev, blk_request_t **rqs, int count);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "vfs.h"
+#include "radix.h"
+#include "memdef.h"
+
+#define PAGE_READAHEAD 1        // Read in ahead of the reader, not yet accessed
+#define PAGE_DIRTY 2            // Newer than the file on disk
+#define PAGE_REFERENCED 4       // Accessed since the shrinker last passed
+
+#define MAPPING_NO_WRITEBACK 1  // Pages live only in memory, writes never dirty them
+#define MAPPING_UNHASHED 2      // File was deleted, only its inode still reaches the mapping
+#define MAPPING_BUSY 4          // Tree is being changed by an allocating insert, the shrinker must skip it
+
+// A page frame holding 4 KiB of a file
+struct cached_page {
+    physical_addr_t frame;
+    uint8_t *data;              // Frame in the direct physical map
+    uint64_t index;             // Page number within the file
+    uint32_t refcount;          // User mappings and transient pins, pinned pages are never dropped
+    uint8_t flags;
+    volatile uint8_t locked;    // Being read in
+    volatile uint8_t valid;
+    volatile uint8_t error;     // Some read of the page failed
+    volatile uint32_t pending;  // Reads still filling the page
+};
+
+// Cached pages of one file, shared by every open of it
+struct address_space {
+    superblock_t *sb;
+    ino_t ino;
+    radix_tree_t pages;
+    uint64_t num_pages;
+    uint64_t num_dirty;
+    uint8_t flags;
+    address_space_t *hash_next;
+};
+
+typedef struct page_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t num_pages;
+    uint64_t num_dirty;
+    uint64_t ra_issued;         // Pages read ahead
+    uint64_t ra_used;           // Readahead pages later accessed
+    uint64_t ra_wasted;         // Readahead pages dropped without being accessed
+    uint64_t shrunk;            // Clean pages freed by the shrinker
+} page_cache_stats_t;
+
+address_space_t *PC_get_mapping(inode_t *inode);
+void PC_unhash_mapping(inode_t *inode);
+cached_page_t *PC_get_page(file_t *file, uint64_t index);
+cached_page_t *PC_find_page(inode_t *inode, uint64_t index);
+void PC_readahead(file_t *file, uint64_t index);
+void PC_page_get(cached_page_t *page);
+void PC_page_put(cached_page_t *page);
+void PC_page_io_start(cached_page_t *page);
+void PC_page_io_done(cached_page_t *page, int status);
+int PC_pread(file_t *file, char *dst, int len, off_t offset);
+int PC_read(file_t *file, char *dst, int len);
+int PC_pwrite(file_t *file, const char *src, int len, off_t offset);
+int PC_write(file_t *file, const char *src, int len);
+void PC_mark_dirty(address_space_t *mapping, cached_page_t *page);
+void PC_clear_dirty(address_space_t *mapping, cached_page_t *page);
+int PC_dirty_pages(address_space_t *mapping, uint64_t start, cached_page_t **pages, int max);
+void PC_truncate(inode_t *inode, off_t size);
+void PC_remove_mapping(inode_t *inode);
+uint64_t PC_shrink(uint64_t nr_to_scan);
+void PC_get_stats(page_cache_stats_t *stats);
+void PC_print_stats(void);
+
+#endif
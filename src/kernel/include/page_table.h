@@ -3,12 +3,15 @@
 
 #include "memdef.h"
 #include <stddef.h>
+#include <stdbool.h>
 
 #define PAGE_WRITABLE 0x2
 #define PAGE_NO_EXECUTE 0x8000000000000000
 #define PAGE_ALLOCATED 0x200
 #define PAGE_HUGE 0x80
 #define PML4_MMAP_INDEX 256
+#define PAGE_FAULT_IRQ 14
+#define PAGE_FAULT_IST 2
 
 #define GET_VIRT_ADDR(PHYS_ADDR) (PHYS_ADDR + KERNEL_MMAP_START)
 #define GET_PHYS_ADDR(VIRT_ADDR) (VIRT_ADDR - KERNEL_MMAP_START)
@@ -21,8 +24,13 @@ typedef struct permission {
 
 void map_page(virtual_addr_t virt_addr, physical_addr_t phys_addr, uint64_t flags);
 int free_pf_from_virtual_addr(virtual_addr_t addr);
+physical_addr_t MMU_virt_to_phys(virtual_addr_t addr);
+void *MMU_map_mmio(physical_addr_t phys_addr, size_t size);
 void setup_pml4();
 void free_multiboot_sections();
 void user_allocate_range(virtual_addr_t start, size_t size, permission_t perms);
+void MMU_map_user_page(virtual_addr_t vaddr, physical_addr_t frame, permission_t perms);
+bool MMU_user_page_used(virtual_addr_t vaddr);
+physical_addr_t MMU_unmap_user_page(virtual_addr_t vaddr);
 
 #endif
\ No newline at end of file
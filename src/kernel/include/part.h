@@ -1,14 +1,19 @@
 #ifndef PART_H
 #define PART_H
 
-#include "ata.h"
+#include "block.h"
 
 typedef struct part_block_dev {
-    ATA_block_dev_t ata;
-    uint32_t lba_offset;
-    uint32_t num_sectors;
+    block_dev_t dev;
+    block_dev_t *parent;
+    uint64_t lba_offset;
+    uint64_t num_sectors;
 } part_block_dev_t;
 
-int parse_MBR(ATA_block_dev_t *, part_block_dev_t **);
+#define MAX_PARTITIONS 16
 
-#endif
\ No newline at end of file
+int parse_MBR(block_dev_t *drive, part_block_dev_t **partitions, int max);
+int parse_GPT(block_dev_t *drive, part_block_dev_t **partitions, int max);
+int parse_partitions(block_dev_t *drive, part_block_dev_t **partitions, int max);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint-gcc.h>
+
+typedef struct pci_dev pci_dev_t;
+
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+    uint32_t bar[6];
+    pci_dev_t *next;
+};
+
+void PCI_enumerate(void);
+pci_dev_t *PCI_find_class(uint8_t class_code, uint8_t subclass, pci_dev_t *start);
+pci_dev_t *PCI_find_device(uint16_t vendor_id, uint16_t device_id, pci_dev_t *start);
+uint32_t PCI_config_readl(pci_dev_t *dev, uint8_t offset);
+void PCI_config_writel(pci_dev_t *dev, uint8_t offset, uint32_t value);
+uint64_t PCI_bar_addr(pci_dev_t *dev, int bar);
+void PCI_enable_bus_master(pci_dev_t *dev);
+
+// Configuration space offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_CLASS 0x08
+#define PCI_HEADER_TYPE 0x0C
+#define PCI_BAR0 0x10
+#define PCI_INTERRUPT_LINE 0x3C
+
+// Command register bits
+#define PCI_CMD_IO_SPACE 0x1
+#define PCI_CMD_MEM_SPACE 0x2
+#define PCI_CMD_BUS_MASTER 0x4
+#define PCI_CMD_INT_DISABLE 0x400
+
+// Class codes
+#define PCI_CLASS_MASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+
+// Legacy PIC vector for a PCI interrupt line
+#define PCI_IRQ(line) (0x20 + (line))
+
+#endif
@@ -2,9 +2,17 @@
 #define PF_ALLOC_H
 
 #include "memdef.h"
+#include <stdint-gcc.h>
+#include <stdbool.h>
+
+// Frees up to nr_to_scan cached objects when memory runs low, returning how many were freed
+typedef uint64_t (*shrinker_f)(uint64_t nr_to_scan);
 
 void MMU_init_pf_alloc();
 physical_addr_t MMU_pf_alloc(void);
+physical_addr_t MMU_pf_alloc_contig(int num);
 void MMU_pf_free(physical_addr_t pf);
+bool MMU_pf_available(void);
+void MMU_register_shrinker(shrinker_f shrink);
 
 #endif
\ No newline at end of file
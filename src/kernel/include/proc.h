@@ -7,6 +7,9 @@
 #include "irq.h"
 #include "init_syscalls.h"
 
+#define PROC_MAX_FILES 32
+#define PROC_MAX_MAPS 16
+
 typedef void (*kproc_t)(void *);
 
 struct regfile {
@@ -28,6 +31,9 @@ struct Process {
     struct regfile regfile;
     int pid;
     virtual_addr_t stack_top;
+    struct file *files[PROC_MAX_FILES];     // Open files, indexed by file descriptor
+    virtual_addr_t maps[PROC_MAX_MAPS];     // Start of each file mapped with mmap, 0 if the slot is free
+    struct ring_ctx *io_ring;               // Submission ring shared with the process, if it set one up
     process_t *next;
     process_t *prev;
 };
@@ -39,6 +45,7 @@ extern process_t *next_proc;
 void PROC_init(void);
 void PROC_run(void);
 process_t *PROC_create_kthread(kproc_t entry_point, void *arg);
+void PROC_free(process_t *proc);
 
 // Blocking process management
 void PROC_block_on(proc_queue_t *, int enable_ints);
@@ -55,6 +62,16 @@ void PROC_init_queue(proc_queue_t *);
     STI;\
 }
 
+// Same as wait_event_interruptable, but usable with interrupts disabled
+// Blocking isn't possible there, so halt until an interrupt changes the condition
+#define wait_event_or_halt(wait_queue, condition) {\
+    if (check_int()) {\
+        wait_event_interruptable(wait_queue, condition);\
+    } else {\
+        while (condition) asm volatile ("sti; hlt; cli");\
+    }\
+}
+
 #define KEXIT_IST 4
 #define KEXIT_IRQ 207
 
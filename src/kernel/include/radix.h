@@ -0,0 +1,30 @@
+#ifndef RADIX_H
+#define RADIX_H
+
+#include <stdint-gcc.h>
+
+#define RADIX_BITS 6
+#define RADIX_SLOTS (1 << RADIX_BITS)
+#define RADIX_MAX_HEIGHT 11
+
+typedef struct radix_node radix_node_t;
+struct radix_node {
+    void *slots[RADIX_SLOTS];
+    uint32_t count;
+};
+
+// Maps 64 bit indices to pointers, growing in height as larger indices are inserted
+typedef struct radix_tree {
+    radix_node_t *root;
+    int height;
+} radix_tree_t;
+
+typedef int (*radix_cb)(uint64_t index, void *item, void *p);
+
+void radix_init(radix_tree_t *tree);
+void *radix_lookup(radix_tree_t *tree, uint64_t index);
+int radix_insert(radix_tree_t *tree, uint64_t index, void *item);
+void *radix_delete(radix_tree_t *tree, uint64_t index);
+int radix_for_each(radix_tree_t *tree, radix_cb callback, void *p);
+
+#endif
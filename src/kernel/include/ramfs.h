@@ -0,0 +1,8 @@
+#ifndef RAMFS_H
+#define RAMFS_H
+
+#include "vfs.h"
+
+superblock_t *RAMFS_init(const char *name);
+
+#endif
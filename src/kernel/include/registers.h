@@ -50,4 +50,14 @@ static inline uint64_t get_cr2() {
     return res;
 }
 
+static inline void invlpg(uint64_t addr) {
+    asm volatile ( "invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline uint64_t read_tsc() {
+    uint32_t low, high;
+    asm volatile ( "rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 #endif
\ No newline at end of file
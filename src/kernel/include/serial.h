@@ -5,5 +5,6 @@
 int SER_init(void);
 int SER_write(const char *buff, int len);
 int SER_writeb(const char *buff, int len);
+int SER_send(const char *data, int len);
 
 #endif
\ No newline at end of file
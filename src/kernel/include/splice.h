@@ -0,0 +1,22 @@
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include "vfs.h"
+#include <stdint-gcc.h>
+
+typedef struct splice_sink splice_sink_t;
+
+// Where spliced data goes, fed straight from page cache pages
+struct splice_sink {
+    // Consumes len bytes, returns how many were taken or -1 on failure
+    int (*write)(splice_sink_t *sink, const char *data, int len);
+    file_t *file;               // Destination of file sinks
+};
+
+extern splice_sink_t SPLICE_serial;
+extern splice_sink_t SPLICE_console;
+
+int64_t SPLICE_to_sink(file_t *in, off_t *offset, uint64_t len, splice_sink_t *sink);
+int64_t SPLICE_to_file(file_t *in, off_t *offset, uint64_t len, file_t *out);
+
+#endif
@@ -6,9 +6,11 @@
 
 void *memset(void *dest, uint8_t c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 size_t strlen(const char *);
 char *strncpy(char *dst, const char *src, size_t n);
 int strcmp(const char *, const char *);
+int strcasecmp(const char *, const char *);
 int strncmp(const char * s1, const char * s2, size_t n);
 const char *strchr(const char *, int);
 void strrev(char *);
@@ -4,5 +4,7 @@
 void test_page_alloc();
 void test_kmalloc();
 void test_snakes();
+void test_block_throughput();
+void test_fs_throughput();
 
 #endif
\ No newline at end of file
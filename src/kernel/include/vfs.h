@@ -13,22 +13,45 @@ typedef uint64_t off_t;
 typedef struct inode inode_t;
 typedef struct file file_t;
 typedef struct superblock superblock_t;
+typedef struct cached_page cached_page_t;
+typedef struct address_space address_space_t;
 
 // mode_t values
 #define S_IFDIR 0040000 // Directory
 #define S_IFREG 0100000 // Regular file
 
-typedef int (*readdir_cb)(const char *, inode_t *, void *);
+#define NAME_MAX 255
+#define PATH_MAX 4096
+
+// One directory entry returned by getdents
+typedef struct dirent {
+    ino_t d_ino;
+    mode_t d_mode;
+    off_t d_size;
+    char d_name[NAME_MAX + 1];
+} dirent_t;
+
+// Sequential readahead window of an open file, in page indices
+typedef struct file_ra {
+    uint64_t next_index;        // Page a sequential reader would read next
+    uint64_t start;             // First page of the last window read ahead
+    uint64_t end;
+    uint32_t size;              // Pages in the last window, 0 after a random access
+} file_ra_t;
 
 struct file {
     inode_t *inode;
     off_t cursor;
-    unsigned long first_cluster;
     int (*close)(file_t **file);
     int (*read)(file_t *file, char *dst, int len);
-    int (*write)(file_t *file, char *dst, int len);
+    int (*write)(file_t *file, char *src, int len);
+    // Sets the file's size, zero filling any growth
+    int (*truncate)(file_t *file, off_t size);
     int (*lseek)(file_t *file, off_t offset);
     int (*mmap)(file_t *file, void *addr);
+    // Reads up to count entries of a directory from the cursor, returns how many, 0 at the end
+    int (*getdents)(file_t *file, dirent_t *ents, int count);
+    file_ra_t ra;
 };
 
 struct inode {
@@ -37,14 +60,28 @@ struct inode {
     uid_t st_uid;
     gid_t st_gid;
     off_t st_size;
+    uint32_t st_nlink;          // 0 once deleted
     file_t *(*open)(inode_t *inode);
-    int (*readdir)(inode_t *inode, readdir_cb callback, void *p);
-    int (*unlink)(inode_t *inode, const char *name);
+    // Returns a reference to the named entry of a directory, or NULL if it doesn't exist
+    inode_t *(*lookup)(inode_t *dir, const char *name);
+    // Returns a reference to a new, empty file in a directory
+    inode_t *(*create)(inode_t *dir, const char *name, mode_t mode);
+    int (*unlink)(inode_t *dir, const char *name);
     void (*free)(inode_t **inode);
+    // Starts reading the locked pages in, finishing each with PC_page_io_done
+    int (*readpages)(file_t *file, cached_page_t **pages, int count);
     inode_t *parent_inode;
     superblock_t *parent_superblock;
+    superblock_t *mounted;      // Filesystem mounted on this directory, paths cross into its root
+    address_space_t *mapping;   // Cached pages of the file, set by the page cache on first use
+    uint32_t refcount;          // Managed by the inode cache
+    inode_t *hash_next;
+    inode_t *unused_prev;       // Unreferenced inodes, most recently used first
+    inode_t *unused_next;
 };
 
+#define SB_CASE_INSENSITIVE 1   // Names differing only in ASCII case are the same file
+
 struct superblock {
     inode_t *root_inode;
     inode_t *(*read_inode)(superblock_t *, unsigned long inode_num);
@@ -52,13 +89,28 @@ struct superblock {
     void (*put_super)(superblock_t *);
     const char *name, *type;
     block_dev_t *dev;
+    uint32_t flags;
 };
 
 typedef superblock_t *(*FS_detect_cb)(struct block_dev *dev);
 
+// A filesystem attached to the namespace
+typedef struct mount {
+    superblock_t *sb;
+    inode_t *mountpoint;        // Directory it covers, holding a reference, NULL for the root
+    char *path;
+    struct mount *next;
+} mount_t;
+
 void FS_register(FS_detect_cb probe);
 superblock_t *FS_probe(block_dev_t *dev);
 inode_t *FS_inode_for_path(char *path, inode_t *cwd);
+inode_t *FS_create(char *path, inode_t *cwd, mode_t mode);
+int FS_unlink(char *path, inode_t *cwd);
+int FS_mount(superblock_t *sb, char *path);
+inode_t *FS_root(void);
+char *FS_mount_path(const char *type);
+void FS_print_mounts(void);
 void FS_print(superblock_t *superblock);
 void FS_print_file(char *path, superblock_t *superblock);
 
@@ -0,0 +1,38 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "block.h"
+#include "proc_queue.h"
+#include "memdef.h"
+#include <stdbool.h>
+
+typedef struct VIRTIO_blk_dev VIRTIO_blk_dev_t;
+typedef struct virtq_desc virtq_desc_t;
+typedef struct virtq_avail virtq_avail_t;
+typedef struct virtq_used virtq_used_t;
+typedef struct virtio_blk_slot virtio_blk_slot_t;
+
+struct VIRTIO_blk_dev {
+    block_dev_t dev;
+    uint16_t io_base;
+    uint16_t queue_size;
+    virtq_desc_t *desc;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    uint16_t last_used;
+    bool event_idx;
+    virtio_blk_slot_t *slots;       // Indirect table, header and status per request
+    physical_addr_t slots_phys;
+    int num_slots;
+    volatile uint64_t slots_busy;
+    volatile uint64_t slots_done;
+    proc_queue_t blocked;
+    VIRTIO_blk_dev_t *next;
+};
+
+VIRTIO_blk_dev_t *VIRTIO_blk_probe(void);
+int VIRTIO_blk_read_block(block_dev_t *dev, uint64_t blk_num, void *dst);
+int VIRTIO_blk_read_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *dst);
+int VIRTIO_blk_write_blocks(block_dev_t *dev, uint64_t blk_num, uint32_t count, void *src);
+
+#endif
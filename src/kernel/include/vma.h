@@ -0,0 +1,27 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include "memdef.h"
+#include "page_table.h"
+#include "vfs.h"
+#include <stdbool.h>
+
+typedef struct vma vma_t;
+
+// A range of user memory backed by a file, filled in page by page on first touch
+struct vma {
+    virtual_addr_t start;
+    virtual_addr_t end;
+    file_t *file;
+    off_t offset;           // File offset mapped at start
+    uint64_t file_size;     // Bytes backed by the file, the rest of the range reads as zero
+    permission_t perms;
+    vma_t *next;
+};
+
+int MMU_map_file(virtual_addr_t start, size_t size, file_t *file, off_t offset, size_t file_size, permission_t perms);
+int MMU_file_fault(virtual_addr_t addr);
+bool MMU_range_used(virtual_addr_t start, size_t size);
+file_t *MMU_unmap_file(virtual_addr_t start);
+
+#endif
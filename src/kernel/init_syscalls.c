@@ -19,6 +19,9 @@ void init_sys_calls() {
     set_sys_call(PUTC_SYS_CALL, putc_sys_call);
 }
 
-uint64_t sys_call_isr(uint64_t sys_call_index, uint64_t arg) {
-    return sys_calls[sys_call_index](arg);
+uint64_t sys_call_isr(uint64_t sys_call_index, uint64_t arg, uint64_t arg2, uint64_t arg3) {
+    if (sys_call_index >= NUM_SYS_CALLS || sys_calls[sys_call_index] == NULL) {
+        return (uint64_t)-1;
+    }
+    return sys_calls[sys_call_index](arg, arg2, arg3);
 }
\ No newline at end of file
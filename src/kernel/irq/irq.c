@@ -124,6 +124,11 @@ void set_idt_entry(uint8_t irq) {
     entry->res2 = 0;
 }
 
+// Changes which interrupt stack an IDT entry switches to, 0 stays on the current stack
+void IRQ_set_ist(uint8_t irq, uint8_t ist) {
+    idt[irq].ist = ist;
+}
+
 void PIC_remap() {
     uint8_t mask1 = inb(PIC1_DATA);
     uint8_t mask2 = inb(PIC2_DATA);
@@ -505,7 +505,7 @@ ist_stack1_bottom:
 ist_stack1_top:
 
 ist_stack2_bottom:
-    resb 4096 * 2
+    resb 4096 * 4
 ist_stack2_top:
 
 ist_stack3_bottom:
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include "string.h"
 
 #include "gdt.h"
 #include "irq.h"
@@ -10,12 +11,25 @@
 #include "pf_alloc.h"
 #include "page_table.h"
 #include "stack_alloc.h"
+#include "kmalloc.h"
 
 #include "init_syscalls.h"
 #include "proc.h"
+#include "file_table.h"
+#include "io_ring.h"
 
+#include "pci.h"
 #include "ata.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "nvme.h"
+#include "buffer_cache.h"
+#include "page_cache.h"
+#include "dcache.h"
+#include "inode_cache.h"
 #include "fat.h"
+#include "ramfs.h"
+#include "initramfs.h"
 #include "part.h"
 #include "vfs.h"
 
@@ -53,9 +67,16 @@ void kmain(struct multiboot_info *multiboot_tags) {
     // Cleanup old address space
     free_multiboot_sections();
 
+    // Caches give memory back when physical frames run out
+    // Clean file pages return frames, unused inodes return kmalloc blocks before the heap grows
+    MMU_register_shrinker(PC_shrink);
+    kmalloc_register_shrinker(IC_shrink);
+
     init_sys_calls();
 
     PROC_init();
+    FD_init();
+    RING_init();
     PROC_create_kthread(kmain_thread, NULL);
 
     while (1) {
@@ -66,39 +87,130 @@ void kmain(struct multiboot_info *multiboot_tags) {
     }
 }
 
-void kmain_thread(void *arg) {
-    part_block_dev_t *partitions[4];
-    ATA_block_dev_t *drive;
-    superblock_t *superblock;
+// Creates a directory to mount on, where the filesystem holding it allows
+static void make_mountpoint(char *path) {
+    inode_t *dir;
 
-    printb("\nExecuting in kthread\n");
+    if ((dir = FS_inode_for_path(path, FS_root())) == NULL) {
+        dir = FS_create(path, FS_root(), S_IFDIR);
+    }
+    if (dir != NULL) {
+        IC_put(dir);
+    }
+}
 
-    // Probe for ATA drive on primary master bus
-    if ((drive = ATA_probe(PRIMARY_BASE, 0, "sda", PRIMARY_IRQ)) == NULL) {
+// Mounts filesystems from every partition of the boot drive
+// The first becomes the root if nothing is mounted yet, the others go under /mnt by device name
+static void probe_disks(void *arg) {
+    part_block_dev_t *partitions[MAX_PARTITIONS];
+    ATA_block_dev_t *ata_drive;
+    AHCI_block_dev_t *sata_drive;
+    VIRTIO_blk_dev_t *virtio_drive;
+    NVME_block_dev_t *nvme_drive;
+    block_dev_t *drive;
+    superblock_t *superblock;
+    char mount_path[16];
+    int i;
+
+    // Discover PCI devices, so drivers can locate their controllers
+    PCI_enumerate();
+
+    // Register SATA drives on any AHCI controllers, virtio disks, and NVMe namespaces
+    sata_drive = AHCI_probe();
+    virtio_drive = VIRTIO_blk_probe();
+    nvme_drive = NVME_probe();
+
+    // Boot from the ATA drive on primary master bus, or the first SATA / virtio / NVMe drive
+    if ((ata_drive = ATA_probe(PRIMARY_BASE, 0, "sda", PRIMARY_IRQ)) != NULL) {
+        drive = &ata_drive->dev;
+    } else if (sata_drive != NULL) {
+        drive = &sata_drive->dev;
+    } else if (virtio_drive != NULL) {
+        drive = &virtio_drive->dev;
+    } else if (nvme_drive != NULL) {
+        drive = &nvme_drive->dev;
+    } else {
         printb("No ATA drive was found on primary/master");
         return;
     }
 
-    // Parse Master Boot Record on sda
-    if (parse_MBR(drive, partitions) != 1) {
-        printb("Failed to parse MBR on %s\n", drive->dev.name);
+    // Parse the MBR or GPT on the boot drive
+    if (parse_partitions(drive, partitions, MAX_PARTITIONS) != 1) {
+        printb("Failed to parse partition table on %s\n", drive->name);
         return;
     }
 
+    for (i = 0; i < MAX_PARTITIONS; i++) {
+        if (partitions[i] == NULL) continue;
+
+        if ((superblock = FS_probe((block_dev_t *)partitions[i])) == NULL) {
+            printb("Failed to find supported filesystem on %s\n", partitions[i]->dev.name);
+            continue;
+        }
+
+        if (FS_root() == NULL) {
+            strncpy(mount_path, "/", sizeof(mount_path));
+        } else {
+            strncpy(mount_path, "/mnt/", sizeof(mount_path));
+            strncpy(mount_path + 5, partitions[i]->dev.name, sizeof(mount_path) - 6);
+            mount_path[sizeof(mount_path) - 1] = '\0';
+            make_mountpoint("/mnt");
+            make_mountpoint(mount_path);
+        }
+
+        // A filesystem that isn't mounted is released, with any thread it started
+        if (FS_mount(superblock, mount_path) == -1 && superblock->put_super != NULL) {
+            superblock->put_super(superblock);
+        }
+    }
+}
+
+void kmain_thread(void *arg) {
+    struct mem_region *initrd;
+    superblock_t *superblock;
+    int count;
+
+    printb("\nExecuting in kthread\n");
+
+    // Dirty buffers are written back in the background from here on
+    BUF_start_flusher();
+
     // Register FAT32 filesystem in VFS
     FS_register(FAT_detect);
 
-    // Probe sda0 for supported filesystem
-    if ((superblock = FS_probe((block_dev_t *)partitions[0])) == NULL) {
-        printb("Failed to find supported filesystem on %s\n", partitions[0]->ata.dev.name);
+    // With an initramfs, init runs from memory while the disks are probed in the background
+    if ((initrd = get_initrd()) != NULL) {
+        superblock = RAMFS_init("initramfs");
+        count = INITRAMFS_unpack(superblock->root_inode, (uint8_t *)GET_VIRT_ADDR(initrd->start),
+            initrd->end - initrd->start);
+        free_initrd();
+
+        if (count > 0) {
+            printb("Unpacked %d entries from the initramfs\n", count);
+            FS_mount(superblock, "/");
+            PROC_create_kthread(probe_disks, NULL);
+        }
+    }
+
+    if (FS_root() == NULL) {
+        probe_disks(NULL);
+    }
+
+    if (FS_root() == NULL) {
+        printb("Failed to mount a root filesystem\n");
         return;
-    };
+    }
+
+    // Scratch files live in memory
+    make_mountpoint("/tmp");
+    FS_mount(RAMFS_init("tmpfs"), "/tmp");
+    FS_print_mounts();
 
     if (KBD_init() < 0) {
         printb("Failed to initialize keyboard\n");
     }
 
-    setup_userspace(superblock->root_inode, "/bin/init.bin");
+    setup_userspace(FS_root(), "/bin/init.bin");
 }
 
 void setup_userspace(inode_t *root, char *binary_path) {
@@ -106,6 +218,10 @@ void setup_userspace(inode_t *root, char *binary_path) {
     permission_t perms;
     
     prog_start = ELF_mmap_binary(root, binary_path);
+    BUF_print_stats();
+    PC_print_stats();
+    DC_print_stats();
+    IC_print_stats();
 
     if (prog_start == 0) return;
 
@@ -0,0 +1,35 @@
+#include "crc32.h"
+#include <stdbool.h>
+
+#define CRC32_POLY 0xEDB88320       // IEEE 802.3, bit reversed
+
+static uint32_t table[256];
+static bool table_ready;
+
+static void init_table(void) {
+    uint32_t crc;
+    int i, bit;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    table_ready = true;
+}
+
+// The CRC32 used by GPT, zlib and Ethernet
+uint32_t crc32(const void *data, uint64_t len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFF;
+    uint64_t i;
+
+    if (!table_ready) init_table();
+
+    for (i = 0; i < len; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
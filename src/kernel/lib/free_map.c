@@ -0,0 +1,187 @@
+#include "free_map.h"
+#include "kmalloc.h"
+#include <stddef.h>
+
+#define ALL_FREE (~0UL)
+
+static inline free_summary_t *block_summary(free_map_t *map, uint64_t block) {
+    return &map->tree[map->leaves / FREE_BLOCK_WORDS + block];
+}
+
+static uint64_t get_word(free_map_t *map, uint64_t word) {
+    uint64_t *block = map->blocks[word / FREE_BLOCK_WORDS];
+
+    if (block != NULL) {
+        return block[word % FREE_BLOCK_WORDS];
+    }
+    return block_summary(map, word / FREE_BLOCK_WORDS)->best ? ALL_FREE : 0;
+}
+
+static void summarize_word(free_summary_t *s, uint64_t word) {
+    uint32_t best = 0;
+    uint64_t x;
+
+    if (word == ALL_FREE) {
+        s->pre = s->suf = s->best = 64;
+        return;
+    }
+
+    // Each step shortens every run of set bits by one
+    for (x = word; x != 0; x &= x >> 1) {
+        best++;
+    }
+    s->pre = __builtin_ctzl(~word);
+    s->suf = __builtin_clzl(~word);
+    s->best = best;
+}
+
+static void merge(free_summary_t *s, free_summary_t *left, free_summary_t *right, uint32_t child_len) {
+    s->pre = (left->pre == child_len) ? child_len + right->pre : left->pre;
+    s->suf = (right->suf == child_len) ? child_len + left->suf : right->suf;
+    s->best = left->suf + right->pre;
+    if (left->best > s->best) s->best = left->best;
+    if (right->best > s->best) s->best = right->best;
+}
+
+// Sets up a map of num_bits bits, all used
+void free_map_init(free_map_t *map, uint64_t num_bits) {
+    uint64_t num_words = (num_bits + 63) / 64;
+
+    map->num_bits = num_bits;
+    map->num_free = 0;
+    for (map->leaves = FREE_BLOCK_WORDS; map->leaves < num_words; map->leaves *= 2);
+
+    map->blocks = (uint64_t **)kcalloc(map->leaves / FREE_BLOCK_WORDS, sizeof(uint64_t *));
+    map->tree = (free_summary_t *)kcalloc(2 * map->leaves, sizeof(free_summary_t));
+}
+
+// Frees the map's blocks and tree
+void free_map_destroy(free_map_t *map) {
+    uint64_t i;
+
+    for (i = 0; i < map->leaves / FREE_BLOCK_WORDS; i++) {
+        if (map->blocks[i] != NULL) kfree(map->blocks[i]);
+    }
+    kfree(map->blocks);
+    kfree(map->tree);
+}
+
+bool free_map_test(free_map_t *map, uint64_t bit) {
+    return bit < map->num_bits && (get_word(map, bit / 64) & (1UL << (bit % 64)));
+}
+
+// Marks len bits from start free or used
+// Only the touched words and their ancestors are updated, blocks that become uniform are dropped
+void free_map_set(free_map_t *map, uint64_t start, uint64_t len, bool free) {
+    uint64_t end, word, first, last, old, mask, diff, *block, lo, hi, i;
+    uint32_t child_len;
+
+    if (start >= map->num_bits) return;
+    end = (start + len > map->num_bits) ? map->num_bits : start + len;
+    if (end <= start) return;
+    first = start / 64;
+    last = (end - 1) / 64;
+
+    for (word = first; word <= last; word++) {
+        mask = ALL_FREE;
+        if (word == first) mask &= ALL_FREE << (start % 64);
+        if (word == last && end % 64) mask &= ALL_FREE >> (64 - end % 64);
+
+        old = get_word(map, word);
+        if ((block = map->blocks[word / FREE_BLOCK_WORDS]) == NULL) {
+            if ((free ? old | mask : old & ~mask) == old) continue;
+
+            block = (uint64_t *)kmalloc(FREE_BLOCK_WORDS * sizeof(uint64_t));
+            for (i = 0; i < FREE_BLOCK_WORDS; i++) block[i] = old;
+            map->blocks[word / FREE_BLOCK_WORDS] = block;
+        }
+
+        block[word % FREE_BLOCK_WORDS] = free ? old | mask : old & ~mask;
+        summarize_word(&map->tree[map->leaves + word], block[word % FREE_BLOCK_WORDS]);
+
+        for (diff = old ^ block[word % FREE_BLOCK_WORDS]; diff != 0; diff &= diff - 1) {
+            if (free) map->num_free++;
+            else map->num_free--;
+        }
+    }
+
+    // Merge the changed summaries up to the root a level at a time
+    lo = (map->leaves + first) / 2;
+    hi = (map->leaves + last) / 2;
+    for (child_len = 64; lo >= 1; child_len *= 2, lo /= 2, hi /= 2) {
+        for (i = lo; i <= hi; i++) {
+            merge(&map->tree[i], &map->tree[2 * i], &map->tree[2 * i + 1], child_len);
+        }
+    }
+
+    for (i = first / FREE_BLOCK_WORDS; i <= last / FREE_BLOCK_WORDS; i++) {
+        if (map->blocks[i] != NULL &&
+            (block_summary(map, i)->best == 0 || block_summary(map, i)->pre == FREE_BLOCK_WORDS * 64))
+        {
+            kfree(map->blocks[i]);
+            map->blocks[i] = NULL;
+        }
+    }
+}
+
+// Finds the first run of want free bits starting at or after lo, within the node covering [start, start + len)
+// carry is the length of the free run ending just before the node, counting from lo
+static uint64_t find(free_map_t *map, uint64_t node, uint64_t start, uint64_t len, uint64_t lo,
+    uint64_t want, uint64_t *carry)
+{
+    free_summary_t *s = &map->tree[node];
+    uint64_t word, r, i;
+
+    if (start + len <= lo) {
+        return FREE_MAP_NONE;
+    }
+
+    // Nodes entirely past lo are answered from their summary unless the run is inside them
+    if (start >= lo) {
+        if (*carry + s->pre >= want) {
+            return start - *carry;
+        }
+        if (s->best < want) {
+            *carry = (s->pre == len) ? *carry + len : s->suf;
+            return FREE_MAP_NONE;
+        }
+    }
+
+    if (len == 64) {
+        word = get_word(map, start / 64);
+        for (i = (lo > start) ? lo - start : 0; i < 64; i++) {
+            if (!(word & (1UL << i))) {
+                *carry = 0;
+            } else if (++*carry >= want) {
+                return start + i + 1 - want;
+            }
+        }
+        return FREE_MAP_NONE;
+    }
+
+    if ((r = find(map, 2 * node, start, len / 2, lo, want, carry)) != FREE_MAP_NONE) {
+        return r;
+    }
+    return find(map, 2 * node + 1, start + len / 2, len / 2, lo, want, carry);
+}
+
+// Finds free bits for want units, searching from goal and wrapping around to the start
+// Returns the first run of want from goal, otherwise the longest run, its length in len
+// Returns FREE_MAP_NONE if nothing is free, the bits aren't marked used
+uint64_t free_map_find(free_map_t *map, uint64_t goal, uint64_t want, uint64_t *len) {
+    uint64_t carry = 0, bit, best = map->tree[1].best;
+
+    if (best == 0 || want == 0) {
+        return FREE_MAP_NONE;
+    }
+    if (want > best) want = best;
+    if (goal >= map->num_bits) goal = 0;
+
+    if ((bit = find(map, 1, 0, map->leaves * 64, goal, want, &carry)) == FREE_MAP_NONE) {
+        carry = 0;
+        bit = find(map, 1, 0, map->leaves * 64, 0, want, &carry);
+    }
+
+    *len = want;
+    return bit;
+}
@@ -5,6 +5,8 @@
 
 #define NUM_POOLS 7
 #define PAGE_OFFSET 12
+#define MAX_SHRINKERS 8
+#define SHRINK_BATCH 32
 
 typedef struct free_list {
     struct free_list *next;
@@ -31,6 +33,9 @@ static kmalloc_pool_t pools[NUM_POOLS] = {
     {2048, 0, NULL}
 };
 
+static shrinker_f shrinkers[MAX_SHRINKERS];
+static int num_shrinkers;
+
 // Counts the number of pages required to fit (size) bytes
 static int num_pages(size_t size) {
     return ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) >> PAGE_OFFSET;
@@ -72,6 +77,27 @@ static free_list_t *pop_free_block(kmalloc_pool_t *pool) {
     return block;
 }
 
+// Registers a cache of kmalloc'd objects, shrunk before a pool grows once physical memory runs out
+// Pools never give their pages back, so freed objects can only be reused by later allocations
+void kmalloc_register_shrinker(shrinker_f shrink) {
+    if (num_shrinkers == MAX_SHRINKERS) {
+        return;
+    }
+    shrinkers[num_shrinkers++] = shrink;
+}
+
+// Lets caches free objects into the pools when no frame is left for a new pool page
+static void run_shrinkers(void) {
+    int i;
+
+    if (MMU_pf_available()) {
+        return;
+    }
+    for (i = 0; i < num_shrinkers; i++) {
+        shrinkers[i](SHRINK_BATCH);
+    }
+}
+
 // Allocates memory on the kernel heap of (size) bytes
 void *kmalloc(size_t size) {
     size_t full_size = size + sizeof(block_header_t);
@@ -82,6 +108,9 @@ void *kmalloc(size_t size) {
     for (i = 0; i < NUM_POOLS; i++) {
         if (full_size <= pools[i].block_size) {
             // Adequate block size
+            if (pools[i].avail == 0) {
+                run_shrinkers();
+            }
             if (pools[i].avail == 0) {
                 allocate_blocks(&pools[i]);
             }
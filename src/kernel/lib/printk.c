@@ -285,7 +285,7 @@ int printk(const char *fmt, ...) {
     return res;
 }
 
-uint64_t putc_sys_call(uint64_t data) {
+uint64_t putc_sys_call(uint64_t data, uint64_t arg2, uint64_t arg3) {
     char c = (char)data;
     VGA_display_char(c);
     SER_write(&c, 1);
@@ -0,0 +1,131 @@
+#include "radix.h"
+#include "kmalloc.h"
+#include <stddef.h>
+
+#define SLOT(index, level) (((index) >> ((level) * RADIX_BITS)) & (RADIX_SLOTS - 1))
+
+// Largest index a tree of this height can hold, plus one (0 when all indices fit)
+static inline uint64_t max_index(int height) {
+    return (height * RADIX_BITS >= 64) ? 0 : 1UL << (height * RADIX_BITS);
+}
+
+void radix_init(radix_tree_t *tree) {
+    tree->root = NULL;
+    tree->height = 0;
+}
+
+// Returns the item at index, or NULL
+void *radix_lookup(radix_tree_t *tree, uint64_t index) {
+    radix_node_t *node = tree->root;
+    int level;
+
+    if (max_index(tree->height) != 0 && index >= max_index(tree->height)) {
+        return NULL;
+    }
+
+    for (level = tree->height - 1; node != NULL && level > 0; level--) {
+        node = (radix_node_t *)node->slots[SLOT(index, level)];
+    }
+
+    return (node != NULL) ? node->slots[SLOT(index, 0)] : NULL;
+}
+
+// Stores item at index
+// Returns 1 on success, -1 if the index is already used
+int radix_insert(radix_tree_t *tree, uint64_t index, void *item) {
+    radix_node_t *node, **link;
+    int level;
+
+    // Add levels on top until the index fits
+    while (tree->height == 0 || (max_index(tree->height) != 0 && index >= max_index(tree->height))) {
+        node = (radix_node_t *)kcalloc(1, sizeof(radix_node_t));
+        if (tree->root != NULL) {
+            node->slots[0] = tree->root;
+            node->count = 1;
+        }
+        tree->root = node;
+        tree->height++;
+    }
+
+    node = tree->root;
+    for (level = tree->height - 1; level > 0; level--) {
+        link = (radix_node_t **)&node->slots[SLOT(index, level)];
+        if (*link == NULL) {
+            *link = (radix_node_t *)kcalloc(1, sizeof(radix_node_t));
+            node->count++;
+        }
+        node = *link;
+    }
+
+    if (node->slots[SLOT(index, 0)] != NULL) {
+        return -1;
+    }
+
+    node->slots[SLOT(index, 0)] = item;
+    node->count++;
+    return 1;
+}
+
+// Removes the item at index, freeing nodes left empty
+// Returns the removed item, or NULL if there was none
+void *radix_delete(radix_tree_t *tree, uint64_t index) {
+    radix_node_t *path[RADIX_MAX_HEIGHT];
+    radix_node_t *node = tree->root;
+    void *item;
+    int level;
+
+    if (node == NULL || (max_index(tree->height) != 0 && index >= max_index(tree->height))) {
+        return NULL;
+    }
+
+    for (level = tree->height - 1; level > 0; level--) {
+        path[level] = node;
+        if ((node = (radix_node_t *)node->slots[SLOT(index, level)]) == NULL) {
+            return NULL;
+        }
+    }
+
+    if ((item = node->slots[SLOT(index, 0)]) == NULL) {
+        return NULL;
+    }
+    node->slots[SLOT(index, 0)] = NULL;
+
+    // Walk back up, unlinking nodes as they empty
+    for (level = 0; --node->count == 0; level++) {
+        kfree(node);
+        if (level == tree->height - 1) {
+            tree->root = NULL;
+            tree->height = 0;
+            break;
+        }
+        node = path[level + 1];
+        node->slots[SLOT(index, level + 1)] = NULL;
+    }
+
+    return item;
+}
+
+static int for_each_helper(radix_node_t *node, int level, uint64_t base, radix_cb callback, void *p) {
+    uint64_t index;
+    int i;
+
+    for (i = 0; i < RADIX_SLOTS; i++) {
+        if (node->slots[i] == NULL) continue;
+
+        index = base | ((uint64_t)i << (level * RADIX_BITS));
+        if (level == 0) {
+            if (callback(index, node->slots[i], p) == -1) return -1;
+        } else if (for_each_helper((radix_node_t *)node->slots[i], level - 1, index, callback, p) == -1) {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+// Calls the callback on every item in index order, stopping early if it returns -1
+// Returns 1 if every item was visited, -1 if stopped early
+int radix_for_each(radix_tree_t *tree, radix_cb callback, void *p) {
+    if (tree->root == NULL) return 1;
+    return for_each_helper(tree->root, tree->height - 1, 0, callback, p);
+}
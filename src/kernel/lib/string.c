@@ -29,6 +29,18 @@ void *memcpy(void *dest, const void *src, size_t n) {
     return dest;
 }
 
+int memcmp(const void *s1, const void *s2, size_t n) {
+    const uint8_t *a = (const uint8_t *)s1;
+    const uint8_t *b = (const uint8_t *)s2;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (a[i] != b[i]) return a[i] - b[i];
+    }
+
+    return 0;
+}
+
 size_t strlen(const char *s) {
     size_t len = 0;
     if (s == NULL) return 0;
@@ -61,6 +73,21 @@ int strcmp(const char *s1, const char *s2) {
     return *(const unsigned char *)s1 - *(const unsigned char *)s2;
 }
 
+static inline char fold(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// Compares like strcmp, ignoring ASCII case
+int strcasecmp(const char *s1, const char *s2) {
+    if (s1 == NULL || s2 == NULL) return -1;
+
+    while (*s1 && fold(*s1) == fold(*s2)) {
+        s1++;
+        s2++;
+    }
+    return (unsigned char)fold(*s1) - (unsigned char)fold(*s2);
+}
+
 // https://stackoverflow.com/questions/32560167/strncmp-implementation
 int strncmp( const char * s1, const char * s2, size_t n )
 {
@@ -1,9 +1,12 @@
 #include "multiboot.h"
 #include <stddef.h>
+#include <stdbool.h>
 #include "memdef.h"
 #include "printk.h"
+#include "pf_alloc.h"
 
 #define MULTIBOOT_TAG_TYPE_ELF 9
+#define MULTIBOOT_TAG_TYPE_MODULE 3
 #define MULTIBOOT_TAG_TYPE_MMAP 6
 #define MULTIBOOT_TAG_TYPE_END 0
 #define MMAP_ENTRY_FREE_TYPE 1
@@ -20,6 +23,14 @@ struct multiboot_mmap_entry {
     uint32_t zero;
 };
 
+struct multiboot_module_tag {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];
+};
+
 struct multiboot_mmap_tag {
     uint32_t type;
     uint32_t size;
@@ -113,6 +124,43 @@ void parse_mmap_tag(struct multiboot_mmap_tag *tag) {
     mmap.num_regions = i;
 }
 
+// Set once the initramfs frames are in the free pool, the range stays reserved from the bump allocator
+static bool initrd_freed;
+
+// Only the first module is used, as the initramfs
+void parse_module_tag(struct multiboot_module_tag *tag) {
+    if (mmap.initrd.end > mmap.initrd.start) {
+        printk("parse_module_tag(): Ignoring extra module %s\n", tag->cmdline);
+        return;
+    }
+
+    mmap.initrd.start = tag->mod_start;
+    mmap.initrd.end = tag->mod_end;
+}
+
+// Returns the physical range of the initramfs, or NULL if none was loaded
+struct mem_region *get_initrd(void) {
+    return (mmap.initrd.end > mmap.initrd.start && !initrd_freed) ? &mmap.initrd : NULL;
+}
+
+// Gives the frames of the initramfs to the page allocator once it is unpacked
+// The range is left in mmap, so the bump allocator keeps skipping frames that are now in the free pool
+void free_initrd(void) {
+    physical_addr_t pf;
+
+    if (get_initrd() == NULL) {
+        return;
+    }
+
+    for (pf = (mmap.initrd.start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        pf + PAGE_SIZE <= mmap.initrd.end;
+        pf += PAGE_SIZE)
+    {
+        MMU_pf_free(pf);
+    }
+    initrd_freed = true;
+}
+
 // Parses the multiboot tags and populates the mmap struct
 // with memory information
 void parse_multiboot_tags(struct multiboot_info *multiboot_tags) {
@@ -132,6 +180,9 @@ void parse_multiboot_tags(struct multiboot_info *multiboot_tags) {
             case MULTIBOOT_TAG_TYPE_MMAP:
                 parse_mmap_tag((struct multiboot_mmap_tag *)tag);
                 break;
+            case MULTIBOOT_TAG_TYPE_MODULE:
+                parse_module_tag((struct multiboot_module_tag *)tag);
+                break;
             default: break;
         }
     }
@@ -142,5 +193,9 @@ void parse_multiboot_tags(struct multiboot_info *multiboot_tags) {
         mmap.kernel.start, mmap.kernel.end, (mmap.kernel.end - mmap.kernel.start)/1024);
     printk("Multiboot start: 0x%lx, end: 0x%lx, len: %ld B\n", 
         mmap.multiboot.start, mmap.multiboot.end, mmap.multiboot.end - mmap.multiboot.start);
+    if (get_initrd() != NULL) {
+        printk("Initramfs start: 0x%lx, end: 0x%lx, len: %ld KB\n",
+            mmap.initrd.start, mmap.initrd.end, (mmap.initrd.end - mmap.initrd.start) / 1024);
+    }
     print_free_mem_regions();
 }
\ No newline at end of file
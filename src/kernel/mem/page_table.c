@@ -8,18 +8,18 @@
 #include "registers.h"
 #include "irq.h"
 #include "vga.h"
+#include "vma.h"
 
 #define NUM_ENTRIES 512
 
 #define PAGE_PRESENT 0x1
 #define PAGE_USER_ACCESS 0x4
+#define PAGE_DISABLE_CACHE 0x10
 #define PAGE_OFFSET 12
 
 #define ELF_WRITE_FLAG 0x1
 #define ELF_EXEC_FLAG 0x4
 
-#define PAGE_FAULT_IRQ 14
-
 typedef struct page_table_entry {
     uint64_t present : 1;
     uint64_t writable : 1;
@@ -53,6 +53,7 @@ typedef struct {
 } __attribute__((packed)) pt_index_t;
 
 static page_table_t *pml4;
+static virtual_addr_t mmio_brk = KERNEL_MMIO_START;
 extern memory_map_t mmap;
 extern void enable_no_execute(void);
 
@@ -136,32 +137,114 @@ void user_allocate_range(virtual_addr_t start, size_t size, permission_t perms)
     map_range(0, start, size, flags);
 }
 
+// Maps a page frame at a user address
+void MMU_map_user_page(virtual_addr_t vaddr, physical_addr_t frame, permission_t perms) {
+    uint64_t flags = PAGE_PRESENT | PAGE_USER_ACCESS;
+
+    if (perms.w) flags |= PAGE_WRITABLE;
+    if (!perms.x) flags |= PAGE_NO_EXECUTE;
+
+    map_page(vaddr, frame, flags);
+}
+
+// Maps a device's register region into the MMIO region of virtual memory, uncached
+// Returns the virtual address corresponding to phys_addr
+void *MMU_map_mmio(physical_addr_t phys_addr, size_t size) {
+    physical_addr_t pstart = phys_addr & ~(PAGE_SIZE - 1);
+    uint64_t len = (phys_addr + size) - pstart;
+    virtual_addr_t vstart = mmio_brk;
+
+    map_range(pstart, vstart, len, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_DISABLE_CACHE);
+    mmio_brk += (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    return (void *)(vstart + (phys_addr - pstart));
+}
+
 // Returns the page frame associated with a virtual address if it is mapped in PML4
 pt_entry_t *get_page_frame(virtual_addr_t addr) {
     pt_index_t *i = (pt_index_t *)&addr;
-    page_table_t *pdp = entry_to_table(pml4, i->pml4_index);
-    if (pdp == NULL) return NULL;
-    page_table_t *pd = entry_to_table(pdp, i->pdp_index);
-    if (pd == NULL) return NULL;
-    page_table_t *pt = entry_to_table(pd, i->pd_index);
-    if (pt == NULL) return NULL;
+    page_table_t *pdp, *pd, *pt;
+
+    if (!pml4->table[i->pml4_index].present) return NULL;
+    pdp = entry_to_table(pml4, i->pml4_index);
+    if (!pdp->table[i->pdp_index].present) return NULL;
+    pd = entry_to_table(pdp, i->pdp_index);
+    if (!pd->table[i->pd_index].present) return NULL;
+    pt = entry_to_table(pd, i->pd_index);
     return &pt->table[i->pt_index];
 }
 
+// Returns true if a user page is mapped or set to be demand allocated
+bool MMU_user_page_used(virtual_addr_t vaddr) {
+    pt_entry_t *entry = get_page_frame(vaddr);
+
+    return entry != NULL && (entry->present || entry->allocated);
+}
+
+// Removes a user page from the page tables
+// Returns the frame that was mapped there for the caller to release, or 0 if none was
+physical_addr_t MMU_unmap_user_page(virtual_addr_t vaddr) {
+    pt_entry_t *entry = get_page_frame(vaddr);
+    physical_addr_t frame;
+
+    if (entry == NULL || !entry->present) {
+        if (entry != NULL) entry->allocated = 0;
+        return 0;
+    }
+
+    frame = (physical_addr_t)entry->base_addr << PAGE_OFFSET;
+    entry->present = 0;
+    entry->allocated = 0;
+    invlpg(vaddr);
+    return frame;
+}
+
+// Backs a demand allocated page table entry with a page frame
+static void demand_allocate(pt_entry_t *entry) {
+    physical_addr_t pf = MMU_pf_alloc();
+    entry->base_addr = (pf >> PAGE_OFFSET);
+    entry->present = 1;
+    entry->allocated = 0;
+}
+
+// Translates a virtual address into the physical address backing it
+// Demand allocated pages are backed first, so devices can DMA into them
+// Returns 0 if the address is not mapped
+physical_addr_t MMU_virt_to_phys(virtual_addr_t addr) {
+    pt_entry_t *entry;
+
+    // Physical memory map uses huge pages
+    if (addr >= KERNEL_MMAP_START && addr < KERNEL_HEAP_START) {
+        return GET_PHYS_ADDR(addr);
+    }
+
+    if ((entry = get_page_frame(addr)) == NULL) {
+        return 0;
+    }
+
+    if (!entry->present) {
+        if (!entry->allocated) return 0;
+        demand_allocate(entry);
+    }
+
+    return ((physical_addr_t)entry->base_addr << PAGE_OFFSET) | (addr & (PAGE_SIZE - 1));
+}
+
 // Handles page faults
 void page_fault_handler(uint8_t irq, uint32_t error_code, void *arg) {
     virtual_addr_t page = get_cr2();
-    physical_addr_t pf;
     pt_entry_t *entry;
 
     entry = get_page_frame(page);
 
     if (entry != NULL && entry->allocated) {
         // On demand paging
-        pf = MMU_pf_alloc();
-        entry->base_addr = (pf >> PAGE_OFFSET);
-        entry->present = 1;
-        entry->allocated = 0;
+        demand_allocate(entry);
+        return;
+    }
+
+    if ((entry == NULL || !entry->present) && MMU_file_fault(page) == 1) {
+        // File backed mapping, filled from the page cache
         return;
     }
 
@@ -172,6 +255,11 @@ void page_fault_handler(uint8_t irq, uint32_t error_code, void *arg) {
     if (error_code & 0x08) printk("- Read reserved field in page table entry\n");
     if (error_code & 0x10) printk("- Instruction fetch\n");
 
+    if (entry == NULL) {
+        printk("\nNo page table entry\n");
+        while (1) asm("hlt");
+    }
+
     printk("\nPage table entry:\n");
     printk("- physical address: 0x%lx\n",(uint64_t)(entry->base_addr << PAGE_OFFSET));
     printk("- present: %d\n", entry->present);
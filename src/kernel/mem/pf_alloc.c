@@ -21,7 +21,12 @@ typedef struct pf_info {
     uint8_t physical_region_index;
 } pf_info_t;
 
+#define MAX_SHRINKERS 8
+#define SHRINK_BATCH 128
+
 static pf_info_t pf_info;
+static shrinker_f shrinkers[MAX_SHRINKERS];
+static int num_shrinkers;
 extern memory_map_t mmap;
 
 static inline uint64_t align_page(uint64_t addr) {
@@ -33,6 +38,18 @@ static inline bool range_contains_addr(uint64_t addr, uint64_t start, uint64_t e
     return ((addr - start) < (end - start));
 }
 
+// Returns true if the range [start, end) overlaps the region
+static inline bool range_overlaps_region(uint64_t start, uint64_t end, struct mem_region *region) {
+    return start < region->end && region->start < end;
+}
+
+// Returns true if any of the frame holds the kernel, the multiboot info or the initramfs
+static inline bool frame_is_reserved(physical_addr_t pf) {
+    return range_overlaps_region(pf, pf + PAGE_SIZE, &mmap.multiboot) ||
+        range_overlaps_region(pf, pf + PAGE_SIZE, &mmap.kernel) ||
+        range_overlaps_region(pf, pf + PAGE_SIZE, &mmap.initrd);
+}
+
 void push_free_pf(physical_addr_t pf) {
     // Convert physical address to writeable virtual one
     // Write a free pool node at the beginning of the page
@@ -69,6 +86,25 @@ void MMU_init_pf_alloc() {
     pf_info.physical_region_index = 0;
 }
 
+// Registers a cache to be shrunk when physical memory runs out
+void MMU_register_shrinker(shrinker_f shrink) {
+    if (num_shrinkers == MAX_SHRINKERS) {
+        return;
+    }
+    shrinkers[num_shrinkers++] = shrink;
+}
+
+// Asks every registered cache to free objects, returns the total freed
+static uint64_t run_shrinkers(void) {
+    uint64_t freed = 0;
+    int i;
+
+    for (i = 0; i < num_shrinkers; i++) {
+        freed += shrinkers[i](SHRINK_BATCH);
+    }
+    return freed;
+}
+
 // Allocates a physical page frame
 physical_addr_t MMU_pf_alloc(void) {
     physical_addr_t page;
@@ -87,6 +123,10 @@ check_addr:
     {
         // Page is outside of current memory region
         if (pf_info.physical_region_index >= mmap.num_regions) {
+            // Let caches release memory before giving up
+            if (run_shrinkers() > 0 && (pf_option = pop_free_pf()).present) {
+                return pf_option.addr;
+            }
             panic("MMU_pf_alloc(): No physical memory remaining!");
         }
         // Set current free entry to next
@@ -106,14 +146,87 @@ check_addr:
         goto check_addr; // Recheck address
     }
 
+    if (range_contains_addr(pf_info.current_page, mmap.initrd.start, mmap.initrd.end)) {
+        // Page holds the initramfs, its frames go to the free pool once it is unpacked
+        pf_info.current_page = align_page(mmap.initrd.end);
+        goto check_addr; // Recheck address
+    }
+
     page = pf_info.current_page;
     pf_info.current_page += PAGE_SIZE;
     return page;
 }
 
+// Returns the whole frames of [start, end) within the region to the free pool, apart from reserved ones
+// Frames the contiguous allocator steps over are still usable as single frames
+static void release_frames(physical_addr_t start, physical_addr_t end, struct mem_region *region) {
+    physical_addr_t pf;
+
+    if (end > region->end) end = region->end;
+    for (pf = start; range_contains_addr(pf, region->start, region->end) && pf + PAGE_SIZE <= end; pf += PAGE_SIZE) {
+        if (!frame_is_reserved(pf)) {
+            push_free_pf(pf);
+        }
+    }
+}
+
+// Allocates (num) physically contiguous page frames, for devices that DMA
+// Frames are carved from the untouched part of the physical regions, never the free pool
+// Returns the physical address of the first frame
+physical_addr_t MMU_pf_alloc_contig(int num) {
+    struct mem_region *region;
+    physical_addr_t start, end;
+
+check_range:
+    region = &mmap.physical_regions[pf_info.physical_region_index];
+    start = pf_info.current_page;
+    end = start + (uint64_t)num * PAGE_SIZE;
+
+    if (!range_contains_addr(start, region->start, region->end) || end > region->end) {
+        // Run does not fit in the current region, skip to the next one
+        if (pf_info.physical_region_index + 1 >= mmap.num_regions) {
+            panic("MMU_pf_alloc_contig(): No contiguous physical memory remaining!");
+        }
+
+        release_frames(start, region->end, region);
+        pf_info.physical_region_index++;
+        pf_info.current_page = align_page(mmap.physical_regions[pf_info.physical_region_index].start);
+        goto check_range;
+    }
+
+    if (range_overlaps_region(start, end, &mmap.multiboot)) {
+        pf_info.current_page = align_page(mmap.multiboot.end);
+        release_frames(start, pf_info.current_page, region);
+        goto check_range;
+    }
+
+    if (range_overlaps_region(start, end, &mmap.kernel)) {
+        pf_info.current_page = align_page(mmap.kernel.end);
+        release_frames(start, pf_info.current_page, region);
+        goto check_range;
+    }
+
+    if (range_overlaps_region(start, end, &mmap.initrd)) {
+        pf_info.current_page = align_page(mmap.initrd.end);
+        release_frames(start, pf_info.current_page, region);
+        goto check_range;
+    }
+
+    pf_info.current_page = end;
+    return start;
+}
+
 // Returns a physical page frame to the free pool
 void MMU_pf_free(physical_addr_t pf) {
     pf &= ~(PAGE_SIZE - 1);
 
     push_free_pf(pf);
+}
+
+// Returns true if a frame can likely be allocated without shrinking caches
+bool MMU_pf_available(void) {
+    struct mem_region *region = &mmap.physical_regions[pf_info.physical_region_index];
+
+    return pf_info.free_pool != NULL || pf_info.physical_region_index + 1 < mmap.num_regions ||
+        pf_info.current_page + PAGE_SIZE <= region->end;
 }
\ No newline at end of file
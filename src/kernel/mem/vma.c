@@ -0,0 +1,180 @@
+#include "vma.h"
+#include "page_cache.h"
+#include "pf_alloc.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "printk.h"
+#include "ll_generic.h"
+#include "irq.h"
+#include <stddef.h>
+
+static vma_t *head, *tail;
+
+// Records a file backed mapping of size bytes at start, nothing is read until it is touched
+// The file must stay open for as long as the mapping exists
+// Returns 1 on success, -1 on failure
+int MMU_map_file(virtual_addr_t start, size_t size, file_t *file, off_t offset, size_t file_size, permission_t perms) {
+    vma_t *vma;
+
+    if (file->inode->readpages == NULL) {
+        printk("MMU_map_file(): File can't be mapped\n");
+        return -1;
+    }
+
+    vma = (vma_t *)kmalloc(sizeof(vma_t));
+    vma->start = start;
+    vma->end = start + size;
+    vma->file = file;
+    vma->offset = offset;
+    vma->file_size = (file_size < size) ? file_size : size;
+    vma->perms = perms;
+    vma->next = NULL;
+    LL_APPEND(head, tail, vma);
+
+    return 1;
+}
+
+static inline int overlaps(vma_t *vma, virtual_addr_t page) {
+    return vma->start < page + PAGE_SIZE && vma->end > page;
+}
+
+// Maps the cached frame itself when a read-only page lines up with one page of the file
+// Returns 1 if the page was mapped, -1 otherwise
+static int map_shared(vma_t *vma, virtual_addr_t page, permission_t perms) {
+    off_t offset = vma->offset + (page - vma->start);
+    cached_page_t *cpage;
+
+    if (vma->perms.w || page < vma->start || page + PAGE_SIZE > vma->start + vma->file_size ||
+        offset % PAGE_SIZE != 0)
+    {
+        return -1;
+    }
+
+    if ((cpage = PC_get_page(vma->file, offset / PAGE_SIZE)) == NULL) {
+        return -1;
+    }
+
+    PC_page_get(cpage);
+    MMU_map_user_page(page, cpage->frame, perms);
+    return 1;
+}
+
+// Gives the page a private frame holding the file data of every mapping overlapping it
+// Returns 1 on success, -1 on failure
+static int map_private(virtual_addr_t page, permission_t perms) {
+    physical_addr_t frame = MMU_pf_alloc();
+    uint8_t *data = (uint8_t *)GET_VIRT_ADDR(frame);
+    virtual_addr_t from, to;
+    vma_t *vma;
+
+    memset(data, 0, PAGE_SIZE);
+
+    for (vma = head; vma != NULL; vma = vma->next) {
+        if (!overlaps(vma, page)) continue;
+
+        from = (vma->start > page) ? vma->start : page;
+        to = vma->start + vma->file_size;
+        if (to > page + PAGE_SIZE) to = page + PAGE_SIZE;
+
+        if (from < to && PC_pread(vma->file, (char *)data + (from - page), to - from,
+            vma->offset + (from - vma->start)) == -1)
+        {
+            MMU_pf_free(frame);
+            return -1;
+        }
+    }
+
+    MMU_map_user_page(page, frame, perms);
+    return 1;
+}
+
+// Fills a page of a file backed mapping, called from the page fault handler
+// Returns 1 if the address was in a mapping and is now mapped, -1 otherwise
+int MMU_file_fault(virtual_addr_t addr) {
+    virtual_addr_t page = addr & ~(PAGE_SIZE - 1);
+    permission_t perms = {0};
+    vma_t *vma, *only = NULL;
+    int num = 0, ret;
+
+    // Segments can share a page, which then gets the permissions of all of them
+    for (vma = head; vma != NULL; vma = vma->next) {
+        if (!overlaps(vma, page)) continue;
+
+        only = vma;
+        num++;
+        perms.w |= vma->perms.w;
+        perms.x |= vma->perms.x;
+    }
+
+    if (num == 0) {
+        return -1;
+    }
+
+    // Reading the file may touch demand paged kernel memory, so let those faults nest on this stack
+    IRQ_set_ist(PAGE_FAULT_IRQ, 0);
+
+    if (num == 1 && map_shared(only, page, perms) == 1) {
+        ret = 1;
+    } else {
+        ret = map_private(page, perms);
+    }
+
+    IRQ_set_ist(PAGE_FAULT_IRQ, PAGE_FAULT_IST);
+
+    return ret;
+}
+
+// Returns true if any page of [start, start + size) is mapped, demand allocated or in a file backed mapping
+bool MMU_range_used(virtual_addr_t start, size_t size) {
+    virtual_addr_t page;
+    vma_t *vma;
+
+    for (page = start & ~(PAGE_SIZE - 1); page < start + size; page += PAGE_SIZE) {
+        if (MMU_user_page_used(page)) return true;
+
+        for (vma = head; vma != NULL; vma = vma->next) {
+            if (overlaps(vma, page)) return true;
+        }
+    }
+    return false;
+}
+
+// Removes the mapping starting at start and the pages filled in for it
+// Shared pages go back to the page cache, private ones to the frame allocator
+// The mapping must not share pages with another one
+// Returns the mapped file for the caller to close, or NULL if no mapping starts there
+file_t *MMU_unmap_file(virtual_addr_t start) {
+    vma_t *vma, *prev = NULL;
+    virtual_addr_t page;
+    physical_addr_t frame;
+    cached_page_t *cpage;
+    off_t offset;
+    file_t *file;
+
+    for (vma = head; vma != NULL && vma->start != start; vma = vma->next) {
+        prev = vma;
+    }
+    if (vma == NULL) {
+        return NULL;
+    }
+
+    for (page = start; page < vma->end; page += PAGE_SIZE) {
+        if ((frame = MMU_unmap_user_page(page)) == 0) continue;
+
+        offset = vma->offset + (page - start);
+        cpage = (offset % PAGE_SIZE == 0) ? PC_find_page(vma->file->inode, offset / PAGE_SIZE) : NULL;
+        if (cpage != NULL && cpage->frame == frame) {
+            PC_page_put(cpage);
+        } else {
+            MMU_pf_free(frame);
+        }
+    }
+
+    if (prev == NULL) head = vma->next;
+    else prev->next = vma->next;
+    if (tail == vma) tail = prev;
+
+    file = vma->file;
+    kfree(vma);
+    return file;
+}
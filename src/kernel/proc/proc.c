@@ -8,18 +8,24 @@
 #include "gdt.h"
 #include "printk.h"
 #include "syscall.h"
+#include "file_table.h"
+#include "io_ring.h"
 
 #define IE_FLAG 0x200
 #define RES_FLAG 0x2
 
-uint64_t yield_sys_call(uint64_t);
+uint64_t yield_sys_call(uint64_t, uint64_t, uint64_t);
 void kexit_isr(uint8_t, uint32_t, void *);
 
 static int pid = 1;
 static process_t orig_proc;
+static process_t *zombies;          // Exited processes waiting for the reaper, linked through next
+static proc_queue_t reap_queue;
 process_t *curr_proc;
 process_t *next_proc;
 
+static void reap_thread(void *arg);
+
 // Initializes the multitasking system
 void PROC_init(void) {
     virtual_addr_t stack_top = MMU_alloc_stack();
@@ -27,6 +33,9 @@ void PROC_init(void) {
     set_sys_call(YIELD_SYS_CALL, yield_sys_call);
     IRQ_set_handler(KEXIT_IRQ, kexit_isr, NULL);
     TSS_set_ist(stack_top, KEXIT_IST);
+
+    PROC_init_queue(&reap_queue);
+    PROC_create_kthread(reap_thread, NULL);
 }
 
 // Drives the multitasking system
@@ -78,23 +87,48 @@ struct Process *PROC_create_kthread(kproc_t entry_point, void *arg) {
 }
 
 // Invokes the scheduler and passes control to the next eligible thread
-uint64_t yield_sys_call(uint64_t arg) {
+uint64_t yield_sys_call(uint64_t arg, uint64_t arg2, uint64_t arg3) {
     CLI;
     PROC_reschedule();
     STI;
     return 0;
 }
 
+// Closes a descheduled process's files, deallocates its stack and its context
+// Closing a file may block on I/O, so this runs in a kthread
+void PROC_free(process_t *proc) {
+    FD_close_all(proc);
+    MMU_free_stack(proc->stack_top);
+    kfree(proc);
+}
+
+// Frees exited processes, kexit_isr runs on the shared KEXIT stack and must not block
+static void reap_thread(void *arg) {
+    process_t *proc;
+
+    while (1) {
+        wait_event_interruptable(&reap_queue, zombies == NULL);
+
+        CLI;
+        proc = zombies;
+        zombies = proc->next;
+        STI;
+
+        PROC_free(proc);
+    }
+}
+
 // Exits and destroys the state of the caller thread
 void kexit_isr(uint8_t irq, uint32_t error_code, void *arg) {
-    // Deallocate the stack
-    MMU_free_stack(curr_proc->stack_top);
-
     // Deschedule the thread
     sched_remove(curr_proc);
 
-    // Deallocate the thread context
-    kfree(curr_proc);
+    // Hand it to the reaper, unless its ring's poller is still running one of its requests and frees it after
+    if (RING_release(curr_proc) == 1) {
+        curr_proc->next = zombies;
+        zombies = curr_proc;
+        PROC_unblock_all(&reap_queue);
+    }
 
     // Runs the scheduler to pick another process
     PROC_reschedule();
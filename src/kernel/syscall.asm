@@ -36,6 +36,24 @@ bits 64
     ret
 %endmacro
 
+; Moves up to three arguments from rdi, rsi and rdx along to make room for the sys call number
+%macro RET_SYSCALL_ARGS 1
+    push rdi
+    push rsi
+    push rdx
+    push rcx
+    mov rcx, rdx    ; third argument
+    mov rdx, rsi    ; second argument
+    mov rsi, rdi    ; first argument
+    mov rdi, %1     ; interrupt
+    int 206
+    pop rcx
+    pop rdx
+    pop rsi
+    pop rdi
+    ret
+%endmacro
+
 global kexit
 kexit:
     int 207
@@ -52,3 +70,47 @@ getc:
 global putc
 putc:
     VOID_SYSCALL_ARG 2
+
+global open
+open:
+    RET_SYSCALL_ARGS 3
+
+global read
+read:
+    RET_SYSCALL_ARGS 4
+
+global lseek
+lseek:
+    RET_SYSCALL_ARGS 5
+
+global close
+close:
+    RET_SYSCALL_ARGS 6
+
+global mmap
+mmap:
+    RET_SYSCALL_ARGS 7
+
+global sendfile
+sendfile:
+    RET_SYSCALL_ARGS 8
+
+global readv
+readv:
+    RET_SYSCALL_ARGS 9
+
+global writev
+writev:
+    RET_SYSCALL_ARGS 10
+
+global io_ring_setup
+io_ring_setup:
+    RET_SYSCALL_ARGS 11
+
+global io_ring_enter
+io_ring_enter:
+    RET_SYSCALL_ARGS 12
+
+global munmap
+munmap:
+    RET_SYSCALL_ARGS 13
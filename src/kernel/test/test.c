@@ -6,6 +6,15 @@
 #include "kmalloc.h"
 #include "snakes.h"
 #include "proc.h"
+#include "block.h"
+#include "registers.h"
+#include "vfs.h"
+#include "inode_cache.h"
+#include "string.h"
+
+#define BENCH_BLOCKS 2048
+#define BENCH_FILES 64
+#define BENCH_FILE_SIZE (16 * KB)
 
 void write_uniq(void *addr, size_t len) {
     uint8_t data = ((uint64_t)addr) & 0xFF;
@@ -62,4 +71,150 @@ void test_snakes() {
     setup_snakes(1);
     PROC_run();
     printk("Back to kmain!\n");
-}
\ No newline at end of file
+}
+
+// Reads BENCH_BLOCKS blocks one at a time, in order or scattered over the device
+// Returns the number of TSC cycles taken
+static uint64_t time_block_reads(block_dev_t *dev, bool sequential) {
+    uint8_t *buff = (uint8_t *)kmalloc(dev->blk_size);
+    uint64_t start, end, blk, seed = 1;
+    int i;
+
+    start = read_tsc();
+    for (i = 0; i < BENCH_BLOCKS; i++) {
+        if (sequential) {
+            blk = i % dev->tot_len;
+        } else {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            blk = (seed >> 33) % dev->tot_len;
+        }
+        dev->read_block(dev, blk, buff);
+    }
+    end = read_tsc();
+
+    kfree(buff);
+    return end - start;
+}
+
+static void bench_block_dev(const char *name) {
+    block_dev_t *dev = BLK_get(name);
+    uint64_t seq, rand, kb;
+
+    if (dev == NULL) {
+        printk("%s: not present\n", name);
+        return;
+    }
+
+    kb = BENCH_BLOCKS * dev->blk_size / KB;
+    seq = time_block_reads(dev, true);
+    rand = time_block_reads(dev, false);
+
+    printk("%s: sequential %lu cycles/block (%lu KB/Mcycle), random %lu cycles/block (%lu KB/Mcycle)\n",
+        name, seq / BENCH_BLOCKS, kb * 1000000 / seq, rand / BENCH_BLOCKS, kb * 1000000 / rand);
+}
+
+// Compares single block read throughput of the emulated IDE and paravirtualized disks
+void test_block_throughput() {
+    bench_block_dev("sda");
+    bench_block_dev("vda");
+}
+
+static void bench_path(char *path, int n) {
+    memcpy(path, "bench", 5);
+    path[5] = '0' + n / 10 % 10;
+    path[6] = '0' + n % 10;
+    path[7] = 0;
+}
+
+// Writes or reads back a whole benchmark file
+static bool bench_file_io(inode_t *dir, char *path, char *buff, bool write) {
+    inode_t *inode = FS_inode_for_path(path, dir);
+    file_t *file;
+    int len;
+
+    if (inode == NULL) return false;
+    file = inode->open(inode);
+    IC_put(inode);
+
+    if (write) {
+        len = (file->write != NULL) ? file->write(file, buff, BENCH_FILE_SIZE) : -1;
+    } else {
+        memset(buff, 0, BENCH_FILE_SIZE);
+        len = file->read(file, buff, BENCH_FILE_SIZE);
+    }
+    file->close(&file);
+
+    return len == BENCH_FILE_SIZE && (write || check_uniq(buff, BENCH_FILE_SIZE));
+}
+
+// Times creating, writing, reading back and unlinking BENCH_FILES files in a directory
+// Writes include syncing the filesystem, so disk backed ones pay for getting the data out
+static void bench_fs(char *dir_path) {
+    inode_t *dir = FS_inode_for_path(dir_path, FS_root()), *inode;
+    superblock_t *sb;
+    char path[8], *buff;
+    uint64_t t[5], kb = BENCH_FILES * BENCH_FILE_SIZE / KB;
+    int i;
+
+    if (dir == NULL || dir->create == NULL) {
+        printk("%s: not a writable directory\n", dir_path);
+        if (dir != NULL) IC_put(dir);
+        return;
+    }
+    sb = dir->parent_superblock;
+    buff = (char *)kmalloc(BENCH_FILE_SIZE);
+
+    t[0] = read_tsc();
+    for (i = 0; i < BENCH_FILES; i++) {
+        bench_path(path, i);
+        if ((inode = FS_create(path, dir, S_IFREG)) == NULL) break;
+        IC_put(inode);
+    }
+
+    t[1] = read_tsc();
+    for (i = 0; i < BENCH_FILES; i++) {
+        bench_path(path, i);
+        write_uniq(buff, BENCH_FILE_SIZE);
+        if (!bench_file_io(dir, path, buff, true)) break;
+    }
+    if (sb->sync_fs != NULL) sb->sync_fs(sb);
+
+    t[2] = read_tsc();
+    for (i = 0; i < BENCH_FILES; i++) {
+        bench_path(path, i);
+        if (!bench_file_io(dir, path, buff, false)) {
+            printk("%s: failed to read back %s\n", dir_path, path);
+            break;
+        }
+    }
+
+    t[3] = read_tsc();
+    for (i = 0; i < BENCH_FILES; i++) {
+        bench_path(path, i);
+        FS_unlink(path, dir);
+    }
+    if (sb->sync_fs != NULL) sb->sync_fs(sb);
+    t[4] = read_tsc();
+
+    printk("%s (%s): create %lu, write %lu, read %lu, unlink %lu cycles/file\n", dir_path, sb->type,
+        (t[1] - t[0]) / BENCH_FILES, (t[2] - t[1]) / BENCH_FILES, (t[3] - t[2]) / BENCH_FILES,
+        (t[4] - t[3]) / BENCH_FILES);
+    printk("%s (%s): write %lu KB/Mcycle, read %lu KB/Mcycle\n", dir_path, sb->type,
+        kb * 1000000 / (t[2] - t[1]), kb * 1000000 / (t[3] - t[2]));
+
+    kfree(buff);
+    IC_put(dir);
+}
+
+// Compares file operation throughput of the in-memory /tmp and the first FAT32 partition
+// The root is the initramfs, disks are mounted under /mnt
+void test_fs_throughput() {
+    char *fat_path = FS_mount_path("FAT32");
+
+    bench_fs("/tmp");
+    if (fat_path != NULL) {
+        bench_fs(fat_path);
+    } else {
+        printk("No FAT32 filesystem is mounted\n");
+    }
+}